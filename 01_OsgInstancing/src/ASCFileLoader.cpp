@@ -22,34 +22,707 @@
 */
 
 #include "ASCFileLoader.h"
+#include "MemoryMappedFile.h"
+#include "HeightMapSampler.h"
 
 // std
 #include <iostream>
+#include <sstream>
+#include <locale>
+#include <vector>
+#include <thread>
+#include <algorithm>
 #include <osgDB/fstream>
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <clocale>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace
+{
+
+const char			CACHE_MAGIC[4] = { 'H', 'M', 'A', 'P' };
+const unsigned int	CACHE_VERSION = 2u;
+const unsigned int	CACHE_BYTE_ORDER = 0x01020304u;
+
+// bytes at the start and at the end of the source file that are hashed to detect changes the file time misses
+const size_t		SOURCE_HASH_BYTES = 4096u;
+
+// header of the binary height map cache, the float32 rows follow directly after it
+struct CacheHeader
+{
+	char				magic[4];
+	unsigned int		version;
+	unsigned int		byteOrder;
+	unsigned int		width;
+	unsigned int		height;
+	float				minHeight;
+	float				maxHeight;
+	unsigned int		reserved;
+	unsigned long long	sourceSize;
+	long long			sourceModificationTime;		// in nanoseconds
+	unsigned long long	sourceHash;
+	char				padding[8];
+};
+
+// a 64 byte header keeps the mapped samples aligned for SIMD access
+static_assert(sizeof(CacheHeader) == 64, "height map cache header has to be 64 bytes");
+
+// fnv-1a hash of the first and the last bytes of the file
+bool getSourceHash(const std::string& fileName, unsigned long long size, unsigned long long& hash)
+{
+	std::ifstream stream(fileName.c_str(), std::ios::in | std::ios::binary);
+	if (!stream.is_open())
+		return false;
+
+	char buffer[2 * SOURCE_HASH_BYTES];
+	size_t headSize = (size_t)std::min(size, (unsigned long long)SOURCE_HASH_BYTES);
+	size_t tailSize = (size_t)std::min(size - headSize, (unsigned long long)SOURCE_HASH_BYTES);
+	stream.read(buffer, headSize);
+	stream.seekg((std::streamoff)(size - tailSize));
+	stream.read(buffer + headSize, tailSize);
+	if (stream.fail())
+		return false;
+
+	hash = 14695981039346656037ull;
+	for (size_t i = 0; i < headSize + tailSize; ++i)
+	{
+		hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ull;
+	}
+	return true;
+}
+
+// size, modification time with sub-second precision where the platform has it and hash of the file
+bool getFileInfo(const std::string& fileName, unsigned long long& size, long long& modificationTime, unsigned long long& hash)
+{
+	struct stat fileStat;
+	if (stat(fileName.c_str(), &fileStat) != 0)
+		return false;
+
+	size = (unsigned long long)fileStat.st_size;
+#if defined(__APPLE__)
+	modificationTime = (long long)fileStat.st_mtimespec.tv_sec * 1000000000ll + fileStat.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	// only whole seconds, the hash has to catch the rest
+	modificationTime = (long long)fileStat.st_mtime * 1000000000ll;
+#else
+	modificationTime = (long long)fileStat.st_mtim.tv_sec * 1000000000ll + fileStat.st_mtim.tv_nsec;
+#endif
+	return getSourceHash(fileName, size, hash);
+}
+
+// checks if a cache file belongs to the current version of the source file
+bool isValidCache(const CacheHeader& header, size_t cacheSize, const std::string& sourceFileName)
+{
+	unsigned long long sourceSize = 0u;
+	long long sourceModificationTime = 0;
+	unsigned long long sourceHash = 0u;
+	if (!getFileInfo(sourceFileName, sourceSize, sourceModificationTime, sourceHash))
+		return false;
+
+	size_t numSamples = (size_t)header.width * (size_t)header.height;
+	return numSamples &&
+		   memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+		   header.version == CACHE_VERSION &&
+		   header.byteOrder == CACHE_BYTE_ORDER &&
+		   header.sourceSize == sourceSize &&
+		   header.sourceModificationTime == sourceModificationTime &&
+		   header.sourceHash == sourceHash &&
+		   cacheSize >= sizeof(CacheHeader) + numSamples * sizeof(float);
+}
+
+// every thread should at least get this many bytes to parse, otherwise spawning it costs more than it saves
+const size_t MIN_BYTES_PER_THREAD = 256u * 1024u;
+
+// bytes of the source file every thread parses at once, when the samples are streamed into the cache
+const size_t STREAM_BYTES_PER_THREAD = 4u * 1024u * 1024u;
+
+// samples the stream loader buffers, before they are appended to the cache
+const size_t STREAM_BUFFER_SAMPLES = 1024u * 1024u;
+
+// samples of the tiled backend that are fetched under one lock of its tile cache
+const size_t TILED_BATCH_SIZE = 256u;
+
+/**
+ Writes a height map cache incrementally, so that the samples never have to be resident at once.
+ The header is written last, because the height range is only known after the final sample.
+*/
+class CacheWriter
+{
+public:
+	CacheWriter(const std::string& cacheFileName)
+		:	m_cacheFileName(cacheFileName),
+			m_tempFileName(cacheFileName + ".tmp"),
+			m_numSamples(0u),
+			m_minHeight(0.0f),
+			m_maxHeight(0.0f)
+	{
+		// write to a temporary file first, so a crash never leaves a truncated cache behind
+		m_stream.open(m_tempFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+		// reserve space for the header
+		CacheHeader header;
+		memset(&header, 0, sizeof(header));
+		m_stream.write((const char*)&header, sizeof(header));
+	}
+
+	~CacheWriter()
+	{
+		// an unfinished cache is discarded
+		if (m_stream.is_open())
+		{
+			m_stream.close();
+			remove(m_tempFileName.c_str());
+		}
+	}
+
+	void append(const float* samples, size_t count)
+	{
+		if (!count)
+			return;
+
+		const float* end = samples + count;
+		float minHeight = *std::min_element(samples, end);
+		float maxHeight = *std::max_element(samples, end);
+		m_minHeight = m_numSamples ? std::min(m_minHeight, minHeight) : minHeight;
+		m_maxHeight = m_numSamples ? std::max(m_maxHeight, maxHeight) : maxHeight;
+		m_numSamples += count;
+
+		m_stream.write((const char*)samples, count * sizeof(float));
+	}
+
+	// pads missing samples with zero, like the parsers do for short files
+	void fill(size_t numSamples)
+	{
+		std::vector<float> zeros(std::min(numSamples, STREAM_BUFFER_SAMPLES), 0.0f);
+		while (numSamples)
+		{
+			size_t count = std::min(numSamples, zeros.size());
+			append(&zeros[0], count);
+			numSamples -= count;
+		}
+	}
+
+	bool finish(const std::string& sourceFileName, unsigned int width, unsigned int height)
+	{
+		CacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+		header.version = CACHE_VERSION;
+		header.byteOrder = CACHE_BYTE_ORDER;
+		header.width = width;
+		header.height = height;
+		header.minHeight = m_minHeight;
+		header.maxHeight = m_maxHeight;
+
+		if (m_numSamples != (size_t)width * (size_t)height || !getFileInfo(sourceFileName, header.sourceSize, header.sourceModificationTime, header.sourceHash))
+			return false;
+
+		m_stream.seekp(0);
+		m_stream.write((const char*)&header, sizeof(header));
+		m_stream.close();
+
+		if (m_stream.fail())
+		{
+			std::cout << "Warning: could not write height map cache: " << m_cacheFileName << std::endl;
+			remove(m_tempFileName.c_str());
+			return false;
+		}
+
+		remove(m_cacheFileName.c_str());
+		if (rename(m_tempFileName.c_str(), m_cacheFileName.c_str()) != 0)
+		{
+			std::cout << "Warning: could not write height map cache: " << m_cacheFileName << std::endl;
+			remove(m_tempFileName.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	inline float getMinHeight() const { return m_minHeight; }
+	inline float getMaxHeight() const { return m_maxHeight; }
+
+private:
+	std::string		m_cacheFileName;
+	std::string		m_tempFileName;
+	std::ofstream	m_stream;
+	size_t			m_numSamples;
+	float			m_minHeight;
+	float			m_maxHeight;
+};
+
+inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+inline const char* skipSpaces(const char* it, const char* end)
+{
+	while (it != end && isSpace(*it))
+		++it;
+	return it;
+}
+
+inline const char* skipToken(const char* it, const char* end)
+{
+	while (it != end && !isSpace(*it))
+		++it;
+	return it;
+}
+
+// slow path for tokens the fast path can't convert exactly, uses the same conversion as the stream loader
+float parseFloatSlow(const char* begin, const char* end)
+{
+	// strtof is what std::num_get uses under the hood, but it depends on the C locale's decimal point
+	char buffer[64];
+	size_t length = end - begin;
+	if (length < sizeof(buffer) && *localeconv()->decimal_point == '.')
+	{
+		memcpy(buffer, begin, length);
+		buffer[length] = '\0';
+
+		char* parsedEnd = NULL;
+		float value = strtof(buffer, &parsedEnd);
+		return (parsedEnd == buffer) ? 0.0f : value;
+	}
+
+	std::istringstream stream(std::string(begin, end));
+	stream.imbue(std::locale::classic());
+	float value = 0.0f;
+	stream >> value;
+	return stream.fail() ? 0.0f : value;
+}
+
+// parses a single whitespace delimited float, the result is bit-identical to std::istream >> float
+float parseFloat(const char* begin, const char* end)
+{
+	// exact powers of ten in single precision
+	static const float powersOfTen[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+	const char* it = begin;
+	bool negative = false;
+	if (it != end && (*it == '-' || *it == '+'))
+	{
+		negative = (*it == '-');
+		++it;
+	}
+
+	unsigned long long mantissa = 0u;
+	int numDigits = 0;
+	int exponent = 0;
+	bool hasDigits = false;
+
+	// skip leading zeros, they don't count against the precision of the mantissa
+	while (it != end && *it == '0') { ++it; hasDigits = true; }
+	while (it != end && *it >= '0' && *it <= '9')
+	{
+		if (numDigits < 19) { mantissa = mantissa * 10u + (*it - '0'); ++numDigits; }
+		else				{ ++exponent; }
+		++it;
+		hasDigits = true;
+	}
+
+	if (it != end && *it == '.')
+	{
+		++it;
+		if (!mantissa)
+		{
+			while (it != end && *it == '0') { ++it; --exponent; hasDigits = true; }
+		}
+		while (it != end && *it >= '0' && *it <= '9')
+		{
+			if (numDigits < 19) { mantissa = mantissa * 10u + (*it - '0'); ++numDigits; --exponent; }
+			++it;
+			hasDigits = true;
+		}
+	}
+
+	if (hasDigits && it != end && (*it == 'e' || *it == 'E'))
+	{
+		++it;
+		bool negativeExponent = false;
+		if (it != end && (*it == '-' || *it == '+'))
+		{
+			negativeExponent = (*it == '-');
+			++it;
+		}
+
+		int explicitExponent = 0;
+		while (it != end && *it >= '0' && *it <= '9')
+		{
+			if (explicitExponent < 10000)
+				explicitExponent = explicitExponent * 10 + (*it - '0');
+			++it;
+		}
+		exponent += negativeExponent ? -explicitExponent : explicitExponent;
+	}
+
+	// anything we didn't fully understand goes through the stream conversion
+	if (!hasDigits || it != end)
+		return parseFloatSlow(begin, end);
+
+	if (!mantissa)
+		return negative ? -0.0f : 0.0f;
+
+	// mantissa and power of ten are exactly representable, so a single multiplication or division rounds correctly
+	if (mantissa <= (1u << 24) && exponent >= -10 && exponent <= 10)
+	{
+		float value = (float)mantissa;
+		value = (exponent < 0) ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+		return negative ? -value : value;
+	}
+
+	return parseFloatSlow(begin, end);
+}
+
+size_t countTokens(const char* begin, const char* end)
+{
+	size_t numTokens = 0u;
+	const char* it = skipSpaces(begin, end);
+	while (it != end)
+	{
+		it = skipSpaces(skipToken(it, end), end);
+		++numTokens;
+	}
+	return numTokens;
+}
+
+void parseTokens(const char* begin, const char* end, float* output, size_t maxTokens)
+{
+	const char* it = skipSpaces(begin, end);
+	for (size_t i = 0; i < maxTokens && it != end; ++i)
+	{
+		const char* tokenEnd = skipToken(it, end);
+		output[i] = parseFloat(it, tokenEnd);
+		it = skipSpaces(tokenEnd, end);
+	}
+}
+
+template<class Function> void parallelFor(size_t numTasks, Function function)
+{
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numTasks; ++i)
+	{
+		threads.push_back(std::thread(function, i));
+	}
+
+	// the calling thread takes the first task
+	if (numTasks)
+		function(0u);
+
+	for (auto it = threads.begin(); it != threads.end(); ++it)
+	{
+		it->join();
+	}
+}
+
+// parses width and height from the start of the file and returns the position after them
+const char* parseDimensions(const char* begin, const char* end, unsigned int& width, unsigned int& height)
+{
+	const char* it = skipSpaces(begin, end);
+	const char* tokenEnd = skipToken(it, end);
+	width = (unsigned int)std::max(0.0f, parseFloat(it, tokenEnd));
+	it = skipSpaces(tokenEnd, end);
+	tokenEnd = skipToken(it, end);
+	height = (unsigned int)std::max(0.0f, parseFloat(it, tokenEnd));
+	return tokenEnd;
+}
+
+/**
+ Splits [begin, end) into numThreads ranges that start and end at a newline and counts their samples.
+ rangeOffset[i] is the index of the first sample of range i, rangeOffset[numThreads] the total number of samples.
+*/
+void splitSamples(const char* begin, const char* end, size_t numThreads, std::vector<const char*>& rangeBegin, std::vector<size_t>& rangeOffset)
+{
+	rangeBegin.assign(numThreads + 1, end);
+	rangeBegin[0] = begin;
+	for (size_t i = 1; i < numThreads; ++i)
+	{
+		const char* split = std::max(rangeBegin[i-1], begin + (end - begin) * i / numThreads);
+		const char* newline = (const char*)memchr(split, '\n', end - split);
+		rangeBegin[i] = newline ? newline + 1 : end;
+	}
+
+	// first pass counts the samples per range, so that every range knows where its output starts
+	rangeOffset.assign(numThreads + 1, 0u);
+	parallelFor(numThreads, [&](size_t i)
+	{
+		rangeOffset[i+1] = countTokens(rangeBegin[i], rangeBegin[i+1]);
+	});
+
+	for (size_t i = 0; i < numThreads; ++i)
+	{
+		rangeOffset[i+1] += rangeOffset[i];
+	}
+}
+
+// second pass converts the samples of the ranges in place, samples behind maxSamples are ignored
+void parseSamples(const std::vector<const char*>& rangeBegin, const std::vector<size_t>& rangeOffset, float* output, size_t maxSamples)
+{
+	size_t numThreads = rangeBegin.size() - 1u;
+	parallelFor(numThreads, [&](size_t i)
+	{
+		if (rangeOffset[i] < maxSamples)
+		{
+			parseTokens(rangeBegin[i], rangeBegin[i+1], output + rangeOffset[i], maxSamples - rangeOffset[i]);
+		}
+	});
+}
+
+size_t getNumParseThreads(size_t numBytes)
+{
+	size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+	return std::max((size_t)1u, std::min(numThreads, numBytes / MIN_BYTES_PER_THREAD));
+}
+
+}
 
 namespace osgExample
 {
 
 ASCFileLoader::ASCFileLoader()
 	:	m_heightMap(NULL),
+	m_heights(NULL),
 	m_width(0u),
-	m_height(0u)
+	m_height(0u),
+	m_minHeight(0.0f),
+	m_maxHeight(0.0f),
+	m_tileMemoryBudget(0u),
+	m_useCache(true)
 {
 }
 
 ASCFileLoader::~ASCFileLoader()
+{
+	releaseHeightMap();
+}
+
+std::string ASCFileLoader::getCacheFileName(const std::string& fileName)
+{
+	return fileName + ".cache";
+}
+
+void ASCFileLoader::loadFromFile(const std::string& fileName, LoadMode mode)
+{
+	releaseHeightMap();
+
+	// a valid cache is paged or mapped directly, no parsing and no copy necessary
+	if (m_tileMemoryBudget && loadTiledFromCache(fileName))
+		return;
+	if (!m_tileMemoryBudget && m_useCache && loadFromCache(fileName))
+		return;
+
+	// with a tile budget the samples are streamed from the source into the cache and paged from there, the grid is never resident
+	if (m_tileMemoryBudget)
+	{
+		bool cached = (mode == PARALLEL_LOAD) ? streamMappedFileToCache(fileName) : streamFileToCache(fileName);
+		if (cached && loadTiledFromCache(fileName))
+			return;
+	}
+
+	switch (mode)
+	{
+	case PARALLEL_LOAD:
+		loadFromMappedFile(fileName);
+		break;
+	case STREAM_LOAD:
+	default:
+		loadFromStream(fileName);
+		break;
+	}
+
+	if (!m_heightMap)
+		return;
+
+	m_heights = m_heightMap;
+
+	// compute height range
+	const float* end = m_heightMap + (size_t)m_width * (size_t)m_height;
+	m_minHeight = *std::min_element((const float*)m_heightMap, end);
+	m_maxHeight = *std::max_element((const float*)m_heightMap, end);
+
+	if (m_tileMemoryBudget)
+		std::cout << "Warning: could not page height map from cache, keeping it resident: " << getCacheFileName(fileName) << std::endl;
+	else if (m_useCache)
+		writeCache(fileName);
+}
+
+void ASCFileLoader::releaseHeightMap()
 {
 	if (m_heightMap)
 		delete[] m_heightMap;
+
+	m_cacheFile.close();
+	m_tiledHeightMap.close();
+	m_heightMap = NULL;
+	m_heights = NULL;
+	m_minHeight = 0.0f;
+	m_maxHeight = 0.0f;
 }
 
-void ASCFileLoader::loadFromFile(const std::string& fileName)
+bool ASCFileLoader::loadFromCache(const std::string& fileName)
+{
+	if (!m_cacheFile.open(getCacheFileName(fileName)))
+		return false;
+
+	// make sure the cache matches our format and the current version of the source file
+	const CacheHeader* header = (const CacheHeader*)m_cacheFile.getData();
+	if (m_cacheFile.getSize() < sizeof(CacheHeader) || !isValidCache(*header, m_cacheFile.getSize(), fileName))
+	{
+		m_cacheFile.close();
+		return false;
+	}
+
+	m_width = header->width;
+	m_height = header->height;
+	m_minHeight = header->minHeight;
+	m_maxHeight = header->maxHeight;
+	m_heights = (const float*)(m_cacheFile.getData() + sizeof(CacheHeader));
+
+	return true;
+}
+
+bool ASCFileLoader::loadTiledFromCache(const std::string& fileName)
+{
+	std::string cacheFileName = getCacheFileName(fileName);
+	std::ifstream cacheStream(cacheFileName.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+	if (!cacheStream.is_open())
+		return false;
+
+	// only read the header, the samples are paged in by the tiled height map
+	CacheHeader header;
+	size_t cacheSize = (size_t)cacheStream.tellg();
+	cacheStream.seekg(0);
+	cacheStream.read((char*)&header, sizeof(header));
+	if (cacheStream.fail() || !isValidCache(header, cacheSize, fileName))
+		return false;
+	cacheStream.close();
+
+	m_tiledHeightMap.setMemoryBudget(m_tileMemoryBudget);
+	if (!m_tiledHeightMap.open(cacheFileName, sizeof(CacheHeader), header.width, header.height))
+		return false;
+
+	m_width = header.width;
+	m_height = header.height;
+	m_minHeight = header.minHeight;
+	m_maxHeight = header.maxHeight;
+
+	return true;
+}
+
+void ASCFileLoader::writeCache(const std::string& fileName) const
+{
+	CacheWriter writer(getCacheFileName(fileName));
+	writer.append(m_heightMap, (size_t)m_width * (size_t)m_height);
+	writer.finish(fileName, m_width, m_height);
+}
+
+bool ASCFileLoader::streamFileToCache(const std::string& fileName)
+{
+	std::ifstream fileStream(fileName.c_str(), std::ios::in);
+	if (!fileStream.is_open())
+	{
+		std::cout << "Error could not load file: " << fileName << std::endl;
+		return false;
+	}
+
+	// first we try to parse width and height
+	unsigned int width = 0u;
+	unsigned int height = 0u;
+	fileStream >> width >> height;
+
+	// make sure we have a valid file
+	if (!width || !height)
+		return false;
+
+	// parse the samples in blocks and append every block to the cache
+	CacheWriter writer(getCacheFileName(fileName));
+	const size_t numSamples = (size_t)width * (size_t)height;
+	std::vector<float> samples(std::min(numSamples, STREAM_BUFFER_SAMPLES));
+	size_t numParsed = 0u;
+	while (numParsed < numSamples)
+	{
+		size_t count = std::min(numSamples - numParsed, samples.size());
+		for (size_t i = 0; i < count; ++i)
+		{
+			fileStream >> samples[i];
+		}
+		writer.append(&samples[0], count);
+		numParsed += count;
+	}
+
+	return writer.finish(fileName, width, height);
+}
+
+bool ASCFileLoader::streamMappedFileToCache(const std::string& fileName)
+{
+	MemoryMappedFile file;
+	if (!file.open(fileName))
+	{
+		std::cout << "Error could not load file: " << fileName << std::endl;
+		return false;
+	}
+
+	const char* end = file.getData() + file.getSize();
+
+	// first we try to parse width and height
+	unsigned int width = 0u;
+	unsigned int height = 0u;
+	const char* it = parseDimensions(file.getData(), end, width, height);
+
+	// make sure we have a valid file
+	if (!width || !height)
+		return false;
+
+	// parse a window of whole lines at a time on all cores, so only the window's samples are resident
+	CacheWriter writer(getCacheFileName(fileName));
+	const size_t numSamples = (size_t)width * (size_t)height;
+	const size_t windowBytes = std::max(1u, std::thread::hardware_concurrency()) * STREAM_BYTES_PER_THREAD;
+	std::vector<const char*> rangeBegin;
+	std::vector<size_t> rangeOffset;
+	std::vector<float> samples;
+	size_t numParsed = 0u;
+	while (it != end && numParsed < numSamples)
+	{
+		const char* windowEnd = end;
+		if ((size_t)(end - it) > windowBytes)
+		{
+			const char* newline = (const char*)memchr(it + windowBytes, '\n', end - (it + windowBytes));
+			windowEnd = newline ? newline + 1 : end;
+		}
+
+		splitSamples(it, windowEnd, getNumParseThreads(windowEnd - it), rangeBegin, rangeOffset);
+		size_t count = std::min(rangeOffset.back(), numSamples - numParsed);
+		if (count)
+		{
+			samples.resize(count);
+			parseSamples(rangeBegin, rangeOffset, &samples[0], count);
+			writer.append(&samples[0], count);
+			numParsed += count;
+		}
+
+		it = windowEnd;
+	}
+
+	if (numParsed < numSamples)
+	{
+		std::cout << "Warning: " << fileName << " contains only " << numParsed << " of " << numSamples << " samples" << std::endl;
+		writer.fill(numSamples - numParsed);
+	}
+
+	return writer.finish(fileName, width, height);
+}
+
+void ASCFileLoader::loadFromStream(const std::string& fileName)
 {
 	std::ifstream fileStream;
 	try
 	{
-		fileStream.open(fileName, std::ios::in);
+        fileStream.open(fileName.c_str(), std::ios::in);
 
 		// first we try to parse width and height
 		m_width = 0u;
@@ -82,10 +755,52 @@ void ASCFileLoader::loadFromFile(const std::string& fileName)
 	fileStream.close();
 }
 
+void ASCFileLoader::loadFromMappedFile(const std::string& fileName)
+{
+	MemoryMappedFile file;
+	if (!file.open(fileName))
+	{
+		std::cout << "Error could not load file: " << fileName << std::endl;
+		return;
+	}
+
+	const char* begin = file.getData();
+	const char* end = begin + file.getSize();
+
+	// first we try to parse width and height
+	m_width = 0u;
+	m_height = 0u;
+	const char* it = parseDimensions(begin, end, m_width, m_height);
+
+	// make sure we have a valid file
+	if (!m_width || !m_height)
+		return;
+
+	// delete old heightmap and create new one
+	if (m_heightMap)
+		delete[] m_heightMap;
+
+	const size_t numSamples = (size_t)m_width * (size_t)m_height;
+	m_heightMap = new float[numSamples];
+
+	// split the samples into ranges that start and end at a newline, surplus samples at the end of the file are ignored like in the stream path
+	std::vector<const char*> rangeBegin;
+	std::vector<size_t> rangeOffset;
+	splitSamples(it, end, getNumParseThreads(end - it), rangeBegin, rangeOffset);
+	parseSamples(rangeBegin, rangeOffset, m_heightMap, numSamples);
+
+	size_t numParsed = rangeOffset.back();
+	if (numParsed < numSamples)
+	{
+		std::cout << "Warning: " << fileName << " contains only " << numParsed << " of " << numSamples << " samples" << std::endl;
+		std::fill(m_heightMap + numParsed, m_heightMap + numSamples, 0.0f);
+	}
+}
+
 float ASCFileLoader::getNearestHeight(float x, float y) const
 {
 	// make sure we have a loaded file
-	if (!m_heightMap)
+	if (!m_heights && !m_tiledHeightMap.isOpen())
 		return 0.0f;
 	
 	// get nearest sample coordinate and clamp it to [0-width],[0-height]
@@ -94,7 +809,105 @@ float ASCFileLoader::getNearestHeight(float x, float y) const
 	nearestX = std::max(std::min(nearestX, (int)m_width-1), 0);
 	nearestY = std::max(std::min(nearestY, (int)m_height-1), 0);
 
-	return m_heightMap[nearestX+nearestY*m_width];
+	if (!m_heights)
+		return m_tiledHeightMap.getHeight(nearestX, nearestY);
+
+	return m_heights[nearestX+nearestY*m_width];
+}
+
+float ASCFileLoader::getBilinearHeight(float x, float y) const
+{
+	float height = 0.0f;
+	getBilinearHeights(&x, &y, &height, 1u);
+	return height;
 }
 
+void ASCFileLoader::getNearestHeights(const float* x, const float* y, float* heights, size_t count) const
+{
+	if (m_heights)
+	{
+		sampleNearestHeights(m_heights, m_width, m_height, x, y, heights, count);
+		return;
+	}
+
+	if (!m_tiledHeightMap.isOpen())
+	{
+		std::fill(heights, heights + count, 0.0f);
+		return;
+	}
+
+	// the tiled backend is sampled in batches, so concurrent callers take its lock once per batch instead of once per sample
+	unsigned int sampleX[TILED_BATCH_SIZE];
+	unsigned int sampleY[TILED_BATCH_SIZE];
+	for (size_t start = 0; start < count; start += TILED_BATCH_SIZE)
+	{
+		size_t batchSize = std::min(count - start, TILED_BATCH_SIZE);
+		for (size_t i = 0; i < batchSize; ++i)
+		{
+			// get nearest sample coordinate and clamp it to [0-width],[0-height]
+			int nearestX = (int)floor(x[start + i] + 0.5f);
+			int nearestY = (int)floor(y[start + i] + 0.5f);
+			sampleX[i] = (unsigned int)std::max(std::min(nearestX, (int)m_width-1), 0);
+			sampleY[i] = (unsigned int)std::max(std::min(nearestY, (int)m_height-1), 0);
+		}
+		m_tiledHeightMap.getHeights(sampleX, sampleY, heights + start, batchSize);
+	}
 }
+
+void ASCFileLoader::getBilinearHeights(const float* x, const float* y, float* heights, size_t count) const
+{
+	if (m_heights)
+	{
+		sampleBilinearHeights(m_heights, m_width, m_height, x, y, heights, count);
+		return;
+	}
+
+	if (!m_tiledHeightMap.isOpen())
+	{
+		std::fill(heights, heights + count, 0.0f);
+		return;
+	}
+
+	// the four corners of every sample of a batch are fetched with one call, neighbouring samples mostly share their tile
+	unsigned int cornerX[4 * TILED_BATCH_SIZE];
+	unsigned int cornerY[4 * TILED_BATCH_SIZE];
+	float cornerHeights[4 * TILED_BATCH_SIZE];
+	float weightX[TILED_BATCH_SIZE];
+	float weightY[TILED_BATCH_SIZE];
+	for (size_t start = 0; start < count; start += TILED_BATCH_SIZE)
+	{
+		size_t batchSize = std::min(count - start, TILED_BATCH_SIZE);
+		for (size_t i = 0; i < batchSize; ++i)
+		{
+			// same filter as the vector kernels, but every corner comes from the tile cache
+			float clampedX = std::min(std::max(x[start + i], 0.0f), (float)(m_width - 1u));
+			float clampedY = std::min(std::max(y[start + i], 0.0f), (float)(m_height - 1u));
+			unsigned int x0 = (unsigned int)clampedX;
+			unsigned int y0 = (unsigned int)clampedY;
+			unsigned int x1 = std::min(x0 + 1u, m_width - 1u);
+			unsigned int y1 = std::min(y0 + 1u, m_height - 1u);
+			weightX[i] = clampedX - (float)x0;
+			weightY[i] = clampedY - (float)y0;
+
+			cornerX[4 * i + 0] = x0; cornerY[4 * i + 0] = y0;
+			cornerX[4 * i + 1] = x1; cornerY[4 * i + 1] = y0;
+			cornerX[4 * i + 2] = x0; cornerY[4 * i + 2] = y1;
+			cornerX[4 * i + 3] = x1; cornerY[4 * i + 3] = y1;
+		}
+		m_tiledHeightMap.getHeights(cornerX, cornerY, cornerHeights, 4 * batchSize);
+
+		for (size_t i = 0; i < batchSize; ++i)
+		{
+			float h00 = cornerHeights[4 * i + 0];
+			float h10 = cornerHeights[4 * i + 1];
+			float h01 = cornerHeights[4 * i + 2];
+			float h11 = cornerHeights[4 * i + 3];
+
+			float top = h00 + (h10 - h00) * weightX[i];
+			float bottom = h01 + (h11 - h01) * weightX[i];
+			heights[start + i] = top + (bottom - top) * weightY[i];
+		}
+	}
+}
+
+}
\ No newline at end of file
@@ -26,25 +26,76 @@
 
 #include <string>
 
+// osgExample
+#include "MemoryMappedFile.h"
+#include "TiledHeightMap.h"
+
 namespace osgExample
 {
 
 class ASCFileLoader
 {
 public:
+	enum LoadMode
+	{
+		STREAM_LOAD,		// parse the file with std::ifstream on the calling thread
+		PARALLEL_LOAD		// memory map the file and parse row ranges on all cores
+	};
+
 	ASCFileLoader();
 	~ASCFileLoader();
 
-	void loadFromFile(const std::string& fileName);
+	void loadFromFile(const std::string& fileName, LoadMode mode = PARALLEL_LOAD);
 	float getNearestHeight(float x, float y) const;
+	float getBilinearHeight(float x, float y) const;
+
+	// batched versions of the accessors above, vectorised with SSE2 or AVX2 if the height map is resident
+	void getNearestHeights(const float* x, const float* y, float* heights, size_t count) const;
+	void getBilinearHeights(const float* x, const float* y, float* heights, size_t count) const;
 
 	inline unsigned int getWidth() const { return m_width; }
 	inline unsigned int getHeight() const { return m_height; }
+	inline float getMinHeight() const { return m_minHeight; }
+	inline float getMaxHeight() const { return m_maxHeight; }
+	// returns NULL if the height map is paged in tiles
+	inline const float* getHeightMap() const { return m_heights; }
+
+	// if enabled a binary sidecar(<file>.cache) is written after parsing and mapped on the next load
+	inline void setUseCache(bool useCache) { m_useCache = useCache; }
+	inline bool getUseCache() const { return m_useCache; }
+	inline bool isLoadedFromCache() const { return m_cacheFile.isOpen(); }
+
+	// a budget greater than zero keeps only the most recently used tiles of the cache resident, takes effect on the next load
+	// without a valid cache the source is parsed straight into the cache, so the whole height map is never resident
+	inline void setTileMemoryBudget(size_t memoryBudget) { m_tileMemoryBudget = memoryBudget; }
+	inline size_t getTileMemoryBudget() const { return m_tileMemoryBudget; }
+	inline bool isTiled() const { return m_tiledHeightMap.isOpen(); }
+	inline const TiledHeightMap& getTiledHeightMap() const { return m_tiledHeightMap; }
+	inline TiledHeightMap& getTiledHeightMap() { return m_tiledHeightMap; }
+
+	static std::string getCacheFileName(const std::string& fileName);
 
 private:
-	float*			m_heightMap;
-	unsigned int	m_width;
-	unsigned int	m_height;
+	void loadFromStream(const std::string& fileName);
+	void loadFromMappedFile(const std::string& fileName);
+	bool loadFromCache(const std::string& fileName);
+	bool loadTiledFromCache(const std::string& fileName);
+	void writeCache(const std::string& fileName) const;
+	// parse the source straight into the cache without keeping the samples resident
+	bool streamFileToCache(const std::string& fileName);
+	bool streamMappedFileToCache(const std::string& fileName);
+	void releaseHeightMap();
+
+	float*				m_heightMap;
+	const float*		m_heights;
+	MemoryMappedFile	m_cacheFile;
+	TiledHeightMap		m_tiledHeightMap;
+	unsigned int		m_width;
+	unsigned int		m_height;
+	float				m_minHeight;
+	float				m_maxHeight;
+	size_t				m_tileMemoryBudget;
+	bool				m_useCache;
 };
 
 }
@@ -0,0 +1,243 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "HeightMapSampler.h"
+
+// std
+#include <algorithm>
+
+#if defined(__AVX2__)
+#define HEIGHT_MAP_SAMPLER_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEIGHT_MAP_SAMPLER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+inline float sampleNearest(const float* heightMap, unsigned int width, float maxX, float maxY, float x, float y)
+{
+	// clamping before the conversion gives the same result as clamping the rounded integer
+	size_t nearestX = (size_t)std::min(std::max(x + 0.5f, 0.0f), maxX);
+	size_t nearestY = (size_t)std::min(std::max(y + 0.5f, 0.0f), maxY);
+
+	return heightMap[nearestX + nearestY * width];
+}
+
+inline float sampleBilinear(const float* heightMap, unsigned int width, float maxX, float maxY, float x, float y)
+{
+	float clampedX = std::min(std::max(x, 0.0f), maxX);
+	float clampedY = std::min(std::max(y, 0.0f), maxY);
+	float floorX = (float)(size_t)clampedX;
+	float floorY = (float)(size_t)clampedY;
+	float tx = clampedX - floorX;
+	float ty = clampedY - floorY;
+
+	size_t x0 = (size_t)floorX;
+	size_t y0 = (size_t)floorY;
+	size_t x1 = (size_t)std::min(floorX + 1.0f, maxX);
+	size_t y1 = (size_t)std::min(floorY + 1.0f, maxY);
+
+	float h00 = heightMap[x0 + y0 * width];
+	float h10 = heightMap[x1 + y0 * width];
+	float h01 = heightMap[x0 + y1 * width];
+	float h11 = heightMap[x1 + y1 * width];
+
+	float top = h00 + (h10 - h00) * tx;
+	float bottom = h01 + (h11 - h01) * tx;
+	return top + (bottom - top) * ty;
+}
+
+// the vector kernels compute 32 bit sample indices
+inline bool fitsInt32Index(unsigned int width, unsigned int height)
+{
+	return (unsigned long long)width * (unsigned long long)height <= 0x7fffffffull;
+}
+
+}
+
+namespace osgExample
+{
+
+void sampleNearestHeights(const float* heightMap, unsigned int width, unsigned int height,
+						  const float* x, const float* y, float* heights, size_t count)
+{
+	const float maxX = (float)(width - 1u);
+	const float maxY = (float)(height - 1u);
+	size_t i = 0;
+
+	if (fitsInt32Index(width, height))
+	{
+#if defined(HEIGHT_MAP_SAMPLER_AVX2)
+		const __m256 half = _mm256_set1_ps(0.5f);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 vMaxX = _mm256_set1_ps(maxX);
+		const __m256 vMaxY = _mm256_set1_ps(maxY);
+		const __m256i vWidth = _mm256_set1_epi32((int)width);
+
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256 vx = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(x + i), half), zero), vMaxX);
+			__m256 vy = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(y + i), half), zero), vMaxY);
+			__m256i index = _mm256_add_epi32(_mm256_cvttps_epi32(vx), _mm256_mullo_epi32(_mm256_cvttps_epi32(vy), vWidth));
+			_mm256_storeu_ps(heights + i, _mm256_i32gather_ps(heightMap, index, 4));
+		}
+#elif defined(HEIGHT_MAP_SAMPLER_SSE2)
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 vMaxX = _mm_set1_ps(maxX);
+		const __m128 vMaxY = _mm_set1_ps(maxY);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 vx = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(x + i), half), zero), vMaxX);
+			__m128 vy = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(y + i), half), zero), vMaxY);
+			__m128i column = _mm_cvttps_epi32(vx);
+			__m128i row = _mm_cvttps_epi32(vy);
+
+			// SSE2 has neither a 32 bit multiply nor gather, so finish the index math and the loads in scalar code
+			int columns[4], rows[4];
+			_mm_storeu_si128((__m128i*)columns, column);
+			_mm_storeu_si128((__m128i*)rows, row);
+			_mm_storeu_ps(heights + i, _mm_setr_ps(heightMap[columns[0] + (size_t)rows[0] * width],
+												   heightMap[columns[1] + (size_t)rows[1] * width],
+												   heightMap[columns[2] + (size_t)rows[2] * width],
+												   heightMap[columns[3] + (size_t)rows[3] * width]));
+		}
+#endif
+	}
+
+	for (; i < count; ++i)
+	{
+		heights[i] = sampleNearest(heightMap, width, maxX, maxY, x[i], y[i]);
+	}
+}
+
+void sampleBilinearHeights(const float* heightMap, unsigned int width, unsigned int height,
+						   const float* x, const float* y, float* heights, size_t count)
+{
+	const float maxX = (float)(width - 1u);
+	const float maxY = (float)(height - 1u);
+	size_t i = 0;
+
+	if (fitsInt32Index(width, height))
+	{
+#if defined(HEIGHT_MAP_SAMPLER_AVX2)
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 vMaxX = _mm256_set1_ps(maxX);
+		const __m256 vMaxY = _mm256_set1_ps(maxY);
+		const __m256i vWidth = _mm256_set1_epi32((int)width);
+
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256 vx = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(x + i), zero), vMaxX);
+			__m256 vy = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(y + i), zero), vMaxY);
+			__m256i x0 = _mm256_cvttps_epi32(vx);
+			__m256i y0 = _mm256_cvttps_epi32(vy);
+			__m256 floorX = _mm256_cvtepi32_ps(x0);
+			__m256 floorY = _mm256_cvtepi32_ps(y0);
+			__m256 tx = _mm256_sub_ps(vx, floorX);
+			__m256 ty = _mm256_sub_ps(vy, floorY);
+			__m256i x1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(floorX, one), vMaxX));
+			__m256i y1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(floorY, one), vMaxY));
+
+			__m256i row0 = _mm256_mullo_epi32(y0, vWidth);
+			__m256i row1 = _mm256_mullo_epi32(y1, vWidth);
+			__m256 h00 = _mm256_i32gather_ps(heightMap, _mm256_add_epi32(x0, row0), 4);
+			__m256 h10 = _mm256_i32gather_ps(heightMap, _mm256_add_epi32(x1, row0), 4);
+			__m256 h01 = _mm256_i32gather_ps(heightMap, _mm256_add_epi32(x0, row1), 4);
+			__m256 h11 = _mm256_i32gather_ps(heightMap, _mm256_add_epi32(x1, row1), 4);
+
+			__m256 top = _mm256_add_ps(h00, _mm256_mul_ps(_mm256_sub_ps(h10, h00), tx));
+			__m256 bottom = _mm256_add_ps(h01, _mm256_mul_ps(_mm256_sub_ps(h11, h01), tx));
+			_mm256_storeu_ps(heights + i, _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), ty)));
+		}
+#elif defined(HEIGHT_MAP_SAMPLER_SSE2)
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 vMaxX = _mm_set1_ps(maxX);
+		const __m128 vMaxY = _mm_set1_ps(maxY);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 vx = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(x + i), zero), vMaxX);
+			__m128 vy = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(y + i), zero), vMaxY);
+			__m128i x0 = _mm_cvttps_epi32(vx);
+			__m128i y0 = _mm_cvttps_epi32(vy);
+			__m128 floorX = _mm_cvtepi32_ps(x0);
+			__m128 floorY = _mm_cvtepi32_ps(y0);
+			__m128 tx = _mm_sub_ps(vx, floorX);
+			__m128 ty = _mm_sub_ps(vy, floorY);
+			__m128i x1 = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(floorX, one), vMaxX));
+			__m128i y1 = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(floorY, one), vMaxY));
+
+			// SSE2 has no gather, so the four corner loads are done in scalar code
+			int columns0[4], columns1[4], rows0[4], rows1[4];
+			_mm_storeu_si128((__m128i*)columns0, x0);
+			_mm_storeu_si128((__m128i*)columns1, x1);
+			_mm_storeu_si128((__m128i*)rows0, y0);
+			_mm_storeu_si128((__m128i*)rows1, y1);
+
+			float corners[4][4];
+			for (int k = 0; k < 4; ++k)
+			{
+				const float* row0 = heightMap + (size_t)rows0[k] * width;
+				const float* row1 = heightMap + (size_t)rows1[k] * width;
+				corners[0][k] = row0[columns0[k]];
+				corners[1][k] = row0[columns1[k]];
+				corners[2][k] = row1[columns0[k]];
+				corners[3][k] = row1[columns1[k]];
+			}
+			__m128 h00 = _mm_loadu_ps(corners[0]);
+			__m128 h10 = _mm_loadu_ps(corners[1]);
+			__m128 h01 = _mm_loadu_ps(corners[2]);
+			__m128 h11 = _mm_loadu_ps(corners[3]);
+
+			__m128 top = _mm_add_ps(h00, _mm_mul_ps(_mm_sub_ps(h10, h00), tx));
+			__m128 bottom = _mm_add_ps(h01, _mm_mul_ps(_mm_sub_ps(h11, h01), tx));
+			_mm_storeu_ps(heights + i, _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), ty)));
+		}
+#endif
+	}
+
+	for (; i < count; ++i)
+	{
+		heights[i] = sampleBilinear(heightMap, width, maxX, maxY, x[i], y[i]);
+	}
+}
+
+const char* getHeightMapSamplerInstructionSet()
+{
+#if defined(HEIGHT_MAP_SAMPLER_AVX2)
+	return "AVX2";
+#elif defined(HEIGHT_MAP_SAMPLER_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+}
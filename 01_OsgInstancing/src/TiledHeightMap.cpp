@@ -0,0 +1,220 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "TiledHeightMap.h"
+
+// std
+#include <iostream>
+#include <algorithm>
+
+namespace osgExample
+{
+
+TiledHeightMap::TiledHeightMap(unsigned int tileSize, size_t memoryBudget)
+	:	m_maxTileSize(std::max(tileSize, 1u)),
+		m_tileSize(m_maxTileSize),
+		m_memoryBudget(memoryBudget),
+		m_dataOffset(0u),
+		m_width(0u),
+		m_height(0u),
+		m_numTilesX(0u)
+{
+	fitTileSize();
+}
+
+TiledHeightMap::~TiledHeightMap()
+{
+	close();
+}
+
+bool TiledHeightMap::open(const std::string& fileName, size_t dataOffset, unsigned int width, unsigned int height)
+{
+	close();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file.open(fileName.c_str(), std::ios::in | std::ios::binary);
+	if (!m_file.is_open() || !width || !height)
+	{
+		m_file.close();
+		return false;
+	}
+
+	m_dataOffset = dataOffset;
+	m_width = width;
+	m_height = height;
+	m_numTilesX = (width + m_tileSize - 1u) / m_tileSize;
+
+	return true;
+}
+
+void TiledHeightMap::close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_file.is_open())
+		m_file.close();
+
+	m_tiles.clear();
+	m_tileLookup.clear();
+	m_width = 0u;
+	m_height = 0u;
+	m_numTilesX = 0u;
+}
+
+float TiledHeightMap::getHeight(unsigned int x, unsigned int y) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const Tile& tile = fetchTile(x / m_tileSize, y / m_tileSize);
+
+	return tile.samples[(x % m_tileSize) + (y % m_tileSize) * m_tileSize];
+}
+
+void TiledHeightMap::getHeights(const unsigned int* x, const unsigned int* y, float* heights, size_t count) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const Tile* tile = NULL;
+	unsigned int tileX = 0u;
+	unsigned int tileY = 0u;
+	for (size_t i = 0; i < count; ++i)
+	{
+		// the lru list never moves its nodes, so the tile stays valid until the next fetch
+		if (!tile || x[i] / m_tileSize != tileX || y[i] / m_tileSize != tileY)
+		{
+			tileX = x[i] / m_tileSize;
+			tileY = y[i] / m_tileSize;
+			tile = &fetchTile(tileX, tileY);
+		}
+
+		heights[i] = tile->samples[(x[i] % m_tileSize) + (y[i] % m_tileSize) * m_tileSize];
+	}
+}
+
+void TiledHeightMap::setMemoryBudget(size_t memoryBudget)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_memoryBudget = memoryBudget;
+	fitTileSize();
+	evictTiles(getMaxResidentTiles());
+}
+
+size_t TiledHeightMap::getResidentBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_tiles.size() * getTileBytes();
+}
+
+TiledHeightMap::Statistics TiledHeightMap::getStatistics() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_statistics;
+}
+
+void TiledHeightMap::resetStatistics()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_statistics = Statistics();
+}
+
+const TiledHeightMap::Tile& TiledHeightMap::fetchTile(unsigned int tileX, unsigned int tileY) const
+{
+	unsigned int index = tileX + tileY * m_numTilesX;
+
+	// move resident tiles to the front of the lru list
+	auto it = m_tileLookup.find(index);
+	if (it != m_tileLookup.end())
+	{
+		++m_statistics.hits;
+		if (it->second != m_tiles.begin())
+			m_tiles.splice(m_tiles.begin(), m_tiles, it->second);
+		return m_tiles.front();
+	}
+
+	// make room for the new tile
+	++m_statistics.misses;
+	evictTiles(getMaxResidentTiles() - 1u);
+
+	m_tiles.push_front(Tile());
+	Tile& tile = m_tiles.front();
+	tile.index = index;
+	tile.samples.resize((size_t)m_tileSize * (size_t)m_tileSize, 0.0f);
+	m_tileLookup[index] = m_tiles.begin();
+
+	// read tile row by row, border tiles are only partially filled
+	unsigned int startX = tileX * m_tileSize;
+	unsigned int startY = tileY * m_tileSize;
+	unsigned int numColumns = std::min(m_tileSize, m_width - startX);
+	unsigned int numRows = std::min(m_tileSize, m_height - startY);
+
+	m_file.clear();
+	for (unsigned int row = 0; row < numRows; ++row)
+	{
+		std::streamoff offset = (std::streamoff)m_dataOffset + ((std::streamoff)(startY + row) * m_width + startX) * sizeof(float);
+		m_file.seekg(offset);
+		m_file.read((char*)&tile.samples[(size_t)row * m_tileSize], numColumns * sizeof(float));
+	}
+
+	if (m_file.fail())
+	{
+		std::cout << "Error: could not read height map tile " << tileX << ", " << tileY << std::endl;
+		m_file.clear();
+	}
+
+	m_statistics.bytesPaged += (unsigned long long)numRows * numColumns * sizeof(float);
+
+	return tile;
+}
+
+void TiledHeightMap::fitTileSize()
+{
+	// the cache has to hold at least one tile, so a small budget gets smaller tiles instead of being exceeded
+	unsigned int tileSize = m_maxTileSize;
+	while (tileSize > 1u && (size_t)tileSize * (size_t)tileSize * sizeof(float) > m_memoryBudget)
+		tileSize /= 2u;
+
+	if (tileSize != m_maxTileSize)
+		std::cout << "Warning: tile memory budget of " << m_memoryBudget << " bytes is smaller than a " << m_maxTileSize << "x" << m_maxTileSize << " tile, using " << tileSize << "x" << tileSize << " tiles" << std::endl;
+
+	// the resident tiles have the old size, so they are dropped
+	if (tileSize != m_tileSize)
+	{
+		m_tileSize = tileSize;
+		m_tiles.clear();
+		m_tileLookup.clear();
+		m_numTilesX = (m_width + m_tileSize - 1u) / m_tileSize;
+	}
+
+	// only a budget below a single sample is exceeded
+	if (getTileBytes() > m_memoryBudget)
+		std::cout << "Warning: tile memory budget of " << m_memoryBudget << " bytes is smaller than a single sample, keeping one sample resident" << std::endl;
+}
+
+void TiledHeightMap::evictTiles(size_t maxTiles) const
+{
+	while (m_tiles.size() > maxTiles)
+	{
+		m_tileLookup.erase(m_tiles.back().index);
+		m_tiles.pop_back();
+		++m_statistics.evictions;
+	}
+}
+
+}
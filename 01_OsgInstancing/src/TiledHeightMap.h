@@ -0,0 +1,115 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _TILED_HEIGHT_MAP_H
+#define _TILED_HEIGHT_MAP_H
+
+// std
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <fstream>
+#include <algorithm>
+
+namespace osgExample
+{
+
+/**
+ Out-of-core height map, that pages square tiles of float32 samples from a row major file on demand.
+ Resident tiles are kept in a LRU cache that never exceeds the configured memory budget.
+*/
+class TiledHeightMap
+{
+public:
+	struct Statistics
+	{
+		Statistics() : hits(0u), misses(0u), evictions(0u), bytesPaged(0u) {}
+
+		inline double getHitRate() const { return (hits + misses) ? (double)hits / (double)(hits + misses) : 0.0; }
+
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long evictions;
+		unsigned long long bytesPaged;
+	};
+
+	// a budget below one tile halves the tile size until a tile fits into it
+	TiledHeightMap(unsigned int tileSize = 256u, size_t memoryBudget = 64u * 1024u * 1024u);
+	~TiledHeightMap();
+
+	bool open(const std::string& fileName, size_t dataOffset, unsigned int width, unsigned int height);
+	void close();
+
+	// x and y have to be inside [0-width),[0-height)
+	float getHeight(unsigned int x, unsigned int y) const;
+	// batched version, locks the cache once and looks up the tile once for a run of samples in the same tile
+	void getHeights(const unsigned int* x, const unsigned int* y, float* heights, size_t count) const;
+
+	void setMemoryBudget(size_t memoryBudget);
+	inline size_t getMemoryBudget() const { return m_memoryBudget; }
+	inline unsigned int getTileSize() const { return m_tileSize; }
+	inline bool isOpen() const { return m_width != 0u; }
+
+	size_t getResidentBytes() const;
+	Statistics getStatistics() const;
+	void resetStatistics();
+
+private:
+	struct Tile
+	{
+		unsigned int		index;
+		std::vector<float>	samples;
+	};
+	typedef std::list<Tile> TileList;
+
+	// a tile cache can't be shared, so forbid copies
+	TiledHeightMap(const TiledHeightMap&);
+	TiledHeightMap& operator=(const TiledHeightMap&);
+
+	const Tile& fetchTile(unsigned int tileX, unsigned int tileY) const;
+	void evictTiles(size_t maxTiles) const;
+	void fitTileSize();
+	inline size_t getTileBytes() const { return (size_t)m_tileSize * (size_t)m_tileSize * sizeof(float); }
+	inline size_t getMaxResidentTiles() const { return std::max((size_t)1u, m_memoryBudget / getTileBytes()); }
+
+	unsigned int		m_maxTileSize;
+	unsigned int		m_tileSize;
+	size_t				m_memoryBudget;
+	size_t				m_dataOffset;
+	unsigned int		m_width;
+	unsigned int		m_height;
+	unsigned int		m_numTilesX;
+
+	// the cache is filled by the const accessor, most recently used tiles are at the front
+	mutable std::ifstream											m_file;
+	mutable TileList												m_tiles;
+	mutable std::unordered_map<unsigned int, TileList::iterator>	m_tileLookup;
+	mutable Statistics												m_statistics;
+	mutable std::mutex												m_mutex;
+};
+
+}
+
+#endif
@@ -27,6 +27,10 @@
 #define _USE_MATH_DEFINES 1 // fix for visual studio
 #include <cmath>
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 // osg
 #include <osg/ref_ptr>
@@ -41,6 +45,8 @@
 #include <osgDB/ReadFile>
 #include <osg/Light>
 #include <osg/LightSource>
+#include <osg/Stats>
+#include <osg/Timer>
 
 // osgExample
 #include "InstancedGeometryBuilder.h"
@@ -118,7 +124,8 @@ osg::ref_ptr<osg::Geometry> createQuads()
 	return geometry;
 }
 
-osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y, GLint maxInstanceMatrices)
+// without software instancing its child is an empty placeholder
+osg::ref_ptr<osg::Switch> createScene(unsigned int x, unsigned int y, GLint maxInstanceMatrices, bool softwareInstancing)
 {
 	osg::ref_ptr<osg::Switch>	switchNode = new osg::Switch;
 
@@ -152,7 +159,7 @@ osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y, GLint maxIn
 		}
 	}
 	
-	switchNode->addChild(builder->getSoftwareInstancedNode(), false);
+	switchNode->addChild(softwareInstancing ? builder->getSoftwareInstancedNode() : osg::ref_ptr<osg::Node>(new osg::Group), false);
 	switchNode->addChild(builder->getHardwareInstancedNode(), false);
 	switchNode->addChild(builder->getTextureHardwareInstancedNode(), true);
 
@@ -184,16 +191,173 @@ osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y, GLint maxIn
 	return switchNode;
 }
 
+osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y, GLint maxInstanceMatrices)
+{
+	return createScene(x, y, maxInstanceMatrices, true);
+}
+
+// averages of one technique and scene size, the times are in ms
+struct TechniqueBenchmarkResult
+{
+	std::string		technique;
+	unsigned int	size;
+	double			frameTime;
+	double			cullTime;
+	double			drawTime;
+	double			gpuTime;
+};
+
+// same columns as the benchmark of 02_OsgInstancing, this example doesn't count drawn instances, draw calls and state changes
+void writeBenchmarkResults(const std::vector<TechniqueBenchmarkResult>& results, std::ostream& stream, bool json)
+{
+	if (json)
+	{
+		stream << "[" << std::endl;
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const TechniqueBenchmarkResult& result = results[i];
+			stream << "\t{\"technique\": \"" << result.technique << "\", \"size\": " << result.size
+				   << ", \"instances\": " << result.size * result.size << ", \"frame_ms\": " << result.frameTime
+				   << ", \"cull_ms\": " << result.cullTime << ", \"draw_ms\": " << result.drawTime << ", \"gpu_ms\": " << result.gpuTime
+				   << ", \"drawn_instances\": null, \"draw_calls\": null, \"state_changes\": null}" << (i + 1 < results.size() ? "," : "") << std::endl;
+		}
+		stream << "]" << std::endl;
+	} else {
+		stream << "technique,size,instances,frame_ms,cull_ms,draw_ms,gpu_ms,drawn_instances,draw_calls,state_changes" << std::endl;
+		for (std::vector<TechniqueBenchmarkResult>::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			stream << it->technique << "," << it->size << "," << it->size * it->size << "," << it->frameTime << ","
+				   << it->cullTime << "," << it->drawTime << "," << it->gpuTime << ",,," << std::endl;
+		}
+	}
+}
+
+int benchmarkTechniques(osg::ref_ptr<osgViewer::Viewer> viewer, GLint maxInstanceMatrices, unsigned int numFrames, unsigned int maxSize, const std::string& outputFile)
+{
+	const char* techniqueNames[] = {"software", "uniform", "texture"};
+	const unsigned int numTechniques = 3u;
+	const unsigned int lightSourceChild = 3u;
+	const unsigned int warmUpFrames = 10u;
+	// a MatrixTransform per instance takes minutes to build and cull above this size
+	const unsigned int maxSoftwareSize = 256u;
+	viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+
+	// keep the stats of all measured frames, osg only keeps the last few by default
+	osg::ref_ptr<osg::Camera> camera = viewer->getCamera();
+	camera->setStats(new osg::Stats("Camera", warmUpFrames + numFrames + 10u));
+	camera->getStats()->collectStats("rendering", true);
+	camera->getStats()->collectStats("gpu", true);
+
+	// look at the whole terrain from the south
+	float extentX = g_fileLoader.getWidth() * 2.0f;
+	float extentY = g_fileLoader.getHeight() * 2.0f;
+	camera->setViewMatrixAsLookAt(osg::Vec3(extentX * 0.5f, -extentY * 0.25f, std::max(extentX, extentY) * 0.5f), osg::Vec3(extentX * 0.5f, extentY * 0.5f, 0.0f), osg::Vec3(0.0f, 0.0f, 1.0f));
+
+	std::vector<TechniqueBenchmarkResult> results;
+	for (unsigned int size = 8u; size <= maxSize; size *= 2u)
+	{
+		// all techniques are built with the scene, so every technique of a size draws the same instances
+		bool softwareInstancing = size <= maxSoftwareSize;
+		osg::ref_ptr<osg::Switch> scene = createScene(size, size, maxInstanceMatrices, softwareInstancing);
+		viewer->setSceneData(scene);
+
+		for (unsigned int technique = 0; technique < numTechniques; ++technique)
+		{
+			if (technique == 0 && !softwareInstancing)
+			{
+				std::cout << "Skipping " << techniqueNames[technique] << " with " << size << "x" << size << " instances" << std::endl;
+				continue;
+			}
+
+			scene->setSingleChildOn(technique);
+			scene->setValue(lightSourceChild, true);
+
+			TechniqueBenchmarkResult result = {techniqueNames[technique], size, 0.0, 0.0, 0.0, 0.0};
+			unsigned int firstFrame = 0u;
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			for (unsigned int frame = 0; frame < warmUpFrames + numFrames; ++frame)
+			{
+				if (frame == warmUpFrames)
+				{
+					firstFrame = viewer->getFrameStamp()->getFrameNumber() + 1u;
+					start = osg::Timer::instance()->tick();
+				}
+
+				viewer->frame();
+			}
+			result.frameTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) / numFrames;
+
+			// the stats hold seconds, gpu times arrive a few frames late and may be missing for the last frames
+			unsigned int lastFrame = viewer->getFrameStamp()->getFrameNumber();
+			camera->getStats()->getAveragedAttribute(firstFrame, lastFrame, "Cull traversal time taken", result.cullTime);
+			camera->getStats()->getAveragedAttribute(firstFrame, lastFrame, "Draw traversal time taken", result.drawTime);
+			camera->getStats()->getAveragedAttribute(firstFrame, lastFrame, "GPU draw time taken", result.gpuTime);
+			result.cullTime *= 1000.0;
+			result.drawTime *= 1000.0;
+			result.gpuTime *= 1000.0;
+
+			std::cout << result.technique << " " << size << "x" << size << ": " << result.frameTime << " ms per frame, cull "
+					  << result.cullTime << " ms, draw " << result.drawTime << " ms, gpu " << result.gpuTime << " ms" << std::endl;
+			results.push_back(result);
+		}
+	}
+
+	// the format follows the extension of the output file, csv without one
+	bool json = outputFile.size() >= 5 && outputFile.compare(outputFile.size() - 5, 5, ".json") == 0;
+	if (outputFile.empty())
+	{
+		writeBenchmarkResults(results, std::cout, false);
+	} else {
+		std::ofstream stream(outputFile.c_str());
+		if (!stream)
+		{
+			std::cout << "Error could not write benchmark results to: " << outputFile << std::endl;
+			return 1;
+		}
+		writeBenchmarkResults(results, stream, json);
+		std::cout << "Wrote benchmark results to " << outputFile << std::endl;
+	}
+
+	return 0;
+}
+
 int main(int argc, char** argv)
 {
+	osg::ArgumentParser arguments(&argc, argv);
 	osg::ref_ptr<osgViewer::Viewer> viewer = new osgViewer::Viewer;
 
-	viewer->setUpViewInWindow(100, 100, 800, 600);
+	// the technique benchmark renders into an offscreen pbuffer, so it also runs on machines without a display
+	unsigned int numBenchmarkFrames = 100u;
+	bool benchmark = arguments.read("--benchmark", numBenchmarkFrames) || arguments.read("--benchmark");
+	if (benchmark)
+	{
+		osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+		traits->readDISPLAY();
+		traits->setUndefinedScreenDetailsToDefaultScreen();
+		traits->width = 800;
+		traits->height = 600;
+		traits->pbuffer = true;
+		traits->doubleBuffer = false;
+		osg::ref_ptr<osg::GraphicsContext> context = osg::GraphicsContext::createGraphicsContext(traits);
+		if (!context.valid())
+		{
+			std::cout << "Error could not create an offscreen pbuffer for the benchmark" << std::endl;
+			return 1;
+		}
 
-	// get window and set name
-	osgViewer::ViewerBase::Windows windows;
-	viewer->getWindows(windows);
-	windows[0]->setWindowName("OpenSceneGraph Instancing Example");
+		viewer->getCamera()->setGraphicsContext(context);
+		viewer->getCamera()->setViewport(0, 0, traits->width, traits->height);
+		viewer->getCamera()->setProjectionMatrixAsPerspective(30.0, (double)traits->width / (double)traits->height, 1.0, 100000.0);
+		viewer->getCamera()->setDrawBuffer(GL_FRONT);
+		viewer->getCamera()->setReadBuffer(GL_FRONT);
+	} else {
+		viewer->setUpViewInWindow(100, 100, 800, 600);
+
+		// get window and set name
+		osgViewer::ViewerBase::Windows windows;
+		viewer->getWindows(windows);
+		windows[0]->setWindowName("OpenSceneGraph Instancing Example");
+	}
 
 	// get context to determine max number of uniforms in vertex shader
 	osgViewer::ViewerBase::Contexts contexts;
@@ -206,6 +370,15 @@ int main(int argc, char** argv)
 	// load elevation model from asc
 	g_fileLoader.loadFromFile("../data/crater.asc");
 
+	if (benchmark)
+	{
+		unsigned int maxBenchmarkSize = 1024u;
+		arguments.read("--benchmark-max-size", maxBenchmarkSize);
+		std::string benchmarkOutput;
+		arguments.read("--benchmark-output", benchmarkOutput);
+		return benchmarkTechniques(viewer, maxInstanceMatrices, std::max(numBenchmarkFrames, 1u), std::min(std::max(maxBenchmarkSize, 8u), 1024u), benchmarkOutput);
+	}
+
 	// create scene
 	osg::ref_ptr<osg::Switch> scene = setupScene(64, 64, maxInstanceMatrices);
 	viewer->setSceneData(scene);
@@ -223,6 +396,7 @@ int main(int argc, char** argv)
 	std::cout << "Switch between instancing techniques: 1, 2, 3" << std::endl;
 	std::cout << "Increase/decrease scene complexety: +/-" << std::endl;
 	std::cout << "Cycle through different status informations(FPS and other stats): s" << std::endl;
+	std::cout << "Benchmark all techniques offscreen with 8x8 to 1024x1024 instances(command line): --benchmark [frames] [--benchmark-max-size n] [--benchmark-output file.csv|file.json]" << std::endl;
 
 	return viewer->run();
 }
\ No newline at end of file
@@ -0,0 +1,35 @@
+# Generates a source file that compiles the shader files into the executable, see src/EmbeddedShaders.h
+# Usage: cmake -DOUTPUT=EmbeddedShaders.cpp -DSHADERS=a.vert|a.frag -P EmbedShaders.cmake
+# The shader list is separated by | instead of ; because a custom command splits its arguments at ;
+
+string(REPLACE "|" ";" shader_files "${SHADERS}")
+
+set(content "// Generated by cmake/EmbedShaders.cmake from the shader files, do not edit\n\n")
+set(content "${content}#include \"EmbeddedShaders.h\"\n\n#include <cstring>\n\nnamespace\n{\n\n")
+set(content "${content}struct EmbeddedShader\n{\n\tconst char* fileName;\n\tconst char* source;\n};\n\n")
+set(content "${content}const EmbeddedShader g_embeddedShaders[] =\n{\n")
+
+foreach(shader_file ${shader_files})
+	get_filename_component(name "${shader_file}" NAME)
+	file(READ "${shader_file}" source)
+
+	# one string literal per line, so no literal gets near the length limit of msvc
+	string(REPLACE "\\" "\\\\" source "${source}")
+	string(REPLACE "\"" "\\\"" source "${source}")
+	string(REPLACE "\r" "" source "${source}")
+	string(REPLACE "\n" "\\n\"\n\t\t\"" source "${source}")
+	set(content "${content}\t{\"${name}\",\n\t\t\"${source}\"},\n")
+endforeach()
+
+set(content "${content}\t{NULL, NULL}\n};\n\n}\n\n")
+set(content "${content}const char* osgExample::getEmbeddedShaderSource(const char* fileName)\n{\n")
+set(content "${content}\tfor (const EmbeddedShader* shader = g_embeddedShaders; shader->fileName != NULL; ++shader)\n\t{\n")
+set(content "${content}\t\tif (strcmp(shader->fileName, fileName) == 0)\n\t\t\treturn shader->source;\n\t}\n\n\treturn NULL;\n}\n")
+
+# only touch the output if it changed, so unchanged shaders don't trigger a rebuild
+if(EXISTS "${OUTPUT}")
+	file(READ "${OUTPUT}" old_content)
+endif()
+if(NOT "${old_content}" STREQUAL "${content}")
+	file(WRITE "${OUTPUT}" "${content}")
+endif()
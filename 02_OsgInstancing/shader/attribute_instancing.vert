@@ -7,7 +7,11 @@ uniform vec3 lightDirection;
 in vec3 vPosition;
 in vec3 vNormal;
 in vec2 vTexCoord;
+#ifdef QUANTIZED_INSTANCES
+in uvec2 vInstanceData;
+#else
 in mat4 vInstanceModelMatrix;
+#endif
 
 smooth out vec2 texCoord;
 smooth out vec3 normal;
@@ -15,6 +19,9 @@ smooth out vec3 lightDir;
 
 void main()
 {
+#ifdef QUANTIZED_INSTANCES
+	mat4 vInstanceModelMatrix = decodeInstanceModelMatrix(vInstanceData);
+#endif
 	gl_Position = osg_ModelViewProjectionMatrix * vInstanceModelMatrix * vec4(vPosition, 1.0);
 	texCoord = vTexCoord;
 
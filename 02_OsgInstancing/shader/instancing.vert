@@ -1,5 +1,9 @@
 #version 150 compatibility
+#ifdef QUANTIZED_INSTANCES
+uniform uvec4 instanceData[MAX_INSTANCES / 2];
+#else
 uniform mat4 instanceModelMatrix[MAX_INSTANCES];
+#endif
 uniform mat4 osg_ModelViewProjectionMatrix;
 uniform mat3 osg_NormalMatrix;
 uniform vec3 lightDirection;
@@ -10,7 +14,12 @@ smooth out vec3 lightDir;
 
 void main()
 {
+#ifdef QUANTIZED_INSTANCES
+	uvec4 instancePair = instanceData[gl_InstanceID / 2];
+	mat4 _instanceModelMatrix = decodeInstanceModelMatrix((gl_InstanceID % 2 == 0) ? instancePair.xy : instancePair.zw);
+#else
 	mat4 _instanceModelMatrix = instanceModelMatrix[gl_InstanceID];
+#endif
 	gl_Position = osg_ModelViewProjectionMatrix * _instanceModelMatrix * gl_Vertex;
 	texCoord = gl_MultiTexCoord0.xy;
 
@@ -1,6 +1,10 @@
 #version 150 compatibility
 #extension GL_ARB_texture_rectangle : enable
+#ifdef QUANTIZED_INSTANCES
+uniform usampler2DRect instanceDataTexture;
+#else
 uniform sampler2DRect instanceMatrixTexture;
+#endif
 uniform mat4 osg_ModelViewProjectionMatrix;
 uniform mat3 osg_NormalMatrix;
 uniform vec3 lightDirection;
@@ -11,11 +15,17 @@ smooth out vec3 lightDir;
 
 void main()
 {
+#ifdef QUANTIZED_INSTANCES
+	// every texel holds two instances and every row 4096 texels
+	uvec4 instancePair = texelFetch(instanceDataTexture, ivec2((gl_InstanceID / 2) % 4096, gl_InstanceID / 8192));
+	mat4 instanceModelMatrix = decodeInstanceModelMatrix((gl_InstanceID % 2 == 0) ? instancePair.xy : instancePair.zw);
+#else
 	vec2 instanceCoord = vec2((gl_InstanceID % 4096) * 4.0, gl_InstanceID / 4096);
 	mat4 instanceModelMatrix = mat4(texture2DRect(instanceMatrixTexture, instanceCoord),
 									texture2DRect(instanceMatrixTexture, instanceCoord + vec2(1.0, 0.0)),
 									texture2DRect(instanceMatrixTexture, instanceCoord + vec2(2.0, 0.0)),
 									texture2DRect(instanceMatrixTexture, instanceCoord + vec2(3.0, 0.0)));
+#endif
 
 	gl_Position = osg_ModelViewProjectionMatrix * instanceModelMatrix * gl_Vertex;
 	texCoord = gl_MultiTexCoord0.xy;
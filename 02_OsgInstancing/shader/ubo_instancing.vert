@@ -2,7 +2,11 @@
 #extension GL_ARB_uniform_buffer_object : enable
 layout(std140) uniform instanceData
 {
+#ifdef QUANTIZED_INSTANCES
+	uvec4 packedInstances[MAX_INSTANCES / 2];
+#else
 	mat4 instanceModelMatrix[MAX_INSTANCES];
+#endif
 };
 uniform mat4 osg_ModelViewProjectionMatrix;
 uniform mat3 osg_NormalMatrix;
@@ -14,7 +18,12 @@ smooth out vec3 lightDir;
 
 void main()
 {
+#ifdef QUANTIZED_INSTANCES
+	uvec4 instancePair = packedInstances[gl_InstanceID / 2];
+	mat4 _instanceModelMatrix = decodeInstanceModelMatrix((gl_InstanceID % 2 == 0) ? instancePair.xy : instancePair.zw);
+#else
 	mat4 _instanceModelMatrix = instanceModelMatrix[gl_InstanceID];
+#endif
 	gl_Position = osg_ModelViewProjectionMatrix * _instanceModelMatrix * gl_Vertex;
 	texCoord = gl_MultiTexCoord0.xy;
 
@@ -0,0 +1,480 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <GL/glew.h>
+
+// std
+#include <iostream>
+#include <algorithm>
+
+// osg
+#include <osgUtil/CullVisitor>
+
+// osgExample
+#include "BatchedInstancedDrawable.h"
+#include "InstanceBounds.h"
+
+namespace
+{
+
+// position, normal and texture coordinate
+const size_t VERTEX_SIZE = 8u;
+
+}
+
+namespace osgExample
+{
+
+BatchedInstancedDrawable::BatchedInstancedDrawable()
+	:	m_vao(0u),
+		m_vbo(0u),
+		m_ebo(0u),
+		m_instancebo(0u),
+		m_indirectbo(0u),
+		m_instanceBufferSize(0u),
+		m_indirectBufferSize(0u),
+		m_meshesDirty(true),
+		m_instancesDirty(true),
+		m_commandsDirty(true),
+		m_dirtyInstanceStart(0u),
+		m_dirtyInstanceEnd(0u),
+		m_multiDrawIndirect(true),
+		m_baseInstance(true)
+{
+	setUseDisplayList(false);
+	setUseVertexBufferObjects(true);
+}
+
+BatchedInstancedDrawable::BatchedInstancedDrawable(const BatchedInstancedDrawable& other, const osg::CopyOp& copyOp)
+	:	osg::Drawable(other, copyOp),
+		m_vertexData(other.m_vertexData),
+		m_indices(other.m_indices),
+		m_meshes(other.m_meshes),
+		m_draws(other.m_draws),
+		m_commands(other.m_commands),
+		m_matrixArray(other.m_matrixArray),
+		m_vao(0u),
+		m_vbo(0u),
+		m_ebo(0u),
+		m_instancebo(0u),
+		m_indirectbo(0u),
+		m_instanceBufferSize(0u),
+		m_indirectBufferSize(0u),
+		m_meshesDirty(true),
+		m_instancesDirty(true),
+		m_commandsDirty(true),
+		m_dirtyInstanceStart(0u),
+		m_dirtyInstanceEnd(0u),
+		m_multiDrawIndirect(true),
+		m_baseInstance(true)
+{
+}
+
+BatchedInstancedDrawable::~BatchedInstancedDrawable()
+{
+	releaseGLObjects(0);
+}
+
+unsigned int BatchedInstancedDrawable::addMesh(const osg::Geometry* geometry)
+{
+	const osg::Vec3Array* vertices = dynamic_cast<const osg::Vec3Array*>(geometry->getVertexArray());
+	const osg::Vec3Array* normals = dynamic_cast<const osg::Vec3Array*>(geometry->getNormalArray());
+	const osg::Vec2Array* texCoords = dynamic_cast<const osg::Vec2Array*>(geometry->getTexCoordArray(0));
+	if (!vertices || vertices->empty())
+	{
+		std::cout << "Error: Batched meshes need a Vec3Array as vertex array." << std::endl;
+		return INVALID_MESH;
+	}
+
+	Mesh mesh;
+	mesh.firstIndex = m_indices.size();
+	mesh.baseVertex = m_vertexData.size() / VERTEX_SIZE;
+	mesh.bounds = computeVertexBounds(vertices);
+
+	// all meshes share one command type, so only indexed triangles can be batched
+	for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+	{
+		const osg::DrawElements* drawElements = dynamic_cast<const osg::DrawElements*>(geometry->getPrimitiveSet(i));
+		if (!drawElements || drawElements->getMode() != GL_TRIANGLES)
+		{
+			std::cout << "Warning: Batched meshes only draw indexed triangles, skipping primitive set " << i << std::endl;
+			continue;
+		}
+
+		for (unsigned int j = 0; j < drawElements->getNumIndices(); ++j)
+		{
+			m_indices.push_back(drawElements->index(j));
+		}
+	}
+	mesh.numIndices = m_indices.size() - mesh.firstIndex;
+	if (!mesh.numIndices)
+	{
+		std::cout << "Error: Batched mesh has no indexed triangles." << std::endl;
+		return INVALID_MESH;
+	}
+
+	// interleave the vertex data like InstancedDrawable, missing attributes are zero
+	for (unsigned int i = 0; i < vertices->size(); ++i)
+	{
+		osg::Vec3 normal = normals && i < normals->size() ? (*normals)[i] : osg::Vec3();
+		osg::Vec2 texCoord = texCoords && i < texCoords->size() ? (*texCoords)[i] : osg::Vec2();
+		const GLfloat vertex[VERTEX_SIZE] = {(*vertices)[i].x(), (*vertices)[i].y(), (*vertices)[i].z(),
+											 normal.x(), normal.y(), normal.z(), texCoord.x(), texCoord.y()};
+		m_vertexData.insert(m_vertexData.end(), vertex, vertex + VERTEX_SIZE);
+	}
+
+	m_meshes.push_back(mesh);
+	m_meshesDirty = true;
+	dirtyBound();
+	return m_meshes.size() - 1;
+}
+
+unsigned int BatchedInstancedDrawable::addDraw(unsigned int mesh, unsigned int firstInstance, unsigned int numInstances)
+{
+	Draw draw = {mesh, firstInstance, numInstances, true};
+	m_draws.push_back(draw);
+	m_commands.push_back(DrawElementsIndirectCommand());
+	writeCommand(m_draws.size() - 1);
+	dirtyBound();
+	return m_draws.size() - 1;
+}
+
+void BatchedInstancedDrawable::setDrawInstances(unsigned int draw, unsigned int firstInstance, unsigned int numInstances)
+{
+	m_draws[draw].firstInstance = firstInstance;
+	m_draws[draw].numInstances = numInstances;
+	writeCommand(draw);
+	dirtyBound();
+}
+
+void BatchedInstancedDrawable::removeLastDraw()
+{
+	m_draws.pop_back();
+	m_commands.pop_back();
+	m_commandsDirty = true;
+	dirtyBound();
+}
+
+void BatchedInstancedDrawable::setDrawEnabled(unsigned int draw, bool enabled)
+{
+	if (m_draws[draw].enabled == enabled)
+		return;
+
+	m_draws[draw].enabled = enabled;
+	writeCommand(draw);
+}
+
+void BatchedInstancedDrawable::writeCommand(unsigned int draw)
+{
+	const Draw& currentDraw = m_draws[draw];
+	const Mesh& mesh = m_meshes[currentDraw.mesh];
+	DrawElementsIndirectCommand& command = m_commands[draw];
+	command.count = mesh.numIndices;
+	command.instanceCount = currentDraw.enabled ? currentDraw.numInstances : 0u;
+	command.firstIndex = mesh.firstIndex;
+	command.baseVertex = mesh.baseVertex;
+	command.baseInstance = currentDraw.firstInstance;
+	m_commandsDirty = true;
+}
+
+void BatchedInstancedDrawable::dirtyInstances(size_t start, size_t end)
+{
+	if (end <= start)
+		return;
+
+	if (m_dirtyInstanceStart < m_dirtyInstanceEnd)
+	{
+		m_dirtyInstanceStart = std::min(m_dirtyInstanceStart, start);
+		m_dirtyInstanceEnd = std::max(m_dirtyInstanceEnd, end);
+	} else {
+		m_dirtyInstanceStart = start;
+		m_dirtyInstanceEnd = end;
+	}
+	dirtyBound();
+}
+
+unsigned int BatchedInstancedDrawable::getNumDrawCalls() const
+{
+	if (m_multiDrawIndirect)
+		return m_draws.empty() ? 0u : 1u;
+
+	// the fallback skips disabled draws
+	unsigned int numDrawCalls = 0u;
+	for (auto it = m_draws.begin(); it != m_draws.end(); ++it)
+	{
+		if (it->enabled && it->numInstances)
+			++numDrawCalls;
+	}
+	return numDrawCalls;
+}
+
+osg::BoundingBox BatchedInstancedDrawable::computeBound() const
+{
+	// every draw adds the transformed bounds of its mesh
+	osg::BoundingBox bounds;
+	if (!m_matrixArray)
+		return bounds;
+
+	for (auto it = m_draws.begin(); it != m_draws.end(); ++it)
+	{
+		size_t end = std::min((size_t)it->firstInstance + it->numInstances, m_matrixArray->size());
+		if (it->firstInstance < end)
+			bounds.expandBy(computeInstanceBounds(m_meshes[it->mesh].bounds, m_matrixArray->getData(it->firstInstance), end - it->firstInstance));
+	}
+	return bounds;
+}
+
+void BatchedInstancedDrawable::compileGLObjects(osg::RenderInfo& renderInfo) const
+{
+	if (!m_vao)
+	{
+		GLuint buffers[] = {0u, 0u, 0u, 0u};
+		glGenBuffers(4, buffers);
+		m_vbo = buffers[0];
+		m_ebo = buffers[1];
+		m_instancebo = buffers[2];
+		m_indirectbo = buffers[3];
+		glGenVertexArrays(1, &m_vao);
+		m_instanceBufferSize = 0u;
+		m_indirectBufferSize = 0u;
+		m_meshesDirty = m_instancesDirty = m_commandsDirty = true;
+
+		m_multiDrawIndirect = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+		m_baseInstance = GLEW_ARB_base_instance != 0;
+
+		// the mesh attributes never change, the instance attributes only without base instances
+		glBindVertexArray(m_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, VERTEX_SIZE * sizeof(GLfloat), 0);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, VERTEX_SIZE * sizeof(GLfloat), (GLvoid*)(sizeof(GLfloat) * 3));
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, VERTEX_SIZE * sizeof(GLfloat), (GLvoid*)(sizeof(GLfloat) * 6));
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+		setupInstanceAttributes(0);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	// all meshes are uploaded at once, they are only added while the scene is set up
+	if (m_meshesDirty)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+		glBufferData(GL_ARRAY_BUFFER, m_vertexData.size() * sizeof(GLfloat), m_vertexData.empty() ? NULL : &m_vertexData[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(GLuint), m_indices.empty() ? NULL : &m_indices[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		m_meshesDirty = false;
+	}
+
+	if (m_instancesDirty)
+	{
+		uploadInstanceData(0, m_matrixArray.valid() ? m_matrixArray->size() : 0u);
+	} else if (m_dirtyInstanceStart < m_dirtyInstanceEnd) {
+		uploadInstanceData(m_dirtyInstanceStart, m_dirtyInstanceEnd);
+	}
+	m_instancesDirty = false;
+	m_dirtyInstanceStart = m_dirtyInstanceEnd = 0u;
+
+	// culling changes the instance counts every frame, but the commands are only a few bytes per chunk
+	if (m_commandsDirty && m_multiDrawIndirect)
+	{
+		size_t commandsSize = m_commands.size() * sizeof(DrawElementsIndirectCommand);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectbo);
+		if (commandsSize > m_indirectBufferSize)
+			m_indirectBufferSize = std::max(commandsSize, m_indirectBufferSize + m_indirectBufferSize / 2);
+
+		// orphan the commands of the last frame, the gpu may still read them
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, m_indirectBufferSize, NULL, GL_DYNAMIC_DRAW);
+		if (commandsSize)
+			glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commandsSize, &m_commands[0]);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	m_commandsDirty = false;
+}
+
+void BatchedInstancedDrawable::uploadInstanceData(size_t start, size_t end) const
+{
+	size_t numInstances = m_matrixArray.valid() ? m_matrixArray->size() : 0u;
+	size_t dataSize = m_matrixArray.valid() ? m_matrixArray->getDataSize(0, numInstances) : 0u;
+	start = std::min(start, numInstances);
+	end = std::min(end, numInstances);
+
+	glBindBuffer(GL_ARRAY_BUFFER, m_instancebo);
+	if (dataSize > m_instanceBufferSize)
+	{
+		// leave room for added instances, so not every added instance reallocates the buffer
+		m_instanceBufferSize = std::max(dataSize, m_instanceBufferSize + m_instanceBufferSize / 2);
+		glBufferData(GL_ARRAY_BUFFER, m_instanceBufferSize, NULL, GL_DYNAMIC_DRAW);
+		start = 0u;
+		end = numInstances;
+	}
+
+	if (start < end)
+		glBufferSubData(GL_ARRAY_BUFFER, m_matrixArray->getDataSize(0, start), m_matrixArray->getDataSize(start, end), m_matrixArray->getData(start));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void BatchedInstancedDrawable::setupInstanceAttributes(GLintptr offset) const
+{
+	// the vertex array object of this drawable has to be bound
+	glBindBuffer(GL_ARRAY_BUFFER, m_instancebo);
+	for (GLuint i = 0; i < 4; ++i)
+	{
+		glEnableVertexAttribArray(3 + i);
+		glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(offset + i * 4 * sizeof(float)));
+		glVertexAttribDivisor(3 + i, 1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void BatchedInstancedDrawable::releaseGLObjects(osg::State* state) const
+{
+	if (m_vao)
+	{
+		GLuint buffers[] = {m_vbo, m_ebo, m_instancebo, m_indirectbo};
+		glDeleteBuffers(4, buffers);
+		glDeleteVertexArrays(1, &m_vao);
+		m_vbo = 0;
+		m_ebo = 0;
+		m_instancebo = 0;
+		m_indirectbo = 0;
+		m_vao = 0;
+	}
+}
+
+void BatchedInstancedDrawable::drawImplementation(osg::RenderInfo& renderInfo) const
+{
+	// upload changes made after the initial compile
+	if (!m_vao || m_meshesDirty || m_instancesDirty || m_commandsDirty || m_dirtyInstanceStart < m_dirtyInstanceEnd)
+		compileGLObjects(renderInfo);
+
+	if (m_commands.empty())
+		return;
+
+	glBindVertexArray(m_vao);
+	if (m_multiDrawIndirect)
+	{
+		// every mesh and chunk in a single call, disabled draws have zero instances
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirectbo);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, NULL, m_commands.size(), 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	} else {
+		for (auto it = m_commands.begin(); it != m_commands.end(); ++it)
+		{
+			if (!it->instanceCount)
+				continue;
+
+			const GLvoid* indices = (const GLvoid*)(it->firstIndex * sizeof(GLuint));
+			if (m_baseInstance)
+			{
+				glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, it->count, GL_UNSIGNED_INT, indices, it->instanceCount, it->baseVertex, it->baseInstance);
+			} else {
+				setupInstanceAttributes(it->baseInstance * 16 * sizeof(float));
+				glDrawElementsInstancedBaseVertex(GL_TRIANGLES, it->count, GL_UNSIGNED_INT, indices, it->instanceCount, it->baseVertex);
+			}
+		}
+
+		// the next draw expects the attributes at the first instance
+		if (!m_baseInstance)
+			setupInstanceAttributes(0);
+	}
+	glBindVertexArray(0);
+}
+
+void BatchedInstancedDrawable::accept(osg::PrimitiveFunctor& functor) const
+{
+	if (m_vertexData.empty())
+		return;
+
+	// add the meshes to the stats, the positions are interleaved with the other attributes
+	std::vector<osg::Vec3> vertices(m_vertexData.size() / VERTEX_SIZE);
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		vertices[i].set(m_vertexData[i * VERTEX_SIZE], m_vertexData[i * VERTEX_SIZE + 1], m_vertexData[i * VERTEX_SIZE + 2]);
+	}
+	functor.setVertexArray(vertices.size(), &vertices[0]);
+	for (auto it = m_meshes.begin(); it != m_meshes.end(); ++it)
+	{
+		std::vector<GLuint> indices(m_indices.begin() + it->firstIndex, m_indices.begin() + it->firstIndex + it->numIndices);
+		for (auto index = indices.begin(); index != indices.end(); ++index)
+		{
+			*index += it->baseVertex;
+		}
+		functor.drawElements(GL_TRIANGLES, indices.size(), &indices[0]);
+	}
+}
+
+void BatchedChunkCullCallback::addChunk(unsigned int firstDraw, unsigned int numInstances, const osg::BoundingBox& bounds)
+{
+	Chunk chunk = {firstDraw, numInstances, bounds};
+	m_chunks.push_back(chunk);
+}
+
+void BatchedChunkCullCallback::setChunk(unsigned int chunk, unsigned int numInstances, const osg::BoundingBox& bounds)
+{
+	m_chunks[chunk].numInstances = numInstances;
+	m_chunks[chunk].bounds = bounds;
+}
+
+void BatchedChunkCullCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+	osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+	if (!cv)
+	{
+		traverse(node, nv);
+		return;
+	}
+
+	// the frustum and the eye of the current culling set are already in the coordinate system of the node
+	osg::Polytope frustum(cv->getCurrentCullingSet().getFrustum());
+	osg::Vec3 eye = cv->getEyeLocal();
+	size_t numDrawnInstances = 0u;
+	for (auto it = m_chunks.begin(); it != m_chunks.end(); ++it)
+	{
+		unsigned int level = 0u;
+		bool visible = it->numInstances && frustum.contains(it->bounds);
+		if (visible)
+		{
+			float distance = (it->bounds.center() - eye).length();
+			while (level < m_switchDistances.size() && distance >= m_switchDistances[level])
+				++level;
+			numDrawnInstances += it->numInstances;
+		}
+
+		for (unsigned int i = 0; i <= m_switchDistances.size(); ++i)
+		{
+			m_drawable->setDrawEnabled(it->firstDraw + i, visible && i == level);
+		}
+	}
+
+	// one vertex array object and one program for all meshes
+	m_statistics->addDrawnInstances(numDrawnInstances);
+	m_statistics->addDrawCalls(m_drawable->getNumDrawCalls(), 1u);
+	traverse(node, nv);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,185 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _BATCHED_INSTANCED_DRAWABLE_H
+#define _BATCHED_INSTANCED_DRAWABLE_H
+
+// std
+#include <vector>
+
+// osg
+#include <osg/Drawable>
+#include <osg/Geometry>
+#include <osg/NodeCallback>
+#include <osg/BoundingBox>
+
+// osgExample
+#include "InstanceTransformStore.h"
+#include "InstanceCullStatistics.h"
+
+namespace osgExample
+{
+
+/**
+ Draws many instanced meshes with a single draw call. The vertices and indices of all meshes are packed into one
+ vertex and one index buffer, every draw is an indirect command that draws a range of instances of one mesh.
+ With ARB_multi_draw_indirect all commands are issued by one glMultiDrawElementsIndirect, otherwise by a loop of
+ glDrawElementsInstancedBaseVertexBaseInstance, or by pointing the instance attributes to the first instance of
+ every draw without ARB_base_instance. The instances are the matrices of the transform store in the layout of the
+ vertex attribute technique.
+*/
+class BatchedInstancedDrawable : public osg::Drawable
+{
+public:
+	static const unsigned int INVALID_MESH = 0xffffffffu;
+
+	BatchedInstancedDrawable();
+	BatchedInstancedDrawable(const BatchedInstancedDrawable& other, const osg::CopyOp& copyOp);
+
+	META_Object(osgExample, BatchedInstancedDrawable)
+
+	virtual osg::BoundingBox computeBound() const;
+	virtual void compileGLObjects(osg::RenderInfo& renderInfo) const;
+	virtual void drawImplementation(osg::RenderInfo& renderInfo) const;
+	virtual void accept(osg::PrimitiveFunctor& functor) const;
+	virtual void releaseGLObjects(osg::State* state) const;
+
+	// appends the vertices and triangles of the geometry to the shared buffers, returns INVALID_MESH if the
+	// geometry has no indexed triangles
+	unsigned int addMesh(const osg::Geometry* geometry);
+	inline unsigned int getNumMeshes() const { return m_meshes.size(); }
+	inline const osg::BoundingBox& getMeshBounds(unsigned int mesh) const { return m_meshes[mesh].bounds; }
+
+	// a draw renders numInstances instances of the mesh starting at firstInstance of the transform store
+	unsigned int addDraw(unsigned int mesh, unsigned int firstInstance, unsigned int numInstances);
+	void setDrawInstances(unsigned int draw, unsigned int firstInstance, unsigned int numInstances);
+	void removeLastDraw();
+	inline unsigned int getNumDraws() const { return m_draws.size(); }
+	// disabled draws keep their command, but draw zero instances
+	void setDrawEnabled(unsigned int draw, bool enabled);
+
+	inline void setMatrixArray(osg::ref_ptr<const InstanceTransformStore> matrixArray) { m_matrixArray = matrixArray; m_instancesDirty = true; dirtyBound(); }
+	// only uploads the instances [start-end) again
+	void dirtyInstances(size_t start, size_t end);
+
+	// draw calls issued by the last draw, one if multi draw indirect is supported
+	unsigned int getNumDrawCalls() const;
+
+protected:
+	virtual ~BatchedInstancedDrawable();
+private:
+	struct Mesh
+	{
+		GLuint				firstIndex;
+		GLuint				numIndices;
+		GLint				baseVertex;
+		osg::BoundingBox	bounds;
+	};
+
+	struct Draw
+	{
+		unsigned int	mesh;
+		unsigned int	firstInstance;
+		unsigned int	numInstances;
+		bool			enabled;
+	};
+
+	// layout of the commands of glMultiDrawElementsIndirect
+	struct DrawElementsIndirectCommand
+	{
+		GLuint	count;
+		GLuint	instanceCount;
+		GLuint	firstIndex;
+		GLint	baseVertex;
+		GLuint	baseInstance;
+	};
+
+	void			writeCommand(unsigned int draw);
+	void			uploadInstanceData(size_t start, size_t end) const;
+	void			setupInstanceAttributes(GLintptr offset) const;
+
+	std::vector<GLfloat>				m_vertexData;	// interleaved position, normal and texture coordinate
+	std::vector<GLuint>					m_indices;
+	std::vector<Mesh>					m_meshes;
+	std::vector<Draw>					m_draws;
+	std::vector<DrawElementsIndirectCommand> m_commands;
+	osg::ref_ptr<const InstanceTransformStore>	m_matrixArray;
+
+	mutable GLuint						m_vao;
+	mutable GLuint						m_vbo;
+	mutable GLuint						m_ebo;
+	mutable GLuint						m_instancebo;
+	mutable GLuint						m_indirectbo;
+	mutable size_t						m_instanceBufferSize;	// allocated bytes, can be larger than the instances
+	mutable size_t						m_indirectBufferSize;
+	mutable bool						m_meshesDirty;
+	mutable bool						m_instancesDirty;
+	mutable bool						m_commandsDirty;
+	mutable size_t						m_dirtyInstanceStart;
+	mutable size_t						m_dirtyInstanceEnd;
+	mutable bool						m_multiDrawIndirect;
+	mutable bool						m_baseInstance;
+};
+
+/**
+ Cull callback of the geode of a batched drawable. Every chunk of instances owns one draw per level of detail,
+ the callback culls the chunks against the view frustum, enables the draw of the level that matches the
+ distance of the chunk and counts the drawn instances, draw calls and state changes.
+*/
+class BatchedChunkCullCallback : public osg::NodeCallback
+{
+public:
+	BatchedChunkCullCallback(osg::ref_ptr<BatchedInstancedDrawable> drawable, osg::ref_ptr<InstanceCullStatistics> statistics)
+		:	m_drawable(drawable),
+			m_statistics(statistics)
+	{
+	}
+
+	// a chunk up to the first switch distance draws level 0 and so on, without distances every chunk draws level 0
+	inline void setLodSwitchDistances(const std::vector<float>& switchDistances) { m_switchDistances = switchDistances; }
+
+	// the draws of the chunk are firstDraw to firstDraw + number of levels
+	void addChunk(unsigned int firstDraw, unsigned int numInstances, const osg::BoundingBox& bounds);
+	void setChunk(unsigned int chunk, unsigned int numInstances, const osg::BoundingBox& bounds);
+	inline void removeLastChunk() { m_chunks.pop_back(); }
+	inline unsigned int getNumChunks() const { return m_chunks.size(); }
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+private:
+	struct Chunk
+	{
+		unsigned int		firstDraw;
+		unsigned int		numInstances;
+		osg::BoundingBox	bounds;
+	};
+
+	osg::ref_ptr<BatchedInstancedDrawable>	m_drawable;
+	osg::ref_ptr<InstanceCullStatistics>	m_statistics;
+	std::vector<float>						m_switchDistances;
+	std::vector<Chunk>						m_chunks;
+};
+
+} // namespace osgExample
+
+#endif
\ No newline at end of file
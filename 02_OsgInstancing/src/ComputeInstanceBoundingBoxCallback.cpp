@@ -25,33 +25,23 @@
 #include <osg/Geometry>
 
 #include "ComputeInstanceBoundingBoxCallback.h"
+#include "InstanceBounds.h"
 
 namespace osgExample
 {
 
 osg::BoundingBox ComputeInstancedBoundingBoxCallback::computeBound(const osg::Drawable& drawable) const
 {
-	osg::BoundingBox bounds;
 	const osg::Geometry* geometry = dynamic_cast<const osg::Geometry*>(&drawable);
 
-	if (!geometry)
-		return bounds;
+	if (!geometry || !m_instanceMatrices->getFloatArray())
+		return osg::BoundingBox();
 
-	const osg::Vec3Array* vertices = dynamic_cast<const osg::Vec3Array*>(geometry->getVertexArray());
+	// transform the bounding box of the mesh instead of every vertex
+	osg::BoundingBox localBounds = computeVertexBounds(dynamic_cast<const osg::Vec3Array*>(geometry->getVertexArray()));
+	const osg::FloatArray* matrices = m_instanceMatrices->getFloatArray();
 
-	for (unsigned int i = 0; i < m_instanceMatrices->getNumElements(); ++i)
-	{
-		osg::Matrixd matrix;
-		m_instanceMatrices->getElement(i, matrix);
-
-
-		for (auto it = vertices->begin(); it != vertices->end(); ++it)
-		{
-			bounds.expandBy(*it * matrix);
-		}
-	}
-
-	return bounds;
+	return computeInstanceBounds(localBounds, matrices->empty() ? NULL : &(*matrices)[0], m_instanceMatrices->getNumElements());
 }
 
 }
\ No newline at end of file
@@ -26,29 +26,22 @@
 
 // osgExample
 #include "ComputeTextureBoundingBoxCallback.h"
+#include "InstanceBounds.h"
 
 namespace osgExample
 {
 
 osg::BoundingBox ComputeTextureBoundingBoxCallback::computeBound(const osg::Drawable& drawable) const
 {
-	osg::BoundingBox bounds;
 	const osg::Geometry* geometry = dynamic_cast<const osg::Geometry*>(&drawable);
 
-	if (!geometry)
-		return bounds;
+	if (!geometry || m_end <= m_start)
+		return osg::BoundingBox();
 
-	const osg::Vec3Array* vertices = dynamic_cast<const osg::Vec3Array*>(geometry->getVertexArray());
+	// transform the bounding box of the mesh instead of every vertex
+	osg::BoundingBox localBounds = computeVertexBounds(dynamic_cast<const osg::Vec3Array*>(geometry->getVertexArray()));
 
-	for (unsigned int i = 0; i < m_instanceMatrices.size(); ++i)
-	{
-		for (auto it = vertices->begin(); it != vertices->end(); ++it)
-		{
-			bounds.expandBy(*it * m_instanceMatrices[i]);
-		}
-	}
-
-	return bounds;
+	return computeInstanceBounds(localBounds, m_instanceMatrices->getData(m_start), m_end - m_start);
 }
 
 }
\ No newline at end of file
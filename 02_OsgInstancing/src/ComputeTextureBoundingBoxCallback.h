@@ -24,27 +24,34 @@
 #ifndef _COMPUTE_TEXTURE_BOUNDING_BOX_CALLBACK_H
 #define _COMPUTE_TEXTURE_BOUNDING_BOX_CALLBACK_H
 
-// std
-#include <vector>
-
 // osg
-#include <osg/Matrixd>
+#include <osg/ref_ptr>
 #include <osg/Drawable>
 
+// osgExample
+#include "InstanceTransformStore.h"
+
 namespace osgExample
 {
 
 class ComputeTextureBoundingBoxCallback : public osg::Drawable::ComputeBoundingBoxCallback
 {
 public:
-	ComputeTextureBoundingBoxCallback(std::vector<osg::Matrixd> instanceMatrices)
-		: m_instanceMatrices(instanceMatrices)
+	ComputeTextureBoundingBoxCallback(osg::ref_ptr<const InstanceTransformStore> instanceMatrices, size_t start, size_t end)
+		:	m_instanceMatrices(instanceMatrices),
+			m_start(start),
+			m_end(end)
 	{
 	}
 
+	// the drawable has to be dirtied after changing the range
+	inline void setRange(size_t start, size_t end) { m_start = start; m_end = end; }
+
 		virtual osg::BoundingBox computeBound(const osg::Drawable& drawable) const;
 private:
-	std::vector<osg::Matrixd> m_instanceMatrices;
+	osg::ref_ptr<const InstanceTransformStore>	m_instanceMatrices;
+	size_t										m_start;
+	size_t										m_end;
 };
 
 }
@@ -0,0 +1,59 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _COUNTER_RANDOM_H
+#define _COUNTER_RANDOM_H
+
+namespace osgExample
+{
+
+// integer hash with a low bias, every input bit affects every output bit
+inline unsigned int hashUInt(unsigned int value)
+{
+	value ^= value >> 16;
+	value *= 0x7feb352du;
+	value ^= value >> 15;
+	value *= 0x846ca68bu;
+	value ^= value >> 16;
+	return value;
+}
+
+/**
+ Counter based random numbers: the number only depends on the seed, the counter and the stream, so every
+ thread can draw the numbers of any instance in any order and the result is the same for the same seed. Use
+ the index of the instance as counter and a different stream for every value of an instance.
+*/
+inline unsigned int counterRandom(unsigned int seed, unsigned int counter, unsigned int stream)
+{
+	return hashUInt(counter + hashUInt(seed + hashUInt(stream)));
+}
+
+// uniform in [0, 1)
+inline float counterRandomFloat(unsigned int seed, unsigned int counter, unsigned int stream)
+{
+	return (counterRandom(seed, counter, stream) >> 8) * (1.0f / 16777216.0f);
+}
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _HEIGHT_MAP_SAMPLER_H
+#define _HEIGHT_MAP_SAMPLER_H
+
+// std
+#include <cstddef>
+
+namespace osgExample
+{
+
+/**
+ Batched sampling kernels for a resident row major height map. Coordinates are clamped to the
+ height map like in ASCFileLoader::getNearestHeight. The kernels use AVX2 if the compiler targets it,
+ SSE2 on every other x86 target and plain scalar code elsewhere.
+*/
+void sampleNearestHeights(const float* heightMap, unsigned int width, unsigned int height,
+						  const float* x, const float* y, float* heights, size_t count);
+void sampleBilinearHeights(const float* heightMap, unsigned int width, unsigned int height,
+						   const float* x, const float* y, float* heights, size_t count);
+
+// returns the name of the instruction set the kernels were compiled for
+const char* getHeightMapSamplerInstructionSet();
+
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "InstanceBounds.h"
+
+// std
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <cmath>
+#include <cfloat>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INSTANCE_BOUNDS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+// below this number of instances the threads cost more than they save
+const size_t MIN_INSTANCES_PER_THREAD = 64u * 1024u;
+
+void expandByInstances(osg::BoundingBox& bounds, const osg::BoundingBox& localBounds, const float* matrices, size_t count)
+{
+	osg::Vec3 center = localBounds.center();
+	osg::Vec3 extent = (localBounds._max - localBounds._min) * 0.5f;
+
+#ifdef INSTANCE_BOUNDS_SSE2
+	// osg uses row vectors, so the transformed center is a weighted sum of the matrix rows and the
+	// transformed extent the same sum over the absolute values of the rows
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 cx = _mm_set1_ps(center.x()), cy = _mm_set1_ps(center.y()), cz = _mm_set1_ps(center.z());
+	const __m128 ex = _mm_set1_ps(extent.x()), ey = _mm_set1_ps(extent.y()), ez = _mm_set1_ps(extent.z());
+	__m128 minimum = _mm_set1_ps(FLT_MAX);
+	__m128 maximum = _mm_set1_ps(-FLT_MAX);
+
+	for (size_t i = 0; i < count; ++i, matrices += 16)
+	{
+		__m128 row0 = _mm_loadu_ps(matrices);
+		__m128 row1 = _mm_loadu_ps(matrices + 4);
+		__m128 row2 = _mm_loadu_ps(matrices + 8);
+		__m128 row3 = _mm_loadu_ps(matrices + 12);
+
+		__m128 transformedCenter = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, row0), _mm_mul_ps(cy, row1)), _mm_add_ps(_mm_mul_ps(cz, row2), row3));
+		__m128 transformedExtent = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_and_ps(row0, absMask)), _mm_mul_ps(ey, _mm_and_ps(row1, absMask))), _mm_mul_ps(ez, _mm_and_ps(row2, absMask)));
+
+		minimum = _mm_min_ps(minimum, _mm_sub_ps(transformedCenter, transformedExtent));
+		maximum = _mm_max_ps(maximum, _mm_add_ps(transformedCenter, transformedExtent));
+	}
+
+	float minimumValues[4], maximumValues[4];
+	_mm_storeu_ps(minimumValues, minimum);
+	_mm_storeu_ps(maximumValues, maximum);
+	if (count)
+	{
+		bounds.expandBy(osg::Vec3(minimumValues[0], minimumValues[1], minimumValues[2]));
+		bounds.expandBy(osg::Vec3(maximumValues[0], maximumValues[1], maximumValues[2]));
+	}
+#else
+	for (size_t i = 0; i < count; ++i, matrices += 16)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			float transformedCenter = center.x() * matrices[j] + center.y() * matrices[4 + j] + center.z() * matrices[8 + j] + matrices[12 + j];
+			float transformedExtent = extent.x() * fabsf(matrices[j]) + extent.y() * fabsf(matrices[4 + j]) + extent.z() * fabsf(matrices[8 + j]);
+			bounds._min[j] = std::min(bounds._min[j], transformedCenter - transformedExtent);
+			bounds._max[j] = std::max(bounds._max[j], transformedCenter + transformedExtent);
+		}
+	}
+#endif
+}
+
+}
+
+namespace osgExample
+{
+
+osg::BoundingBox computeVertexBounds(const osg::Vec3Array* vertices)
+{
+	osg::BoundingBox bounds;
+	if (!vertices)
+		return bounds;
+
+	for (auto it = vertices->begin(); it != vertices->end(); ++it)
+	{
+		bounds.expandBy(*it);
+	}
+
+	return bounds;
+}
+
+osg::BoundingBox computeInstanceBounds(const osg::BoundingBox& localBounds, const float* matrices, size_t count)
+{
+	osg::BoundingBox bounds;
+	if (!localBounds.valid() || !matrices || !count)
+		return bounds;
+
+	size_t numThreads = std::min((size_t)std::max(std::thread::hardware_concurrency(), 1u), count / MIN_INSTANCES_PER_THREAD);
+	if (numThreads < 2)
+	{
+		expandByInstances(bounds, localBounds, matrices, count);
+		return bounds;
+	}
+
+	// every thread bounds a contiguous range of instances, the partial boxes are merged afterwards
+	std::vector<osg::BoundingBox> partialBounds(numThreads);
+	std::vector<std::thread> threads;
+	size_t instancesPerThread = (count + numThreads - 1) / numThreads;
+	for (size_t i = 0; i < numThreads; ++i)
+	{
+		size_t start = std::min(i * instancesPerThread, count);
+		size_t end = std::min(start + instancesPerThread, count);
+		threads.push_back(std::thread(expandByInstances, std::ref(partialBounds[i]), std::cref(localBounds), matrices + start * 16, end - start));
+	}
+
+	for (size_t i = 0; i < numThreads; ++i)
+	{
+		threads[i].join();
+		bounds.expandBy(partialBounds[i]);
+	}
+
+	return bounds;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_BOUNDS_H
+#define _INSTANCE_BOUNDS_H
+
+// std
+#include <cstddef>
+
+// osg
+#include <osg/BoundingBox>
+#include <osg/Array>
+
+namespace osgExample
+{
+
+/**
+ Bounds of many instances of one mesh in O(instances + vertices). Instead of transforming every vertex by every
+ instance matrix, the local bounding box of the mesh is transformed per instance(Arvo's method). The result is the
+ box around the transformed boxes, so it can be slightly larger than the exact bounds of rotated instances.
+ Matrices are tightly packed float mat4 in osg layout and have to be affine.
+*/
+osg::BoundingBox computeVertexBounds(const osg::Vec3Array* vertices);
+osg::BoundingBox computeInstanceBounds(const osg::BoundingBox& localBounds, const float* matrices, size_t count);
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "InstanceCullCallback.h"
+
+// std
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <iostream>
+
+// osg
+#include <osg/Group>
+#include <osgUtil/CullVisitor>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INSTANCE_CULLING_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+// instances per job, a multiple of four so blocks start at a block of the structure of arrays
+const size_t INSTANCES_PER_JOB = 16u * 1024u;
+
+}
+
+namespace osgExample
+{
+
+InstanceCullCallback::InstanceCullCallback(osg::ref_ptr<const InstanceTransformStore> transforms, const osg::BoundingBox& localBounds, size_t instanceSize)
+	:	m_transforms(transforms),
+		m_localCenter(localBounds.center()),
+		m_localRadius(localBounds.radius()),
+		m_instanceSize(instanceSize),
+		m_start(0u),
+		m_end(0u),
+		m_levels(1u),
+		m_culledBy(NULL),
+		m_culledTraversal(0u)
+{
+	m_levels[0].maxDistance2 = FLT_MAX;
+	m_levels[0].target = NULL;
+	m_levels[0].numVisibleInstances = 0u;
+	m_levels[0].visibleInstances.resize(1u);
+}
+
+void InstanceCullCallback::setLodSwitchDistances(const std::vector<float>& switchDistances)
+{
+	size_t numBlocks = m_levels[0].visibleInstances.size();
+	m_levels.resize(switchDistances.size() + 1u);
+	for (size_t i = 0; i < m_levels.size(); ++i)
+	{
+		Level& level = m_levels[i];
+		if (i > 0)
+		{
+			level.target = NULL;
+			level.numVisibleInstances = 0u;
+		}
+		level.maxDistance2 = i < switchDistances.size() ? switchDistances[i] * switchDistances[i] : FLT_MAX;
+		level.visibleInstances.resize(numBlocks);
+	}
+}
+
+void InstanceCullCallback::setTarget(GLvoid* target, CompactCallback compactCallback, unsigned int level)
+{
+	if (level >= m_levels.size())
+	{
+		std::cout << "Error: LOD level " << level << " of the instance culling does not exist." << std::endl;
+		return;
+	}
+
+	m_levels[level].target = static_cast<GLubyte*>(target);
+	m_levels[level].compactCallback = compactCallback;
+}
+
+unsigned int InstanceCullCallback::getNumVisibleInstances() const
+{
+	unsigned int numVisibleInstances = 0u;
+	for (auto it = m_levels.begin(); it != m_levels.end(); ++it)
+	{
+		numVisibleInstances += it->numVisibleInstances;
+	}
+	return numVisibleInstances;
+}
+
+void InstanceCullCallback::setRange(unsigned int start, unsigned int end)
+{
+	m_start = start;
+	m_end = end;
+
+	// the padding spheres lie behind every plane, so the last block of four needs no special case
+	size_t paddedSize = ((end - start) + 3u) & ~3u;
+	m_sourceData.resize((end - start) * m_instanceSize);
+	m_centerX.resize(paddedSize, 0.0f);
+	m_centerY.resize(paddedSize, 0.0f);
+	m_centerZ.resize(paddedSize, 0.0f);
+	m_radius.resize(paddedSize, -FLT_MAX);
+	std::fill(m_radius.begin() + (end - start), m_radius.end(), -FLT_MAX);
+	size_t numBlocks = std::max((paddedSize + INSTANCES_PER_JOB - 1) / INSTANCES_PER_JOB, (size_t)1u);
+	for (auto it = m_levels.begin(); it != m_levels.end(); ++it)
+	{
+		it->visibleInstances.resize(numBlocks);
+	}
+}
+
+void InstanceCullCallback::dirtyBounds(unsigned int start, unsigned int end)
+{
+	end = std::min(end, m_end);
+	for (unsigned int i = std::max(start, m_start); i < end; ++i)
+	{
+		const osg::Matrixf& transform = m_transforms->getTransform(i);
+		osg::Vec3 center = m_localCenter * transform;
+
+		// the largest axis scale of the transform bounds the scaled radius
+		float scale = std::max(std::max(osg::Vec3(transform(0, 0), transform(0, 1), transform(0, 2)).length2(),
+										osg::Vec3(transform(1, 0), transform(1, 1), transform(1, 2)).length2()),
+										osg::Vec3(transform(2, 0), transform(2, 1), transform(2, 2)).length2());
+
+		size_t index = i - m_start;
+		m_centerX[index] = center.x();
+		m_centerY[index] = center.y();
+		m_centerZ[index] = center.z();
+		m_radius[index] = m_localRadius * sqrtf(scale);
+	}
+}
+
+void InstanceCullCallback::cullInstances(const osg::Polytope& frustum, const osg::Vec3& eye, const osg::NodeVisitor* cullVisitor)
+{
+	m_culledBy = cullVisitor;
+	m_culledTraversal = cullVisitor ? cullVisitor->getTraversalNumber() : 0u;
+	for (auto it = m_levels.begin(); it != m_levels.end(); ++it)
+	{
+		it->numVisibleInstances = 0u;
+	}
+	if (!m_levels[0].target)
+		return;
+
+	const osg::Polytope::PlaneList& planes = frustum.getPlaneList();
+	size_t numInstances = m_end - m_start;
+	size_t numBlocks = (numInstances + INSTANCES_PER_JOB - 1) / INSTANCES_PER_JOB;
+	if (numBlocks < 2 || !m_jobSystem.valid() || m_jobSystem->getNumThreads() < 2)
+	{
+		cullBlock(planes, eye, 0, 0, numInstances);
+		for (auto it = m_levels.begin(); it != m_levels.end(); ++it)
+		{
+			gatherBlock(*it, 0, 0);
+			it->numVisibleInstances = it->visibleInstances[0].size();
+		}
+		return;
+	}
+
+	// every block writes to its own lists, so the jobs need no synchronisation
+	m_jobSystem->parallelFor(numBlocks, 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			cullBlock(planes, eye, i, i * INSTANCES_PER_JOB, std::min((i + 1) * INSTANCES_PER_JOB, numInstances));
+		}
+	});
+
+	// the prefix sum of the block sizes is where every block starts in the compacted data of its level
+	std::vector<size_t> offsets(numBlocks * m_levels.size());
+	for (size_t level = 0; level < m_levels.size(); ++level)
+	{
+		Level& currentLevel = m_levels[level];
+		for (size_t i = 0; i < numBlocks; ++i)
+		{
+			offsets[level * numBlocks + i] = currentLevel.numVisibleInstances;
+			currentLevel.numVisibleInstances += currentLevel.visibleInstances[i].size();
+		}
+	}
+
+	m_jobSystem->parallelFor(numBlocks * m_levels.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			gatherBlock(m_levels[i / numBlocks], i % numBlocks, offsets[i]);
+		}
+	});
+}
+
+void InstanceCullCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+	osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+	if (!cv || !m_levels[0].target)
+	{
+		traverse(node, nv);
+		return;
+	}
+
+	// the frustum of the current culling set is already in the coordinate system of the node, the traversal number is the frame number.
+	// a result culled in advance for another camera or an earlier frame, in which osg rejected the node, is stale
+	if (m_culledBy != cv || m_culledTraversal != cv->getTraversalNumber())
+		cullInstances(cv->getCurrentCullingSet().getFrustum(), cv->getEyeLocal());
+	m_culledBy = NULL;
+
+	unsigned int numVisibleInstances = 0u;
+	for (auto it = m_levels.begin(); it != m_levels.end(); ++it)
+	{
+		if (it->compactCallback)
+			it->compactCallback(it->numVisibleInstances);
+		numVisibleInstances += it->numVisibleInstances;
+	}
+	if (m_countCallback.valid())
+		m_countCallback->setNumInstances(numVisibleInstances);
+
+	// a draw with zero instances would draw a single one
+	if (numVisibleInstances)
+		traverse(node, nv);
+}
+
+void InstanceCullCallback::gatherBlock(const Level& level, size_t block, size_t offset) const
+{
+	if (!level.target)
+		return;
+
+	const std::vector<unsigned int>& visibleInstances = level.visibleInstances[block];
+	GLubyte* target = level.target + offset * m_instanceSize;
+	for (auto it = visibleInstances.begin(); it != visibleInstances.end(); ++it, target += m_instanceSize)
+	{
+		memcpy(target, &m_sourceData[*it * m_instanceSize], m_instanceSize);
+	}
+}
+
+void InstanceCullCallback::binInstance(const osg::Vec3& eye, size_t block, unsigned int index)
+{
+	if (m_levels.size() == 1)
+	{
+		m_levels[0].visibleInstances[block].push_back(index);
+		return;
+	}
+
+	float dx = m_centerX[index] - eye.x();
+	float dy = m_centerY[index] - eye.y();
+	float dz = m_centerZ[index] - eye.z();
+	float distance2 = dx * dx + dy * dy + dz * dz;
+
+	// the last level has no upper bound, so the search always ends
+	auto it = m_levels.begin();
+	while (distance2 >= it->maxDistance2)
+		++it;
+	it->visibleInstances[block].push_back(index);
+}
+
+void InstanceCullCallback::cullBlock(const osg::Polytope::PlaneList& planes, const osg::Vec3& eye, size_t block, size_t begin, size_t end)
+{
+	for (auto it = m_levels.begin(); it != m_levels.end(); ++it)
+	{
+		it->visibleInstances[block].clear();
+	}
+
+#ifdef INSTANCE_CULLING_SSE2
+	// the spheres are padded to a multiple of four, the padding is never visible
+	for (size_t i = begin; i < end; i += 4)
+	{
+		__m128 centerX = _mm_loadu_ps(&m_centerX[i]);
+		__m128 centerY = _mm_loadu_ps(&m_centerY[i]);
+		__m128 centerZ = _mm_loadu_ps(&m_centerZ[i]);
+		__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&m_radius[i]));
+
+		// a sphere is visible if it is not completely behind any plane
+		__m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (auto it = planes.begin(); it != planes.end(); ++it)
+		{
+			const osg::Vec4 plane = it->asVec4();
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(plane.x())), _mm_mul_ps(centerY, _mm_set1_ps(plane.y()))),
+										 _mm_add_ps(_mm_mul_ps(centerZ, _mm_set1_ps(plane.z())), _mm_set1_ps(plane.w())));
+			visible = _mm_and_ps(visible, _mm_cmpge_ps(distance, negativeRadius));
+		}
+
+		int mask = _mm_movemask_ps(visible);
+		while (mask)
+		{
+			unsigned int lane = 0;
+			while (!(mask & (1 << lane)))
+				++lane;
+			if (i + lane < end)
+				binInstance(eye, block, i + lane);
+			mask &= mask - 1;
+		}
+	}
+#else
+	for (size_t i = begin; i < end; ++i)
+	{
+		bool visible = true;
+		for (auto it = planes.begin(); it != planes.end() && visible; ++it)
+		{
+			const osg::Vec4 plane = it->asVec4();
+			visible = m_centerX[i] * plane.x() + m_centerY[i] * plane.y() + m_centerZ[i] * plane.z() + plane.w() >= -m_radius[i];
+		}
+		if (visible)
+			binInstance(eye, block, i);
+	}
+#endif
+}
+
+void ParallelChunkCullCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+	osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+	osg::Group* group = node->asGroup();
+	if (cv && group && m_chunks.size() == group->getNumChildren())
+	{
+		const osg::Polytope& frustum = cv->getCurrentCullingSet().getFrustum();
+		const osg::Vec3 eye = cv->getEyeLocal();
+		m_jobSystem->parallelFor(m_chunks.size(), 1, [&](size_t begin, size_t end)
+		{
+			// chunks outside of the frustum are culled by osg anyway
+			osg::Polytope chunkFrustum(frustum);
+			for (size_t i = begin; i < end; ++i)
+			{
+				if (chunkFrustum.contains(group->getChild(i)->getBound()))
+					m_chunks[i]->cullInstances(frustum, eye, cv);
+			}
+		});
+	}
+
+	traverse(node, nv);
+}
+
+}
\ No newline at end of file
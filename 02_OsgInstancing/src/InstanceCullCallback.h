@@ -0,0 +1,145 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_CULL_CALLBACK_H
+#define _INSTANCE_CULL_CALLBACK_H
+
+// std
+#include <vector>
+#include <functional>
+
+// osg
+#include <osg/ref_ptr>
+#include <osg/GL>
+#include <osg/Node>
+#include <osg/NodeVisitor>
+#include <osg/Polytope>
+#include <osg/BoundingBox>
+
+// osgExample
+#include "InstanceTransformStore.h"
+#include "InstanceCullStatistics.h"
+#include "JobSystem.h"
+
+namespace osgExample
+{
+
+/**
+ Culls the single instances of a chunk against the view frustum during the cull traversal. The instance data of the
+ chunk is kept in a source copy with instanceSize bytes per instance and the visible instances are gathered from it
+ into the target, which is the data the shader reads. Afterwards the compact callback gets the number of visible
+ instances, so it can dirty the target and set the instance count. Chunks without visible instances are not traversed.
+ The bounds of the instances are spheres kept as structure of arrays, so four of them are tested at once. With a job
+ system large chunks are split into blocks that are culled in parallel, every block writes its own list of visible
+ instances and a prefix sum over their sizes gives the offsets for the gather, so no locks are needed.
+ With level of detail the visible instances are binned by their distance to the eye and every level gathers its
+ instances into its own target.
+*/
+class InstanceCullCallback : public osg::NodeCallback
+{
+public:
+	typedef std::function<void(unsigned int numVisibleInstances)> CompactCallback;
+
+	InstanceCullCallback(osg::ref_ptr<const InstanceTransformStore> transforms, const osg::BoundingBox& localBounds, size_t instanceSize);
+
+	// instances [start-end) of the transform store, the bounds of added instances have to be dirtied
+	void setRange(unsigned int start, unsigned int end);
+	// recomputes the bounds of the instances [start-end) from the transform store
+	void dirtyBounds(unsigned int start, unsigned int end);
+
+	inline GLubyte* getSourceData(unsigned int index) { return &m_sourceData[(index - m_start) * m_instanceSize]; }
+	inline unsigned int getSourceSize() const { return m_end - m_start; }
+	// instances up to the first switch distance go to level 0, up to the second one to level 1 and so on
+	void setLodSwitchDistances(const std::vector<float>& switchDistances);
+	inline unsigned int getNumLevels() const { return m_levels.size(); }
+	void setTarget(GLvoid* target, CompactCallback compactCallback, unsigned int level = 0);
+	// the count callback is set to the number of visible instances
+	inline void setCountCallback(osg::ref_ptr<CountInstancesCullCallback> countCallback) { m_countCallback = countCallback; }
+	inline void setJobSystem(osg::ref_ptr<JobSystem> jobSystem) { m_jobSystem = jobSystem; }
+
+	// culls and gathers the instances, the next traversal of the node by the same cull visitor in the same frame uses the result instead of culling again
+	void cullInstances(const osg::Polytope& frustum, const osg::Vec3& eye, const osg::NodeVisitor* cullVisitor = NULL);
+	unsigned int getNumVisibleInstances() const;
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+private:
+	struct Level
+	{
+		float										maxDistance2;
+		GLubyte*									target;
+		CompactCallback								compactCallback;
+		unsigned int								numVisibleInstances;
+		std::vector<std::vector<unsigned int> >		visibleInstances;	// per block
+	};
+
+	void cullBlock(const osg::Polytope::PlaneList& planes, const osg::Vec3& eye, size_t block, size_t begin, size_t end);
+	void gatherBlock(const Level& level, size_t block, size_t offset) const;
+	void binInstance(const osg::Vec3& eye, size_t block, unsigned int index);
+
+	osg::ref_ptr<const InstanceTransformStore>	m_transforms;
+	osg::Vec3									m_localCenter;
+	float										m_localRadius;
+	size_t										m_instanceSize;
+	unsigned int								m_start;
+	unsigned int								m_end;
+	std::vector<GLubyte>						m_sourceData;
+	std::vector<Level>							m_levels;
+	osg::ref_ptr<CountInstancesCullCallback>	m_countCallback;
+	osg::ref_ptr<JobSystem>						m_jobSystem;
+	// the traversal the instances were culled for in advance, other cameras and later frames cull again
+	const osg::NodeVisitor*						m_culledBy;
+	unsigned int								m_culledTraversal;
+
+	// bounding spheres of the instances, padded to a multiple of four with spheres that are never visible
+	std::vector<float>							m_centerX;
+	std::vector<float>							m_centerY;
+	std::vector<float>							m_centerZ;
+	std::vector<float>							m_radius;
+};
+
+/**
+ Cull callback for the group of all chunks of a node, culls the instances of all visible chunks in parallel
+ before osg traverses the chunks. The chunks have to be added in the order of the children of the group.
+*/
+class ParallelChunkCullCallback : public osg::NodeCallback
+{
+public:
+	ParallelChunkCullCallback(osg::ref_ptr<JobSystem> jobSystem)
+		:	m_jobSystem(jobSystem)
+	{
+	}
+
+	inline void addChunk(osg::ref_ptr<InstanceCullCallback> chunk) { m_chunks.push_back(chunk); }
+	inline void removeLastChunk() { m_chunks.pop_back(); }
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+private:
+	osg::ref_ptr<JobSystem>								m_jobSystem;
+	std::vector<osg::ref_ptr<InstanceCullCallback> >	m_chunks;
+};
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_CULL_STATISTICS_H
+#define _INSTANCE_CULL_STATISTICS_H
+
+// std
+#include <mutex>
+
+// osg
+#include <osg/ref_ptr>
+#include <osg/Referenced>
+#include <osg/Node>
+#include <osg/NodeVisitor>
+
+namespace osgExample
+{
+
+/**
+ Counts how many instances survive view frustum culling and how many draw calls and state changes draw them.
+ The cull callbacks of the instance chunks add to the current frame, nextFrame() has to be called once per frame
+ before the cull traversal.
+*/
+class InstanceCullStatistics : public osg::Referenced
+{
+public:
+	InstanceCullStatistics()
+		:	m_numInstances(0),
+			m_drawnInstances(0),
+			m_drawCalls(0),
+			m_stateChanges(0),
+			m_lastFrameDrawnInstances(0),
+			m_lastFrameDrawCalls(0),
+			m_lastFrameStateChanges(0)
+	{
+	}
+
+	inline void setNumInstances(size_t numInstances) { std::lock_guard<std::mutex> lock(m_mutex); m_numInstances = numInstances; }
+	inline void addDrawnInstances(size_t numInstances) { std::lock_guard<std::mutex> lock(m_mutex); m_drawnInstances += numInstances; }
+	// a state change is a state set, uniform or transform that has to be applied before a draw call
+	inline void addDrawCalls(size_t drawCalls, size_t stateChanges) { std::lock_guard<std::mutex> lock(m_mutex); m_drawCalls += drawCalls; m_stateChanges += stateChanges; }
+
+	// finishes the counts of the last frame and starts counting the next one
+	inline void nextFrame()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_lastFrameDrawnInstances = m_drawnInstances;
+		m_lastFrameDrawCalls = m_drawCalls;
+		m_lastFrameStateChanges = m_stateChanges;
+		m_drawnInstances = 0;
+		m_drawCalls = 0;
+		m_stateChanges = 0;
+	}
+
+	inline size_t getNumInstances() const { std::lock_guard<std::mutex> lock(m_mutex); return m_numInstances; }
+	inline size_t getLastFrameDrawnInstances() const { std::lock_guard<std::mutex> lock(m_mutex); return m_lastFrameDrawnInstances; }
+	inline size_t getLastFrameDrawCalls() const { std::lock_guard<std::mutex> lock(m_mutex); return m_lastFrameDrawCalls; }
+	inline size_t getLastFrameStateChanges() const { std::lock_guard<std::mutex> lock(m_mutex); return m_lastFrameStateChanges; }
+	inline size_t getLastFrameCulledInstances() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_numInstances > m_lastFrameDrawnInstances ? m_numInstances - m_lastFrameDrawnInstances : 0;
+	}
+
+protected:
+	virtual ~InstanceCullStatistics() {}
+
+private:
+	mutable std::mutex	m_mutex;
+	size_t				m_numInstances;
+	size_t				m_drawnInstances;
+	size_t				m_drawCalls;
+	size_t				m_stateChanges;
+	size_t				m_lastFrameDrawnInstances;
+	size_t				m_lastFrameDrawCalls;
+	size_t				m_lastFrameStateChanges;
+};
+
+/**
+ Cull callback for a chunk of instances, only called by osg if the chunk was not culled
+*/
+class CountInstancesCullCallback : public osg::NodeCallback
+{
+public:
+	CountInstancesCullCallback(osg::ref_ptr<InstanceCullStatistics> statistics, size_t numInstances, size_t numDrawCalls = 1, size_t numStateChanges = 1)
+		:	m_statistics(statistics),
+			m_numInstances(numInstances),
+			m_numDrawCalls(numDrawCalls),
+			m_numStateChanges(numStateChanges)
+	{
+	}
+
+	inline void setNumInstances(size_t numInstances) { m_numInstances = numInstances; }
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+	{
+		m_statistics->addDrawnInstances(m_numInstances);
+		m_statistics->addDrawCalls(m_numDrawCalls, m_numStateChanges);
+		traverse(node, nv);
+	}
+
+private:
+	osg::ref_ptr<InstanceCullStatistics>	m_statistics;
+	size_t									m_numInstances;
+	size_t									m_numDrawCalls;
+	size_t									m_numStateChanges;
+};
+
+}
+
+#endif
\ No newline at end of file
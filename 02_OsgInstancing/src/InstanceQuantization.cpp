@@ -0,0 +1,222 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "InstanceQuantization.h"
+
+// std
+#define _USE_MATH_DEFINES 1 // fix for visual studio
+#include <cmath>
+#include <algorithm>
+#include <cfloat>
+
+// osg
+#include <osg/Uniform>
+
+namespace
+{
+
+const unsigned int	POSITION_BITS = 16u;
+const unsigned int	ANGLE_BITS = 10u;
+const unsigned int	SCALE_BITS = 6u;
+const float			POSITION_STEPS = (float)((1u << POSITION_BITS) - 1u);
+const float			ANGLE_STEPS = (float)(1u << ANGLE_BITS);
+const float			SCALE_STEPS = (float)((1u << SCALE_BITS) - 1u);
+
+// relative tolerance when checking if a transform only has translation, z rotation and uniform scale
+const float			DECOMPOSE_TOLERANCE = 1e-4f;
+
+inline GLuint quantizeValue(float value, float origin, float extent, float steps)
+{
+	if (extent <= 0.0f)
+		return 0u;
+
+	float normalized = std::min(std::max((value - origin) / extent, 0.0f), 1.0f);
+	return (GLuint)(normalized * steps + 0.5f);
+}
+
+inline void packInstance(const osg::Vec3& position, float angle, float scale, const osgExample::InstanceQuantization::Range& range, GLuint* output)
+{
+	GLuint x = quantizeValue(position.x(), range.origin.x(), range.extent.x(), POSITION_STEPS);
+	GLuint y = quantizeValue(position.y(), range.origin.y(), range.extent.y(), POSITION_STEPS);
+	GLuint z = quantizeValue(position.z(), range.origin.z(), range.extent.z(), POSITION_STEPS);
+	GLuint a = (GLuint)(angle / (2.0f * (float)M_PI) * ANGLE_STEPS + 0.5f) & ((1u << ANGLE_BITS) - 1u);
+	GLuint s = quantizeValue(scale, range.scaleRange.x(), range.scaleRange.y() - range.scaleRange.x(), SCALE_STEPS);
+
+	output[0] = x | (y << POSITION_BITS);
+	output[1] = z | (a << POSITION_BITS) | (s << (POSITION_BITS + ANGLE_BITS));
+}
+
+}
+
+namespace osgExample
+{
+
+bool InstanceQuantization::decompose(const osg::Matrixf& transform, osg::Vec3& position, float& angle, float& scale)
+{
+	// osg uses row vectors, so a scale * rotate * translate transform has the rotated and scaled axes in its rows
+	scale = sqrtf(transform(0, 0) * transform(0, 0) + transform(0, 1) * transform(0, 1));
+	angle = atan2f(transform(0, 1), transform(0, 0));
+	if (angle < 0.0f)
+		angle += 2.0f * (float)M_PI;
+	position.set(transform(3, 0), transform(3, 1), transform(3, 2));
+
+	float tolerance = DECOMPOSE_TOLERANCE * std::max(scale, 1.0f);
+	return scale > 0.0f &&
+		   fabsf(transform(1, 0) + transform(0, 1)) <= tolerance &&
+		   fabsf(transform(1, 1) - transform(0, 0)) <= tolerance &&
+		   fabsf(transform(2, 2) - scale) <= tolerance &&
+		   fabsf(transform(0, 2)) <= tolerance && fabsf(transform(1, 2)) <= tolerance &&
+		   fabsf(transform(2, 0)) <= tolerance && fabsf(transform(2, 1)) <= tolerance &&
+		   fabsf(transform(0, 3)) <= tolerance && fabsf(transform(1, 3)) <= tolerance &&
+		   fabsf(transform(2, 3)) <= tolerance && fabsf(transform(3, 3) - 1.0f) <= tolerance;
+}
+
+bool InstanceQuantization::canQuantize(const InstanceTransformStore& transforms, size_t start, size_t end)
+{
+	osg::Vec3 position;
+	float angle, scale;
+	for (size_t i = start; i < end; ++i)
+	{
+		if (!decompose(transforms.getTransform(i), position, angle, scale))
+			return false;
+	}
+
+	return true;
+}
+
+InstanceQuantization::Range InstanceQuantization::quantize(const InstanceTransformStore& transforms, size_t start, size_t end, GLuint* output)
+{
+	Range range;
+	if (end <= start)
+		return range;
+
+	// first find the bounds of the chunk
+	osg::Vec3 minPosition(FLT_MAX, FLT_MAX, FLT_MAX);
+	osg::Vec3 maxPosition(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	float minScale = FLT_MAX;
+	float maxScale = -FLT_MAX;
+	osg::Vec3 position;
+	float angle, scale;
+	for (size_t i = start; i < end; ++i)
+	{
+		decompose(transforms.getTransform(i), position, angle, scale);
+		for (int k = 0; k < 3; ++k)
+		{
+			minPosition[k] = std::min(minPosition[k], position[k]);
+			maxPosition[k] = std::max(maxPosition[k], position[k]);
+		}
+		minScale = std::min(minScale, scale);
+		maxScale = std::max(maxScale, scale);
+	}
+
+	range.origin = minPosition;
+	range.extent = maxPosition - minPosition;
+	range.scaleRange.set(minScale, maxScale);
+
+	// then pack every instance relative to the bounds
+	for (size_t i = start; i < end; ++i, output += WORDS_PER_INSTANCE)
+	{
+		decompose(transforms.getTransform(i), position, angle, scale);
+		packInstance(position, angle, scale, range, output);
+	}
+
+	return range;
+}
+
+bool InstanceQuantization::quantizeInstance(const osg::Matrixf& transform, const Range& range, GLuint* output)
+{
+	osg::Vec3 position;
+	float angle, scale;
+	if (!decompose(transform, position, angle, scale))
+		return false;
+
+	// values outside the range would be clamped, so the caller has to quantize the whole chunk again
+	for (int k = 0; k < 3; ++k)
+	{
+		if (position[k] < range.origin[k] || position[k] > range.origin[k] + range.extent[k])
+			return false;
+	}
+	if (scale < range.scaleRange.x() || scale > range.scaleRange.y())
+		return false;
+
+	packInstance(position, angle, scale, range, output);
+	return true;
+}
+
+osg::Matrixf InstanceQuantization::dequantize(const GLuint* input, const Range& range)
+{
+	const GLuint positionMask = (1u << POSITION_BITS) - 1u;
+	osg::Vec3 position(range.origin.x() + range.extent.x() * (float)(input[0] & positionMask) / POSITION_STEPS,
+					   range.origin.y() + range.extent.y() * (float)(input[0] >> POSITION_BITS) / POSITION_STEPS,
+					   range.origin.z() + range.extent.z() * (float)(input[1] & positionMask) / POSITION_STEPS);
+	float angle = (float)((input[1] >> POSITION_BITS) & ((1u << ANGLE_BITS) - 1u)) * (2.0f * (float)M_PI / ANGLE_STEPS);
+	float scale = range.scaleRange.x() + (range.scaleRange.y() - range.scaleRange.x()) * (float)(input[1] >> (POSITION_BITS + ANGLE_BITS)) / SCALE_STEPS;
+
+	float c = cosf(angle) * scale;
+	float s = sinf(angle) * scale;
+	return osg::Matrixf(c,    s,    0.0f,  0.0f,
+						-s,   c,    0.0f,  0.0f,
+						0.0f, 0.0f, scale, 0.0f,
+						position.x(), position.y(), position.z(), 1.0f);
+}
+
+void InstanceQuantization::setRangeUniforms(osg::StateSet* stateSet, const Range& range)
+{
+	osg::Uniform* origin = stateSet->getUniform("instanceOrigin");
+	osg::Uniform* extent = stateSet->getUniform("instanceExtent");
+	osg::Uniform* scaleRange = stateSet->getUniform("instanceScaleRange");
+
+	if (origin && extent && scaleRange)
+	{
+		origin->set(range.origin);
+		extent->set(range.extent);
+		scaleRange->set(range.scaleRange);
+	} else {
+		stateSet->addUniform(new osg::Uniform("instanceOrigin", range.origin));
+		stateSet->addUniform(new osg::Uniform("instanceExtent", range.extent));
+		stateSet->addUniform(new osg::Uniform("instanceScaleRange", range.scaleRange));
+	}
+}
+
+std::string InstanceQuantization::getShaderDefinition()
+{
+	return	"#define QUANTIZED_INSTANCES 1\n"
+			"uniform vec3 instanceOrigin;\n"
+			"uniform vec3 instanceExtent;\n"
+			"uniform vec2 instanceScaleRange;\n"
+			"\n"
+			"mat4 decodeInstanceModelMatrix(uvec2 data)\n"
+			"{\n"
+			"	vec3 position = instanceOrigin + instanceExtent * vec3(float(data.x & 0xFFFFu), float(data.x >> 16u), float(data.y & 0xFFFFu)) / 65535.0;\n"
+			"	float angle = float((data.y >> 16u) & 0x3FFu) * (6.283185307 / 1024.0);\n"
+			"	float scale = instanceScaleRange.x + (instanceScaleRange.y - instanceScaleRange.x) * float(data.y >> 26u) / 63.0;\n"
+			"	float c = cos(angle) * scale;\n"
+			"	float s = sin(angle) * scale;\n"
+			"	return mat4(c, s, 0.0, 0.0,\n"
+			"				-s, c, 0.0, 0.0,\n"
+			"				0.0, 0.0, scale, 0.0,\n"
+			"				position, 1.0);\n"
+			"}\n";
+}
+
+}
@@ -0,0 +1,90 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_QUANTIZATION_H
+#define _INSTANCE_QUANTIZATION_H
+
+// std
+#include <string>
+
+// osg
+#include <osg/ref_ptr>
+#include <osg/Array>
+#include <osg/StateSet>
+#include <osg/Vec2>
+#include <osg/Vec3>
+
+// osgExample
+#include "InstanceTransformStore.h"
+
+namespace osgExample
+{
+
+/**
+ Compressed instance format for transforms made of a translation, a rotation about the z axis and an uniform scale.
+ Every instance is packed into two 32 bit words:
+   word 0: x(16 bit) | y(16 bit)
+   word 1: z(16 bit) | angle(10 bit) | scale(6 bit)
+ Positions are quantized relative to the bounds of the chunk, scales relative to the scale range of the chunk.
+ The vertex shader rebuilds the model matrix with decodeInstanceModelMatrix().
+*/
+class InstanceQuantization
+{
+public:
+	// number of 32 bit words per instance
+	static const unsigned int WORDS_PER_INSTANCE = 2u;
+
+	struct Range
+	{
+		Range() : origin(0.0f, 0.0f, 0.0f), extent(0.0f, 0.0f, 0.0f), scaleRange(1.0f, 1.0f) {}
+
+		osg::Vec3 origin;
+		osg::Vec3 extent;
+		osg::Vec2 scaleRange;
+	};
+
+	// splits a transform into position, angle about z and uniform scale, returns false if it has any other components
+	static bool decompose(const osg::Matrixf& transform, osg::Vec3& position, float& angle, float& scale);
+
+	// returns true if every transform in [start-end) can be quantized
+	static bool canQuantize(const InstanceTransformStore& transforms, size_t start, size_t end);
+
+	// quantizes the transforms in [start-end) into WORDS_PER_INSTANCE words each, starting at output
+	static Range quantize(const InstanceTransformStore& transforms, size_t start, size_t end, GLuint* output);
+
+	// quantizes a single transform into an existing range, returns false if it does not fit into the range
+	static bool quantizeInstance(const osg::Matrixf& transform, const Range& range, GLuint* output);
+
+	// reconstructs the transform the shader computes, used for bounds and validation
+	static osg::Matrixf dequantize(const GLuint* input, const Range& range);
+
+	// adds or updates the uniforms the shader needs to decode the instances of one chunk
+	static void setRangeUniforms(osg::StateSet* stateSet, const Range& range);
+
+	// glsl uniforms and decode function, has to be inserted after the #version line of a shader
+	static std::string getShaderDefinition();
+};
+
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <GL/glew.h>
+
+// std
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+#include "InstanceRingBuffer.h"
+
+namespace
+{
+
+// offsets of vertex attributes should be aligned, 256 bytes also satisfy the alignment of uniform buffers
+const size_t SEGMENT_ALIGNMENT = 256u;
+
+// waits at most one second per try, a longer wait means the gpu is stuck anyway
+const GLuint64 FENCE_TIMEOUT = 1000000000u;
+
+}
+
+namespace osgExample
+{
+
+InstanceRingBuffer::InstanceRingBuffer()
+	:	m_buffer(0u),
+		m_segmentSize(0u),
+		m_segment(0u),
+		m_mappedData(NULL)
+{
+	std::fill(m_fences, m_fences + NUM_SEGMENTS, (void*)NULL);
+}
+
+GLintptr InstanceRingBuffer::write(const GLvoid* data, size_t size)
+{
+	if (!m_buffer || size > m_segmentSize)
+		allocate(size);
+
+	m_segment = (m_segment + 1) % NUM_SEGMENTS;
+	GLintptr offset = m_segment * m_segmentSize;
+
+	if (m_mappedData)
+	{
+		// the gpu may still read the segment from NUM_SEGMENTS frames ago
+		waitForSegment(m_segment);
+		if (size)
+			memcpy(m_mappedData + offset, data, size);
+	} else {
+		// without persistent mapping the driver hands out new storage, so the data in use is never overwritten
+		offset = 0;
+		glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+		glBufferData(GL_ARRAY_BUFFER, m_segmentSize, NULL, GL_STREAM_DRAW);
+		if (size)
+			glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	return offset;
+}
+
+void InstanceRingBuffer::fence()
+{
+	if (!m_mappedData)
+		return;
+
+	if (m_fences[m_segment])
+		glDeleteSync(static_cast<GLsync>(m_fences[m_segment]));
+	m_fences[m_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void InstanceRingBuffer::release()
+{
+	for (unsigned int i = 0; i < NUM_SEGMENTS; ++i)
+	{
+		if (m_fences[i])
+			glDeleteSync(static_cast<GLsync>(m_fences[i]));
+		m_fences[i] = NULL;
+	}
+
+	if (m_buffer)
+	{
+		if (m_mappedData)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &m_buffer);
+	}
+	m_buffer = 0u;
+	m_mappedData = NULL;
+	m_segmentSize = 0u;
+	m_segment = 0u;
+}
+
+void InstanceRingBuffer::allocate(size_t segmentSize)
+{
+	// storage of persistent buffers is immutable, so growing always starts with a new buffer
+	for (unsigned int i = 0; i < NUM_SEGMENTS; ++i)
+	{
+		waitForSegment(i);
+	}
+	release();
+
+	// leave room for added instances, so not every added instance reallocates the buffer
+	m_segmentSize = std::max(segmentSize + segmentSize / 2, SEGMENT_ALIGNMENT);
+	m_segmentSize = (m_segmentSize + SEGMENT_ALIGNMENT - 1) / SEGMENT_ALIGNMENT * SEGMENT_ALIGNMENT;
+
+	glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+	if (GLEW_ARB_buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, m_segmentSize * NUM_SEGMENTS, NULL, flags);
+		m_mappedData = static_cast<GLubyte*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, m_segmentSize * NUM_SEGMENTS, flags));
+		if (!m_mappedData)
+			std::cout << "Warning: Could not map instance ring buffer persistently, orphaning it every frame" << std::endl;
+	}
+	if (!m_mappedData)
+	{
+		// a mutable buffer with a single segment, it is orphaned on every write
+		if (GLEW_ARB_buffer_storage)
+		{
+			glDeleteBuffers(1, &m_buffer);
+			glGenBuffers(1, &m_buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+		}
+		glBufferData(GL_ARRAY_BUFFER, m_segmentSize, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstanceRingBuffer::waitForSegment(unsigned int segment)
+{
+	if (!m_fences[segment])
+		return;
+
+	GLsync fence = static_cast<GLsync>(m_fences[segment]);
+	GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+	while (result == GL_TIMEOUT_EXPIRED)
+	{
+		result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+	}
+	glDeleteSync(fence);
+	m_fences[segment] = NULL;
+}
+
+}
\ No newline at end of file
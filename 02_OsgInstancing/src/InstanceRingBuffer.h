@@ -0,0 +1,76 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_RING_BUFFER_H
+#define _INSTANCE_RING_BUFFER_H
+
+// std
+#include <cstddef>
+
+// osg
+#include <osg/GL>
+
+namespace osgExample
+{
+
+/**
+ Streams instance data that changes every frame through a buffer with NUM_SEGMENTS segments. Every frame writes the
+ next segment, so the cpu fills the data of the next frame while the gpu still reads the previous ones. With
+ ARB_buffer_storage the buffer is mapped persistently once and a fence per segment guards against overwriting data
+ that is still read, otherwise the buffer is orphaned every frame. All functions need a current context.
+*/
+class InstanceRingBuffer
+{
+public:
+	static const unsigned int NUM_SEGMENTS = 3;
+
+	InstanceRingBuffer();
+
+	// copies size bytes into the next segment and returns its offset in the buffer
+	GLintptr write(const GLvoid* data, size_t size);
+	// has to be called after the draw that reads the segment of the last write
+	void fence();
+	void release();
+
+	inline GLuint getBuffer() const { return m_buffer; }
+	inline bool isPersistent() const { return m_mappedData != NULL; }
+
+private:
+	// the buffer belongs to a single drawable
+	InstanceRingBuffer(const InstanceRingBuffer&);
+	InstanceRingBuffer& operator=(const InstanceRingBuffer&);
+
+	void allocate(size_t segmentSize);
+	void waitForSegment(unsigned int segment);
+
+	GLuint			m_buffer;
+	size_t			m_segmentSize;
+	unsigned int	m_segment;
+	GLubyte*		m_mappedData;
+	// GLsync of every segment, glew can not be included in headers that osg includes before it
+	void*			m_fences[NUM_SEGMENTS];
+};
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,116 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <GL/glew.h>
+
+// std
+#include <algorithm>
+
+#include "InstanceTextureSubloadCallback.h"
+
+namespace osgExample
+{
+
+InstanceTextureSubloadCallback::InstanceTextureSubloadCallback(osg::ref_ptr<osg::Image> image)
+	:	m_image(image),
+		m_dirtyStart(0u),
+		m_dirtyEnd(0u)
+{
+}
+
+void InstanceTextureSubloadCallback::dirtyTexels(unsigned int start, unsigned int end)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_dirtyStart < m_dirtyEnd)
+	{
+		m_dirtyStart = std::min(m_dirtyStart, start);
+		m_dirtyEnd = std::max(m_dirtyEnd, end);
+	} else {
+		m_dirtyStart = start;
+		m_dirtyEnd = end;
+	}
+}
+
+void InstanceTextureSubloadCallback::load(const osg::TextureRectangle& texture, osg::State& state) const
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_dirtyStart = m_dirtyEnd = 0u;
+	}
+
+	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, texture.getInternalFormat(), m_image->s(), m_image->t(), 0,
+				 m_image->getPixelFormat(), m_image->getDataType(), m_image->data());
+}
+
+void InstanceTextureSubloadCallback::subload(const osg::TextureRectangle& texture, osg::State& state) const
+{
+	unsigned int start, end;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		start = m_dirtyStart;
+		end = std::min(m_dirtyEnd, (unsigned int)(m_image->s() * m_image->t()));
+		m_dirtyStart = m_dirtyEnd = 0u;
+	}
+
+	if (start < end)
+		uploadTexels(start, end);
+}
+
+void InstanceTextureSubloadCallback::uploadTexels(unsigned int start, unsigned int end) const
+{
+	unsigned int width = m_image->s();
+	unsigned int firstRow = start / width;
+	unsigned int lastRow = (end - 1) / width;
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+
+	// a range inside one row is a single upload, otherwise the partial first and last rows frame a block of full rows
+	if (firstRow == lastRow)
+	{
+		glTexSubImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, start % width, firstRow, end - start, 1,
+						m_image->getPixelFormat(), m_image->getDataType(), m_image->data(start % width, firstRow));
+	} else {
+		unsigned int firstFullRow = (start % width) ? firstRow + 1 : firstRow;
+		unsigned int lastFullRow = (end % width) ? lastRow : lastRow + 1;
+
+		if (firstFullRow != firstRow)
+		{
+			glTexSubImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, start % width, firstRow, width - start % width, 1,
+							m_image->getPixelFormat(), m_image->getDataType(), m_image->data(start % width, firstRow));
+		}
+		if (firstFullRow < lastFullRow)
+		{
+			glTexSubImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, 0, firstFullRow, width, lastFullRow - firstFullRow,
+							m_image->getPixelFormat(), m_image->getDataType(), m_image->data(0, firstFullRow));
+		}
+		if (lastFullRow == lastRow)
+		{
+			glTexSubImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, 0, lastRow, end % width, 1,
+							m_image->getPixelFormat(), m_image->getDataType(), m_image->data(0, lastRow));
+		}
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_TEXTURE_SUBLOAD_CALLBACK_H
+#define _INSTANCE_TEXTURE_SUBLOAD_CALLBACK_H
+
+// std
+#include <mutex>
+
+// osg
+#include <osg/ref_ptr>
+#include <osg/Image>
+#include <osg/TextureRectangle>
+
+namespace osgExample
+{
+
+/**
+ Uploads an instance texture once and afterwards only the texels that were marked as dirty,
+ instead of the whole image like osg does after Image::dirty()
+*/
+class InstanceTextureSubloadCallback : public osg::TextureRectangle::SubloadCallback
+{
+public:
+	InstanceTextureSubloadCallback(osg::ref_ptr<osg::Image> image);
+
+	// marks the texels [start-end) in row major order as changed, they are uploaded with the next apply
+	void dirtyTexels(unsigned int start, unsigned int end);
+
+	virtual void load(const osg::TextureRectangle& texture, osg::State& state) const;
+	virtual void subload(const osg::TextureRectangle& texture, osg::State& state) const;
+
+private:
+	void uploadTexels(unsigned int start, unsigned int end) const;
+
+	osg::ref_ptr<osg::Image>	m_image;
+	mutable std::mutex			m_mutex;
+	mutable unsigned int		m_dirtyStart;
+	mutable unsigned int		m_dirtyEnd;
+};
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _INSTANCE_TRANSFORM_STORE_H
+#define _INSTANCE_TRANSFORM_STORE_H
+
+// std
+#include <vector>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+// osg
+#include <osg/Referenced>
+#include <osg/Matrixf>
+#include <osg/Matrixd>
+
+namespace osgExample
+{
+
+/**
+ Minimal allocator that aligns every allocation to Alignment bytes(has to be a power of two)
+*/
+template<class T, size_t Alignment> class AlignedAllocator
+{
+public:
+	typedef T				value_type;
+	typedef T*				pointer;
+	typedef const T*		const_pointer;
+	typedef T&				reference;
+	typedef const T&		const_reference;
+	typedef size_t			size_type;
+	typedef ptrdiff_t		difference_type;
+
+	template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template<class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	pointer allocate(size_type n, const void* = 0)
+	{
+		// over-allocate and store the original pointer right in front of the aligned block
+		void* memory = malloc(n * sizeof(T) + Alignment + sizeof(void*));
+		if (!memory)
+			throw std::bad_alloc();
+
+		size_t address = ((size_t)memory + sizeof(void*) + Alignment - 1) & ~(Alignment - 1);
+		((void**)address)[-1] = memory;
+		return (pointer)address;
+	}
+
+	void deallocate(pointer p, size_type)
+	{
+		if (p)
+			free(((void**)p)[-1]);
+	}
+
+	size_type max_size() const { return (size_type)-1 / sizeof(T); }
+
+	void construct(pointer p, const T& value) { new((void*)p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+
+	template<class U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+	template<class U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+/**
+ Float32 instance transforms owned by the InstancedGeometryBuilder. The matrices are stored tightly packed
+ and 16 byte aligned, in exactly the layout the uniform, texture, uniform buffer and vertex attribute techniques upload.
+*/
+class InstanceTransformStore : public osg::Referenced
+{
+public:
+	typedef std::vector<osg::Matrixf, AlignedAllocator<osg::Matrixf, 16> > TransformList;
+
+	InstanceTransformStore() {}
+
+	inline void addTransform(const osg::Matrixf& transform) { m_transforms.push_back(transform); }
+	inline void addTransform(const osg::Matrixd& transform) { m_transforms.push_back(osg::Matrixf(transform)); }
+	inline const osg::Matrixf& getTransform(size_t index) const { return m_transforms[index]; }
+	inline osg::Matrixf& getTransform(size_t index) { return m_transforms[index]; }
+
+	inline size_t size() const { return m_transforms.size(); }
+	inline bool empty() const { return m_transforms.empty(); }
+	inline void reserve(size_t numTransforms) { m_transforms.reserve(numTransforms); }
+	inline void resize(size_t numTransforms) { m_transforms.resize(numTransforms); }
+	inline void clear() { m_transforms.clear(); }
+
+	// rearranges the transforms, afterwards index i holds the transform that was at order[i]
+	void reorder(const std::vector<unsigned int>& order)
+	{
+		TransformList transforms;
+		transforms.reserve(order.size());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			transforms.push_back(m_transforms[order[i]]);
+		}
+		m_transforms.swap(transforms);
+	}
+
+	// pointer to the 16 floats of the transform at index, all following transforms are contiguous
+	inline const float* getData(size_t index = 0) const { return m_transforms.empty() ? NULL : m_transforms[index].ptr(); }
+	inline float* getData(size_t index = 0) { return m_transforms.empty() ? NULL : m_transforms[index].ptr(); }
+	inline size_t getDataSize(size_t start, size_t end) const { return (end - start) * sizeof(osg::Matrixf); }
+
+	inline const TransformList& getTransforms() const { return m_transforms; }
+
+protected:
+	virtual ~InstanceTransformStore() {}
+
+	TransformList m_transforms;
+};
+
+}
+
+#endif
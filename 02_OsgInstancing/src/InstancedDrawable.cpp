@@ -24,8 +24,11 @@
 #include <GL/glew.h>
 
 #include <iostream>
+#include <algorithm>
+#include <vector>
 
 #include "InstancedDrawable.h"
+#include "InstanceBounds.h"
 
 // helper struct to pack all vertex data into the array of structs form
 struct VertexData
@@ -39,11 +42,18 @@ namespace osgExample
 {
 
 InstancedDrawable::InstancedDrawable()
-	:	m_dirty(true),
+	:	m_dirtyFlags(VERTEX_DATA_DIRTY | INDEX_DATA_DIRTY | INSTANCE_DATA_DIRTY | ATTRIBUTE_LAYOUT_DIRTY),
 		m_vao(0u),
 		m_vbo(0u),
 		m_instancebo(0u),
 		m_ebo(0u),
+		m_instanceBufferSize(0u),
+		m_dirtyInstanceStart(0u),
+		m_dirtyInstanceEnd(0u),
+		m_dirtyBoundsStart(0u),
+		m_dirtyBoundsEnd(0u),
+		m_instanceBoundsValid(false),
+		m_streamingInstances(false),
 		m_vertexArray(NULL),
 		m_normalArray(NULL),
 		m_texCoordArray(NULL),
@@ -55,11 +65,22 @@ InstancedDrawable::InstancedDrawable()
 
 InstancedDrawable::InstancedDrawable(const InstancedDrawable& other, const osg::CopyOp& copyOp)
 	:	osg::Drawable(other, copyOp),
+		m_dirtyFlags(VERTEX_DATA_DIRTY | INDEX_DATA_DIRTY | INSTANCE_DATA_DIRTY | ATTRIBUTE_LAYOUT_DIRTY),
 		m_vao(0u),
 		m_vbo(0u),
 		m_instancebo(0u),
 		m_ebo(0u),
+		m_instanceBufferSize(0u),
+		m_dirtyInstanceStart(0u),
+		m_dirtyInstanceEnd(0u),
+		m_dirtyBoundsStart(0u),
+		m_dirtyBoundsEnd(0u),
+		m_instanceBoundsValid(false),
+		m_streamingInstances(other.m_streamingInstances),
 		m_vertexArray(dynamic_cast<osg::Vec3Array*>(copyOp(other.m_vertexArray))),
+		m_matrixArray(other.m_matrixArray),
+		m_quantizedInstanceArray(other.m_quantizedInstanceArray),
+		m_compactedInstanceArray(other.m_compactedInstanceArray),
 		m_normalArray(dynamic_cast<osg::Vec3Array*>(copyOp(other.m_normalArray))),
 		m_texCoordArray(dynamic_cast<osg::Vec2Array*>(copyOp(other.m_texCoordArray))),
 		m_drawElements(dynamic_cast<osg::DrawElements*>(copyOp(other.m_drawElements)))
@@ -73,17 +94,48 @@ InstancedDrawable::~InstancedDrawable()
 
 osg::BoundingBox InstancedDrawable::computeBound() const
 {
-	osg::BoundingBox bb;
+	if (!m_matrixArray || !m_vertexArray)
+		return osg::BoundingBox();
 
-	for (auto it = m_matrixArray.begin(); it != m_matrixArray.end(); ++it)
+	// transform the bounding box of the mesh instead of every vertex, dirtyInstances only grows the cached bounds
+	if (!m_instanceBoundsValid)
 	{
-		for (unsigned int i = 0; i < m_vertexArray->getNumElements(); ++i)
-		{
-			bb.expandBy(m_vertexArray->at(i) * (*it));
-		}
+		m_instanceBounds = computeInstanceBounds(computeVertexBounds(m_vertexArray.get()), m_matrixArray->getData(), m_matrixArray->size());
+		m_instanceBoundsValid = true;
+	} else if (m_dirtyBoundsStart < m_dirtyBoundsEnd) {
+		size_t end = std::min(m_dirtyBoundsEnd, m_matrixArray->size());
+		if (m_dirtyBoundsStart < end)
+			m_instanceBounds.expandBy(computeInstanceBounds(computeVertexBounds(m_vertexArray.get()), m_matrixArray->getData(m_dirtyBoundsStart), end - m_dirtyBoundsStart));
 	}
+	m_dirtyBoundsStart = m_dirtyBoundsEnd = 0u;
 
-	return bb;
+	return m_instanceBounds;
+}
+
+void InstancedDrawable::dirtyInstances(size_t start, size_t end)
+{
+	if (end <= start)
+		return;
+
+	// unchanged instances in the merged range are already inside of the bounds, so growing by them does no harm
+	if (m_dirtyInstanceStart < m_dirtyInstanceEnd)
+	{
+		m_dirtyInstanceStart = std::min(m_dirtyInstanceStart, start);
+		m_dirtyInstanceEnd = std::max(m_dirtyInstanceEnd, end);
+	} else {
+		m_dirtyInstanceStart = start;
+		m_dirtyInstanceEnd = end;
+	}
+
+	if (m_dirtyBoundsStart < m_dirtyBoundsEnd)
+	{
+		m_dirtyBoundsStart = std::min(m_dirtyBoundsStart, start);
+		m_dirtyBoundsEnd = std::max(m_dirtyBoundsEnd, end);
+	} else {
+		m_dirtyBoundsStart = start;
+		m_dirtyBoundsEnd = end;
+	}
+	dirtyBound();
 }
 
 void InstancedDrawable::compileGLObjects(osg::RenderInfo& renderInfo) const
@@ -96,74 +148,156 @@ void InstancedDrawable::compileGLObjects(osg::RenderInfo& renderInfo) const
 		m_instancebo = buffers[1];
 		m_ebo = buffers[2];
 		glGenVertexArrays(1, &m_vao);
+		m_instanceBufferSize = 0u;
+		m_dirtyFlags = VERTEX_DATA_DIRTY | INDEX_DATA_DIRTY | INSTANCE_DATA_DIRTY | ATTRIBUTE_LAYOUT_DIRTY;
 	}
 
-	if (m_dirty) 
-	{
-		m_dirty = false;
-		// create one array to fit all vertex data
-		VertexData* vertexData = new VertexData[m_vertexArray->size()];
-		for (unsigned int i = 0; i < m_vertexArray->size(); ++i)
-		{
-			vertexData[i].vertex[0] = m_vertexArray->at(i).x();
-			vertexData[i].vertex[1] = m_vertexArray->at(i).y();
-			vertexData[i].vertex[2] = m_vertexArray->at(i).z();
-			vertexData[i].normal[0] = m_normalArray->at(i).x();
-			vertexData[i].normal[1] = m_normalArray->at(i).y();
-			vertexData[i].normal[2] = m_normalArray->at(i).z();
-			vertexData[i].texCoord[0] = m_texCoordArray->at(i).x();
-			vertexData[i].texCoord[1] = m_texCoordArray->at(i).y();
-		}
-		
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(VertexData) * m_vertexArray->size(), vertexData, GL_STATIC_DRAW);
-		delete[] vertexData;
-
-		// pack matrices into float array
-		osg::ref_ptr<osg::FloatArray> matrixArray = new osg::FloatArray(m_matrixArray.size()*16);
-	
-		for (unsigned int i = 0; i < m_matrixArray.size(); ++i)
-		{
-			for (unsigned int j = 0; j < 16; ++j)
-			{
-				(*matrixArray)[i*16+j] =  m_matrixArray[i].ptr()[j];
-			}
-		}
-
-		glBindBuffer(GL_ARRAY_BUFFER, m_instancebo);
-		glBufferData(GL_ARRAY_BUFFER, matrixArray->getTotalDataSize(), matrixArray->getDataPointer(), GL_STATIC_DRAW);
+	// the mesh only changes if its arrays are replaced, so it is only packed and uploaded then
+	if (m_dirtyFlags & VERTEX_DATA_DIRTY)
+		uploadVertexData();
 
+	if (m_dirtyFlags & INDEX_DATA_DIRTY)
+	{
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
 		glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_drawElements->getTotalDataSize(), m_drawElements->getDataPointer(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	// streamed instances are written to the ring buffer right before they are drawn
+	if (!isStreaming() && (m_dirtyFlags & INSTANCE_DATA_DIRTY))
+	{
+		uploadInstanceData(0, getNumInstanceData());
+	} else if (!isStreaming() && m_dirtyInstanceStart < m_dirtyInstanceEnd) {
+		uploadInstanceData(m_dirtyInstanceStart, m_dirtyInstanceEnd);
+	}
+	m_dirtyInstanceStart = m_dirtyInstanceEnd = 0u;
+
+	if (m_dirtyFlags & ATTRIBUTE_LAYOUT_DIRTY)
+		setupAttributeLayout();
+
+	m_dirtyFlags = 0u;
+}
+
+void InstancedDrawable::uploadVertexData() const
+{
+	// create one array to fit all vertex data
+	std::vector<VertexData> vertexData(m_vertexArray->size());
+	for (unsigned int i = 0; i < m_vertexArray->size(); ++i)
+	{
+		vertexData[i].vertex[0] = m_vertexArray->at(i).x();
+		vertexData[i].vertex[1] = m_vertexArray->at(i).y();
+		vertexData[i].vertex[2] = m_vertexArray->at(i).z();
+		vertexData[i].normal[0] = m_normalArray->at(i).x();
+		vertexData[i].normal[1] = m_normalArray->at(i).y();
+		vertexData[i].normal[2] = m_normalArray->at(i).z();
+		vertexData[i].texCoord[0] = m_texCoordArray->at(i).x();
+		vertexData[i].texCoord[1] = m_texCoordArray->at(i).y();
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(VertexData) * vertexData.size(), vertexData.empty() ? NULL : &vertexData[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstancedDrawable::uploadInstanceData(size_t start, size_t end) const
+{
+	size_t numInstances = getNumInstanceData();
+	size_t dataSize = getInstanceDataSize(0, numInstances);
+	start = std::min(start, numInstances);
+	end = std::min(end, numInstances);
+
+	glBindBuffer(GL_ARRAY_BUFFER, m_instancebo);
+	if (dataSize > m_instanceBufferSize)
+	{
+		// leave room for added instances, so not every added instance reallocates the buffer
+		m_instanceBufferSize = std::max(dataSize, m_instanceBufferSize + m_instanceBufferSize / 2);
+		glBufferData(GL_ARRAY_BUFFER, m_instanceBufferSize, NULL, GL_DYNAMIC_DRAW);
+		start = 0u;
+		end = numInstances;
+	} else if (getInstanceDataSize(start, end) * 2 > dataSize) {
+		// most of the buffer changes, so orphan it instead of waiting until the gpu is done with the old data
+		glBufferData(GL_ARRAY_BUFFER, m_instanceBufferSize, NULL, GL_DYNAMIC_DRAW);
+		start = 0u;
+		end = numInstances;
+	}
+
+	// the matrix store already has the layout of the instance attributes, so upload it without repacking
+	if (start < end)
+		glBufferSubData(GL_ARRAY_BUFFER, getInstanceDataSize(0, start), getInstanceDataSize(start, end), getInstanceData(start));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstancedDrawable::setupAttributeLayout() const
+{
+	glBindVertexArray(m_vao);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), 0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (GLvoid*)(sizeof(GLfloat) * 3));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (GLvoid*)(sizeof(GLfloat) * 6));
+	setupInstanceAttributes(m_instancebo, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+	glBindVertexArray(0);
 
-		glBindVertexArray(m_vao);
-		glEnableVertexAttribArray(0);
-		glEnableVertexAttribArray(1);
-		glEnableVertexAttribArray(2);
-		glEnableVertexAttribArray(3);
+	// unbind all buffers to prevent undefined behavior of osg
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void InstancedDrawable::setupInstanceAttributes(GLuint buffer, GLintptr offset) const
+{
+	// the vertex array object of this drawable has to be bound
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	if (m_quantizedInstanceArray.valid())
+	{
+		// a packed instance is a single uvec2 attribute
+		glDisableVertexAttribArray(4);
+		glDisableVertexAttribArray(5);
+		glDisableVertexAttribArray(6);
+		glVertexAttribIPointer(3, 2, GL_UNSIGNED_INT, 2 * sizeof(GLuint), (GLvoid*)offset);
+		glVertexAttribDivisor(3, 1);
+	} else {
 		glEnableVertexAttribArray(4);
 		glEnableVertexAttribArray(5);
 		glEnableVertexAttribArray(6);
-		glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), 0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (GLvoid*)(sizeof(GLfloat) * 3));
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (GLvoid*)(sizeof(GLfloat) * 6));
-		glBindBuffer(GL_ARRAY_BUFFER, m_instancebo);
-		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), 0);
-		glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(4  * sizeof(float)));
-		glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(8  * sizeof(float)));
-		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(12 * sizeof(float)));
+		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)offset);
+		glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(offset + 4  * sizeof(float)));
+		glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(offset + 8  * sizeof(float)));
+		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (GLvoid*)(offset + 12 * sizeof(float)));
 		glVertexAttribDivisor(3, 1);
 		glVertexAttribDivisor(4, 1);
 		glVertexAttribDivisor(5, 1);
 		glVertexAttribDivisor(6, 1);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
-		glBindVertexArray(0);
-
-		// unbind all buffers to prevent undefined behavior of osg
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+size_t InstancedDrawable::getNumInstanceData() const
+{
+	if (m_compactedInstanceArray.valid())
+		return std::min((size_t)m_drawElements->getNumInstances(), (size_t)m_compactedInstanceArray->getTotalDataSize() / getInstanceDataSize(0, 1));
+	if (m_quantizedInstanceArray.valid())
+		return m_quantizedInstanceArray->size() / 2;
+	return m_matrixArray.valid() ? m_matrixArray->size() : 0u;
+}
+
+size_t InstancedDrawable::getInstanceDataSize(size_t start, size_t end) const
+{
+	if (m_quantizedInstanceArray.valid())
+		return (end - start) * 2 * sizeof(GLuint);
+	return (end - start) * 16 * sizeof(GLfloat);
+}
+
+const GLvoid* InstancedDrawable::getInstanceData(size_t index) const
+{
+	if (m_compactedInstanceArray.valid())
+		return static_cast<const GLubyte*>(m_compactedInstanceArray->getDataPointer()) + getInstanceDataSize(0, index);
+	if (m_quantizedInstanceArray.valid())
+		return m_quantizedInstanceArray->empty() ? NULL : &(*m_quantizedInstanceArray)[index * 2];
+	return m_matrixArray.valid() && !m_matrixArray->empty() ? m_matrixArray->getData(index) : NULL;
 }
 
 void InstancedDrawable::releaseGLObjects(osg::State* state) const
@@ -178,11 +312,16 @@ void InstancedDrawable::releaseGLObjects(osg::State* state) const
 		m_instancebo = 0;
 		m_ebo = 0;
 		m_vao = 0;
-	}	
+	}
+	m_ringBuffer.release();
 }
 
 void InstancedDrawable::drawImplementation(osg::RenderInfo& renderInfo) const
 {
+	// upload changes made after the initial compile
+	if (m_dirtyFlags || m_dirtyInstanceStart < m_dirtyInstanceEnd)
+		compileGLObjects(renderInfo);
+
 	glBindVertexArray(m_vao);
 	GLenum dataType;
 	switch(m_drawElements->getType())
@@ -199,8 +338,18 @@ void InstancedDrawable::drawImplementation(osg::RenderInfo& renderInfo) const
 		break;
 	}
 
+	// point the instance attributes to the segment of this frame
+	if (isStreaming())
+	{
+		GLintptr offset = m_ringBuffer.write(getInstanceData(0), getInstanceDataSize(0, getNumInstanceData()));
+		setupInstanceAttributes(m_ringBuffer.getBuffer(), offset);
+	}
+
 	glDrawElementsInstanced(m_drawElements->getMode(), m_drawElements->getNumIndices(), dataType, NULL, m_drawElements->getNumInstances());
 	glBindVertexArray(0);
+
+	if (isStreaming())
+		m_ringBuffer.fence();
 }
 
 void InstancedDrawable::accept(osg::PrimitiveFunctor& functor) const
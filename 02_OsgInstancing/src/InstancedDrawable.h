@@ -27,6 +27,10 @@
 // osg
 #include <osg/Drawable>
 
+// osgExample
+#include "InstanceTransformStore.h"
+#include "InstanceRingBuffer.h"
+
 namespace osgExample
 {
 
@@ -44,24 +48,71 @@ public:
 	virtual void accept(osg::PrimitiveFunctor& functor) const;
 	virtual void releaseGLObjects(osg::State* state) const;
 
-	inline void setVertexArray(osg::ref_ptr<osg::Vec3Array> vertexArray) { m_vertexArray = vertexArray;  m_dirty = true; }
-	inline void setMatrixArray(const std::vector<osg::Matrixd>& matrixArray) { m_matrixArray = matrixArray;  m_dirty = true; }
-	inline void setNormalArray(osg::ref_ptr<osg::Vec3Array> normalArray) { m_normalArray = normalArray; m_dirty = true; }
-	inline void setTexCoordArray(osg::ref_ptr<osg::Vec2Array> texCoordArray) { m_texCoordArray = texCoordArray; m_dirty = true; }
-	inline void setDrawElements(osg::ref_ptr<osg::DrawElements> drawElements) { m_drawElements = drawElements; m_dirty = true; }
+	// every setter only marks its own buffer as dirty, changing the instances never uploads the mesh again
+	inline void setVertexArray(osg::ref_ptr<osg::Vec3Array> vertexArray) { m_vertexArray = vertexArray;  m_dirtyFlags |= VERTEX_DATA_DIRTY; m_instanceBoundsValid = false; }
+	inline void setMatrixArray(osg::ref_ptr<const InstanceTransformStore> matrixArray) { m_matrixArray = matrixArray;  m_dirtyFlags |= INSTANCE_DATA_DIRTY; m_instanceBoundsValid = false; }
+	// if set the packed instances are uploaded instead of the matrices, the matrices are still used for the bounds
+	inline void setQuantizedInstanceArray(osg::ref_ptr<osg::UIntArray> instanceArray) { m_quantizedInstanceArray = instanceArray; m_dirtyFlags |= INSTANCE_DATA_DIRTY | ATTRIBUTE_LAYOUT_DIRTY; }
+	inline void setNormalArray(osg::ref_ptr<osg::Vec3Array> normalArray) { m_normalArray = normalArray; m_dirtyFlags |= VERTEX_DATA_DIRTY; }
+	inline void setTexCoordArray(osg::ref_ptr<osg::Vec2Array> texCoordArray) { m_texCoordArray = texCoordArray; m_dirtyFlags |= VERTEX_DATA_DIRTY; }
+	inline void setDrawElements(osg::ref_ptr<osg::DrawElements> drawElements) { m_drawElements = drawElements; m_dirtyFlags |= INDEX_DATA_DIRTY; }
+	inline osg::ref_ptr<osg::DrawElements> getDrawElements() const { return m_drawElements; }
+
+	// streamed instances are copied into a ring buffer every frame instead of uploading only the dirty instances,
+	// which is faster if most instances change every frame
+	inline void setStreamingInstances(bool streamingInstances) { m_streamingInstances = streamingInstances; m_dirtyFlags |= INSTANCE_DATA_DIRTY | ATTRIBUTE_LAYOUT_DIRTY; }
+	inline bool getStreamingInstances() const { return m_streamingInstances; }
+
+	// if set, the first getDrawElements()->getNumInstances() instances of this array are streamed every frame instead of
+	// the matrices or packed instances, the array holds the instances that survived culling in the same format
+	inline void setCompactedInstanceArray(osg::ref_ptr<osg::Array> instanceArray) { m_compactedInstanceArray = instanceArray; m_dirtyFlags |= INSTANCE_DATA_DIRTY | ATTRIBUTE_LAYOUT_DIRTY; }
+
+	inline void dirtyArrays() { m_dirtyFlags |= VERTEX_DATA_DIRTY | INDEX_DATA_DIRTY | INSTANCE_DATA_DIRTY; m_instanceBoundsValid = false; }
 
-	inline void dirtyArrays() { m_dirty = true; }
+	// only uploads the instances [start-end) again and grows the bounds by them with the next computeBound,
+	// removed instances do not shrink the bounds
+	void dirtyInstances(size_t start, size_t end);
 protected:
 	virtual ~InstancedDrawable();
 private:
-	mutable bool						m_dirty;
+	enum DirtyFlags
+	{
+		VERTEX_DATA_DIRTY		= 1u << 0,
+		INDEX_DATA_DIRTY		= 1u << 1,
+		INSTANCE_DATA_DIRTY		= 1u << 2,
+		ATTRIBUTE_LAYOUT_DIRTY	= 1u << 3
+	};
+
+	void			uploadVertexData() const;
+	void			uploadInstanceData(size_t start, size_t end) const;
+	void			setupAttributeLayout() const;
+	void			setupInstanceAttributes(GLuint buffer, GLintptr offset) const;
+	inline bool		isStreaming() const { return m_streamingInstances || m_compactedInstanceArray.valid(); }
+
+	// the instance buffer holds either the packed instances or the matrices
+	size_t			getNumInstanceData() const;
+	size_t			getInstanceDataSize(size_t start, size_t end) const;
+	const GLvoid*	getInstanceData(size_t index) const;
+
+	mutable unsigned int				m_dirtyFlags;
 	mutable GLuint						m_vao;
 	mutable GLuint						m_vbo;
 	mutable GLuint						m_instancebo;
 	mutable GLuint						m_ebo;
+	mutable size_t						m_instanceBufferSize;	// allocated bytes, can be larger than the instances
+	mutable size_t						m_dirtyInstanceStart;
+	mutable size_t						m_dirtyInstanceEnd;
+	mutable size_t						m_dirtyBoundsStart;
+	mutable size_t						m_dirtyBoundsEnd;
+	mutable osg::BoundingBox			m_instanceBounds;
+	mutable bool						m_instanceBoundsValid;
+	bool								m_streamingInstances;
+	mutable InstanceRingBuffer			m_ringBuffer;
 
 	osg::ref_ptr<osg::Vec3Array>		m_vertexArray;
-	std::vector<osg::Matrixd>			m_matrixArray;
+	osg::ref_ptr<const InstanceTransformStore>	m_matrixArray;
+	osg::ref_ptr<osg::UIntArray>		m_quantizedInstanceArray;
+	osg::ref_ptr<osg::Array>			m_compactedInstanceArray;
 	osg::ref_ptr<osg::Vec3Array>		m_normalArray;
 	osg::ref_ptr<osg::Vec2Array>		m_texCoordArray;
 	osg::ref_ptr<osg::DrawElements>		m_drawElements;
@@ -22,90 +22,335 @@
 */
 
 #include "InstancedGeometryBuilder.h"
-#include "InstancedDrawable.h"
 
 // std
 #include <cstring>
+#include <cfloat>
+#include <iostream>
+#include <algorithm>
+#include <utility>
+#include <set>
 
 // osg
 #include <osg/Uniform>
 #include <osg/Group>
 #include <osg/Geode>
 #include <osg/MatrixTransform>
+#include <osg/LOD>
 #include <osgDB/ReadFile>
 #include <osg/Image>
 #include <osg/TextureRectangle>
 #include <osg/BufferObject>
 #include <osg/BufferIndexBinding>
+#include <osg/BoundingBox>
 
 // osgExample
-#include "ComputeInstanceBoundingBoxCallback.h"
-#include "ComputeTextureBoundingBoxCallback.h"
 #include "MatrixUniformUpdateCallback.h"
+#include "InstanceBounds.h"
+#include "SharedDrawElements.h"
+#include "WorldDistanceLODCallback.h"
+
+namespace
+{
+
+// spreads the lower 16 bits of value to the even bits of the result
+inline unsigned int spreadBits(unsigned int value)
+{
+	value &= 0x0000ffffu;
+	value = (value | (value << 8)) & 0x00ff00ffu;
+	value = (value | (value << 4)) & 0x0f0f0f0fu;
+	value = (value | (value << 2)) & 0x33333333u;
+	value = (value | (value << 1)) & 0x55555555u;
+	return value;
+}
+
+// matrices per row of the matrix texture(4 texels each) and packed instances per row of the quantized texture(2 per texel)
+const unsigned int MATRICES_PER_TEXTURE_ROW = 4096u;
+const unsigned int QUANTIZED_INSTANCES_PER_TEXTURE_ROW = 8192u;
+
+// attaches one vertex buffer object to all arrays and an element buffer object to every DrawElements that has none.
+// The chunks share them, so a technique that is built in the background only reads the geometry
+void createSharedBufferObjects(osg::Geometry* geometry)
+{
+	if (!geometry)
+		return;
+
+	osg::Geometry::ArrayList arrays(geometry->getTexCoordArrayList());
+	arrays.insert(arrays.end(), geometry->getVertexAttribArrayList().begin(), geometry->getVertexAttribArrayList().end());
+	arrays.push_back(geometry->getVertexArray());
+	arrays.push_back(geometry->getNormalArray());
+	arrays.push_back(geometry->getColorArray());
+	arrays.push_back(geometry->getSecondaryColorArray());
+	arrays.push_back(geometry->getFogCoordArray());
+
+	osg::ref_ptr<osg::VertexBufferObject> vbo;
+	for (auto it = arrays.begin(); it != arrays.end() && !vbo; ++it)
+	{
+		if (it->valid() && (*it)->getVertexBufferObject())
+			vbo = (*it)->getVertexBufferObject();
+	}
+	if (!vbo)
+		vbo = new osg::VertexBufferObject;
+
+	for (auto it = arrays.begin(); it != arrays.end(); ++it)
+	{
+		if (it->valid() && !(*it)->getVertexBufferObject())
+			(*it)->setVertexBufferObject(vbo);
+	}
+
+	for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+	{
+		osg::DrawElements* drawElements = geometry->getPrimitiveSet(i)->getDrawElements();
+		if (drawElements && !drawElements->getElementBufferObject())
+			drawElements->setElementBufferObject(new osg::ElementBufferObject);
+	}
+}
+
+// adds the size of the data to total and to unique if it was not counted before
+inline void addMeshData(const osg::BufferData* data, std::set<const osg::BufferData*>& counted, size_t& unique, size_t& total)
+{
+	if (!data)
+		return;
+
+	total += data->getTotalDataSize();
+	if (counted.insert(data).second)
+		unique += data->getTotalDataSize();
+}
+
+const char* getChunkTechniqueName(unsigned int technique)
+{
+	const char* names[] = {"Uniform chunks", "Texture chunks", "UBO chunks"};
+	return names[technique];
+}
+
+}
 
 namespace osgExample
 {
 
+InstancedGeometryBuilder::InstanceHandle InstancedGeometryBuilder::addMatrix(const osg::Matrixd& matrix)
+{
+	return addTransform(osg::Matrixf(matrix));
+}
+
+InstancedGeometryBuilder::InstanceHandle InstancedGeometryBuilder::addMatrix(const osg::Matrixf& matrix)
+{
+	return addTransform(matrix);
+}
+
+bool InstancedGeometryBuilder::updateMatrix(InstanceHandle handle, const osg::Matrixd& matrix)
+{
+	return updateTransform(handle, osg::Matrixf(matrix));
+}
+
+bool InstancedGeometryBuilder::updateMatrix(InstanceHandle handle, const osg::Matrixf& matrix)
+{
+	return updateTransform(handle, matrix);
+}
+
+bool InstancedGeometryBuilder::removeMatrix(InstanceHandle handle)
+{
+	if (!isValidHandle(handle))
+		return false;
+
+	// move the last instance into the gap, so the instances of every chunk stay contiguous
+	unsigned int index = m_handleIndices[handle];
+	unsigned int last = m_matrices->size() - 1;
+	if (index != last)
+	{
+		m_matrices->getTransform(index) = m_matrices->getTransform(last);
+		m_indexHandles[index] = m_indexHandles[last];
+		m_handleIndices[m_indexHandles[index]] = index;
+		writeNodes(index);
+	}
+	m_matrices->resize(last);
+	m_indexHandles.pop_back();
+	m_handleIndices[handle] = INVALID_INSTANCE_HANDLE;
+	m_freeHandles.push_back(handle);
+
+	shrinkNodes();
+	return true;
+}
+
+void InstancedGeometryBuilder::setGeometry(osg::ref_ptr<osg::Geometry> geometry)
+{
+	// the software technique may already draw the geometry while a chunked technique is built
+	createSharedBufferObjects(geometry.get());
+	m_geometry = geometry;
+}
+
+void InstancedGeometryBuilder::addLodGeometry(float switchDistance, osg::ref_ptr<osg::Geometry> geometry)
+{
+	// the levels are sorted from near to far
+	if (!m_lodSwitchDistances.empty() && switchDistance <= m_lodSwitchDistances.back())
+	{
+		std::cout << "Error: LOD switch distance " << switchDistance << " is not larger than the previous one." << std::endl;
+		return;
+	}
+
+	createSharedBufferObjects(geometry.get());
+	m_lodSwitchDistances.push_back(switchDistance);
+	m_lodGeometries.push_back(geometry);
+}
+
+void InstancedGeometryBuilder::generateMatrices(size_t numMatrices, const MatrixGenerator& generator)
+{
+	// enough matrices per job to hide the scheduling, few enough to keep all threads busy
+	const size_t MATRICES_PER_JOB = 4096u;
+
+	if (hasNodes())
+	{
+		// every added instance has to update the nodes
+		std::vector<osg::Matrixf> matrices(numMatrices);
+		if (numMatrices)
+			generator(0, numMatrices, &matrices[0]);
+		for (auto it = matrices.begin(); it != matrices.end(); ++it)
+		{
+			addTransform(*it);
+		}
+		return;
+	}
+
+	size_t start = m_matrices->size();
+	m_matrices->resize(start + numMatrices);
+	m_handleIndices.reserve(m_handleIndices.size() + numMatrices);
+	m_indexHandles.reserve(start + numMatrices);
+	for (size_t i = start; i < start + numMatrices; ++i)
+	{
+		m_indexHandles.push_back(m_handleIndices.size());
+		m_handleIndices.push_back(i);
+	}
+	m_matricesSorted = false;
+
+	// the generator writes straight into the store
+	getJobSystem()->parallelFor(numMatrices, MATRICES_PER_JOB, [&](size_t begin, size_t end)
+	{
+		generator(begin, end, &m_matrices->getTransform(start + begin));
+	});
+}
+
+void InstancedGeometryBuilder::printMemoryReport() const
+{
+	const double MB = 1024.0 * 1024.0;
+	for (auto node = m_chunkedNodes.begin(); node != m_chunkedNodes.end(); ++node)
+	{
+		// unique counts every array and index buffer once, total as if every chunk had its own copy
+		std::set<const osg::BufferData*> counted;
+		size_t uniqueMeshSize = 0u, totalMeshSize = 0u, instanceSize = 0u;
+		for (auto chunk = node->chunks.begin(); chunk != node->chunks.end(); ++chunk)
+		{
+			const osg::Geometry* geometry = chunk->geometry.get();
+			addMeshData(geometry->getVertexArray(), counted, uniqueMeshSize, totalMeshSize);
+			addMeshData(geometry->getNormalArray(), counted, uniqueMeshSize, totalMeshSize);
+			addMeshData(geometry->getTexCoordArray(0), counted, uniqueMeshSize, totalMeshSize);
+			for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+			{
+				const SharedDrawElements* sharedDrawElements = dynamic_cast<const SharedDrawElements*>(geometry->getPrimitiveSet(i));
+				if (sharedDrawElements)
+					addMeshData(sharedDrawElements->getSharedDrawElements(), counted, uniqueMeshSize, totalMeshSize);
+				else
+					addMeshData(geometry->getPrimitiveSet(i), counted, uniqueMeshSize, totalMeshSize);
+			}
+
+			if (chunk->uniform.valid() && chunk->uniform->getFloatArray())
+				instanceSize += chunk->uniform->getFloatArray()->getTotalDataSize();
+			if (chunk->uniform.valid() && chunk->uniform->getUIntArray())
+				instanceSize += chunk->uniform->getUIntArray()->getTotalDataSize();
+			if (chunk->image.valid())
+				instanceSize += chunk->image->getTotalSizeInBytes();
+			if (chunk->bufferArray.valid())
+				instanceSize += chunk->bufferArray->getTotalDataSize();
+		}
+
+		// the buffer objects hold the same data on the gpu
+		std::cout << getChunkTechniqueName(node->technique) << ": " << node->chunks.size() << " chunks, mesh "
+				  << uniqueMeshSize / MB << " MB shared(" << totalMeshSize / MB << " MB copied per chunk), instances "
+				  << instanceSize / MB << " MB" << std::endl;
+	}
+
+	// a reused program is neither compiled nor linked again
+	std::cout << "Programs: " << m_programCache->getNumPrograms() << " cached, " << m_programCache->getNumHits() << " reused" << std::endl;
+}
+
+void InstancedGeometryBuilder::clearMatrices()
+{
+	m_matrices = new InstanceTransformStore;
+	m_matricesSorted = false;
+	m_handleIndices.clear();
+	m_indexHandles.clear();
+	m_freeHandles.clear();
+
+	// the nodes of the old matrices can not be updated anymore
+	m_chunkedNodes.clear();
+	m_softwareNodes.clear();
+	m_attributeNodes.clear();
+	m_batchedNodes.clear();
+}
+
 osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getSoftwareInstancedNode() const
 {
+	// keep the same instance order as the hardware techniques
+	sortMatricesSpatially();
+
 	// create Group to contain all instances
-	osg::ref_ptr<osg::Group>	group = new osg::Group;
+	SoftwareNode node;
+	node.group = new osg::Group;
 
 	// create Geode to wrap Geometry
-	osg::ref_ptr<osg::Geode>	geode = new osg::Geode;
+	osg::ref_ptr<osg::Geode> geode = new osg::Geode;
 	geode->addDrawable(m_geometry);
+	node.instance = geode;
+
+	if (!m_lodGeometries.empty())
+	{
+		// all transforms share the LOD, it picks the level by the distance in world space like the instanced techniques
+		osg::ref_ptr<osg::LOD> lod = new osg::LOD;
+		lod->setCullCallback(new WorldDistanceLODCallback);
+		lod->addChild(geode, 0.0f, m_lodSwitchDistances[0]);
+		for (size_t i = 0; i < m_lodGeometries.size(); ++i)
+		{
+			osg::ref_ptr<osg::Geode> lodGeode = new osg::Geode;
+			lodGeode->addDrawable(m_lodGeometries[i]);
+			lod->addChild(lodGeode, m_lodSwitchDistances[i], i + 1 < m_lodSwitchDistances.size() ? m_lodSwitchDistances[i + 1] : FLT_MAX);
+		}
+		node.instance = lod;
+	}
+
+	// every transform holds one instance
+	m_cullStatistics->setNumInstances(m_matrices->size());
+	node.countCallback = new CountInstancesCullCallback(m_cullStatistics, 1);
 
 	// now create a MatrixTransform for each matrix in the list
-	for (auto it = m_matrices.begin(); it != m_matrices.end(); ++it)
+	for (auto it = m_matrices->getTransforms().begin(); it != m_matrices->getTransforms().end(); ++it)
 	{
-		osg::ref_ptr<osg::MatrixTransform> matrixTransform = new osg::MatrixTransform(*it);
+		osg::ref_ptr<osg::MatrixTransform> matrixTransform = new osg::MatrixTransform(osg::Matrixd(*it));
 
-		matrixTransform->addChild(geode);
-		group->addChild(matrixTransform);
+		matrixTransform->addChild(node.instance);
+		matrixTransform->setCullCallback(node.countCallback);
+		node.group->addChild(matrixTransform);
 	}
 
-	osg::ref_ptr<osg::Program> program = new osg::Program;
-	osg::ref_ptr<osg::Shader> vsShader = osgDB::readShaderFile("../shader/no_instancing.vert");
-	osg::ref_ptr<osg::Shader> fsShader = osgDB::readShaderFile("../shader/no_instancing.frag");
-	program->addShader(vsShader);
-	program->addShader(fsShader);
-
-	group->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+	osg::ref_ptr<osg::Program> program = m_programCache->getProgram("no_instancing", "");
+	node.group->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+	m_softwareNodes.push_back(node);
 	
-	return group;
+	return node.group;
 }
 
 osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getHardwareInstancedNode() const
 {
-	osg::ref_ptr<osg::Node> instancedNode;
-
-	// first check if we need to split up the geometry in groups
-	if (m_matrices.size() <= m_maxMatrixUniforms)
-	{
-		// we don't have more matrices than uniform space so we only need one geode
-		instancedNode = createHardwareInstancedGeode(0, m_matrices.size());
-	} else {
-		// we need to split up instances into several geodes
-		osg::ref_ptr<osg::Group> group = new osg::Group;
+	// a quantized instance needs two uniform components instead of 16
+	bool quantized = useQuantizedInstances();
+	unsigned int maxInstances = quantized ? m_maxMatrixUniforms * 8 : m_maxMatrixUniforms;
 
-		unsigned int numGeodes = m_matrices.size() / m_maxMatrixUniforms;
-		for (unsigned int i = 0; i < numGeodes; ++i)
-		{
-			unsigned int start = i*m_maxMatrixUniforms;
-			unsigned int end    = std::min((unsigned int)m_matrices.size(), (start + m_maxMatrixUniforms));
-			group->addChild(createHardwareInstancedGeode(start, end));
-		}
-		instancedNode = group;
-	}
+	osg::ref_ptr<osg::Node> instancedNode = createChunkedNode(UNIFORM_CHUNKS, maxInstances, quantized);
 
-	osg::ref_ptr<osg::Program> program = new osg::Program;
-		
+	// every chunk size gets its own program, rebuilds with the same size share it
 	std::stringstream preprocessorDefinition;
-	preprocessorDefinition << "#define MAX_INSTANCES " << m_maxMatrixUniforms;
-	osg::ref_ptr<osg::Shader> vsShader = readShaderFile("../shader/instancing.vert", preprocessorDefinition.str());
-	osg::ref_ptr<osg::Shader> fsShader = osgDB::readShaderFile("../shader/instancing.frag");
-	program->addShader(vsShader);
-	program->addShader(fsShader);
+	preprocessorDefinition << "#define MAX_INSTANCES " << maxInstances << std::endl;
+	if (quantized)
+		preprocessorDefinition << InstanceQuantization::getShaderDefinition();
+	osg::ref_ptr<osg::Program> program = m_programCache->getProgram("instancing", preprocessorDefinition.str());
 
 	instancedNode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
 
@@ -114,286 +359,795 @@ osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getHardwareInstancedNode() con
 
 osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getTextureHardwareInstancedNode() const
 {
-	osg::ref_ptr<osg::Node> instancedNode;
+	bool quantized = useQuantizedInstances();
 
-	// first check if we need to split up the geometry in groups
-	if (m_matrices.size() <= m_maxTextureResolution)
-	{
-		// we don't have more matrices than uniform space so we only need one geode
-		instancedNode = createTextureHardwareInstancedGeode(0, m_matrices.size());
-	} else {
-		// we need to split up instances into several geodes
-		osg::ref_ptr<osg::Group> group = new osg::Group;
+	osg::ref_ptr<osg::Node> instancedNode = createChunkedNode(TEXTURE_CHUNKS, m_maxTextureResolution, quantized);
+	
+	// add shaders
+	osg::ref_ptr<osg::Program> program = m_programCache->getProgram("texture_instancing", quantized ? InstanceQuantization::getShaderDefinition() : "");
 
-		unsigned int numGeodes = m_matrices.size() / m_maxTextureResolution;
-		for (unsigned int i = 0; i < numGeodes; ++i)
-		{
-			unsigned int start = i*m_maxTextureResolution;
-			unsigned int end    = std::min((unsigned int)m_matrices.size(), (start + m_maxTextureResolution));
-			group->addChild(createTextureHardwareInstancedGeode(start, end));
-		}
-		instancedNode = group;
-	}
+	instancedNode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+
+	return instancedNode;
+}
 
+osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getUBOHardwareInstancedNode() const
+{
+	// a matrix takes 64 bytes of the uniform block, a quantized instance 8 bytes
+	bool quantized = useQuantizedInstances();
+	unsigned int maxUBOInstances = quantized ? m_maxUniformBlockSize / (InstanceQuantization::WORDS_PER_INSTANCE * sizeof(GLuint)) : (m_maxUniformBlockSize / 64);
+
+	osg::ref_ptr<osg::Node> instancedNode = createChunkedNode(UBO_CHUNKS, maxUBOInstances, quantized);
 	
 	// add shaders
-	osg::ref_ptr<osg::Program> program = new osg::Program;
-	osg::ref_ptr<osg::Shader> vsShader = osgDB::readShaderFile("../shader/texture_instancing.vert");
-	osg::ref_ptr<osg::Shader> fsShader = osgDB::readShaderFile("../shader/texture_instancing.frag");
-	program->addShader(vsShader);
-	program->addShader(fsShader);
+	std::stringstream preprocessorDefinition;
+	preprocessorDefinition << "#define MAX_INSTANCES " << maxUBOInstances << std::endl;
+	if (quantized)
+		preprocessorDefinition << InstanceQuantization::getShaderDefinition();
+	osg::ref_ptr<osg::Program> program = m_programCache->getProgram("ubo_instancing", preprocessorDefinition.str(), [](osg::Program* newProgram)
+	{
+		newProgram->addBindUniformBlock("instanceData", 0);
+	});
 
 	instancedNode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
 
 	return instancedNode;
 }
 
-osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getUBOHardwareInstancedNode() const
+osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getVertexAttribHardwareInstancedNode() const
 {
-	osg::ref_ptr<osg::Node> instancedNode;
+	bool quantized = useQuantizedInstances();
+	sortMatricesSpatially();
+
+	// create custom instanced drawable, one per level of detail
+	AttributeNode node;
+	node.drawables.push_back(createInstancedDrawable(m_geometry));
+	for (auto it = m_lodGeometries.begin(); it != m_lodGeometries.end(); ++it)
+	{
+		node.drawables.push_back(createInstancedDrawable(*it));
+	}
 
-	m_floatArrays.clear();
+	// create geode and program to wrap the drawables
+	node.geode = new osg::Geode;
+	for (auto it = node.drawables.begin(); it != node.drawables.end(); ++it)
+	{
+		node.geode->addDrawable(*it);
+	}
 
-	unsigned int maxUBOMatrices = (m_maxUniformBlockSize / 64);
+	// instances can change while the previous frame is drawn
+	node.geode->getOrCreateStateSet()->setDataVariance(osg::Object::DYNAMIC);
 
-	// first check if we need to split up the geometry in groups
-	if (m_matrices.size() <= maxUBOMatrices)
+	if (quantized)
 	{
-		// we don't have more matrices than uniform space so we only need one geode
-		instancedNode = createUBOHardwareInstancedGeode(0, m_matrices.size(), maxUBOMatrices);
-	} else {
-		// we need to split up instances into several geodes
-		osg::ref_ptr<osg::Group> group = new osg::Group;
+		// the drawables still compute their bounds from the matrices, but only upload the packed instances
+		node.quantizedInstances = new osg::UIntArray(m_matrices->size() * InstanceQuantization::WORDS_PER_INSTANCE);
+		node.range = InstanceQuantization::quantize(*m_matrices, 0, m_matrices->size(), node.quantizedInstances->empty() ? NULL : &(*node.quantizedInstances)[0]);
+		for (auto it = node.drawables.begin(); it != node.drawables.end(); ++it)
+		{
+			(*it)->setQuantizedInstanceArray(node.quantizedInstances);
+		}
+		InstanceQuantization::setRangeUniforms(node.geode->getOrCreateStateSet(), node.range);
+	}
+
+	osg::ref_ptr<osg::Program> program = m_programCache->getProgram("attribute_instancing", quantized ? InstanceQuantization::getShaderDefinition() : "", [quantized](osg::Program* newProgram)
+	{
+		newProgram->addBindAttribLocation("vPosition", 0);
+		newProgram->addBindAttribLocation("vNormal", 1);
+		newProgram->addBindAttribLocation("vTexCoord", 2);
+		newProgram->addBindAttribLocation(quantized ? "vInstanceData" : "vInstanceModelMatrix", 3);
+	});
+	node.geode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+
+	// add matrix uniforms and update callback
+	osg::ref_ptr<osgExample::MatrixUniformUpdateCallback> updateCallback = new osgExample::MatrixUniformUpdateCallback;
+	node.geode->getOrCreateStateSet()->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
+	node.geode->getOrCreateStateSet()->addUniform(updateCallback->getNormalMatrixUniform());
+	node.geode->setCullCallback(updateCallback);
+
+	// the single geode draws all instances
+	m_cullStatistics->setNumInstances(m_matrices->size());
+	node.countCallback = new CountInstancesCullCallback(m_cullStatistics, m_matrices->size(), node.drawables.size());
 
-		unsigned int numGeodes = m_matrices.size() / maxUBOMatrices;
-		for (unsigned int i = 0; i < numGeodes; ++i)
+	// the level of an instance is chosen while culling it
+	if (m_instanceCulling || !m_lodGeometries.empty())
+	{
+		// the visible instances of every level are gathered into its compacted array, which its drawable streams every frame
+		node.instanceCullCallback = createInstanceCullCallback(quantized, true);
+		node.instanceCullCallback->setCountCallback(node.countCallback);
+		node.instanceCullCallback->setJobSystem(getJobSystem());
+		for (auto it = node.drawables.begin(); it != node.drawables.end(); ++it)
 		{
-			unsigned int start = i*maxUBOMatrices;
-			unsigned int end    = std::min((unsigned int)m_matrices.size(), (start + maxUBOMatrices));
-			group->addChild(createUBOHardwareInstancedGeode(start, end, maxUBOMatrices));
+			if (quantized)
+				node.compactedInstances.push_back(new osg::UIntArray);
+			else
+				node.compactedInstances.push_back(new osg::FloatArray);
+			(*it)->setCompactedInstanceArray(node.compactedInstances.back());
 		}
-		instancedNode = group;
+		updateCallback->addNestedCallback(node.instanceCullCallback);
 	}
+	updateCallback->addNestedCallback(node.countCallback);
 
-	
-	// add shaders
-	osg::ref_ptr<osg::Program> program = new osg::Program;
-	std::stringstream preprocessorDefinition;
-	preprocessorDefinition << "#define MAX_INSTANCES " << maxUBOMatrices;
-	osg::ref_ptr<osg::Shader> vsShader = readShaderFile("../shader/ubo_instancing.vert", preprocessorDefinition.str());
-	osg::ref_ptr<osg::Shader> fsShader = osgDB::readShaderFile("../shader/ubo_instancing.frag");
-	program->addShader(vsShader);
-	program->addShader(fsShader);
-	program->addBindUniformBlock("instanceData", 0);
+	resizeAttributeInstances(node);
+	m_attributeNodes.push_back(node);
 
-	instancedNode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+	return node.geode;
+}
 
-	return instancedNode;
+osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getBatchedHardwareInstancedNode() const
+{
+	sortMatricesSpatially();
+
+	// every level of detail is one mesh in the shared buffers
+	BatchedNode node;
+	node.chunkSize = m_maxInstancesPerChunk;
+	node.drawable = new BatchedInstancedDrawable;
+	node.drawable->setMatrixArray(m_matrices);
+	node.drawable->setDataVariance(osg::Object::DYNAMIC);
+	node.drawable->addMesh(m_geometry);
+	for (auto it = m_lodGeometries.begin(); it != m_lodGeometries.end(); ++it)
+	{
+		node.drawable->addMesh(*it);
+	}
+	if (node.drawable->getNumMeshes() != getNumLodLevels())
+		return new osg::Group;
+
+	// the bounds of a chunk have to contain every level it can switch to
+	for (unsigned int i = 0; i < node.drawable->getNumMeshes(); ++i)
+	{
+		node.localBounds.expandBy(node.drawable->getMeshBounds(i));
+	}
+
+	node.geode = new osg::Geode;
+	node.geode->addDrawable(node.drawable);
+	node.geode->getOrCreateStateSet()->setDataVariance(osg::Object::DYNAMIC);
+
+	// the instances have the layout of the vertex attribute technique, so it shares the program with it
+	osg::ref_ptr<osg::Program> program = m_programCache->getProgram("attribute_instancing", "", [](osg::Program* newProgram)
+	{
+		newProgram->addBindAttribLocation("vPosition", 0);
+		newProgram->addBindAttribLocation("vNormal", 1);
+		newProgram->addBindAttribLocation("vTexCoord", 2);
+		newProgram->addBindAttribLocation("vInstanceModelMatrix", 3);
+	});
+	node.geode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+
+	osg::ref_ptr<osgExample::MatrixUniformUpdateCallback> updateCallback = new osgExample::MatrixUniformUpdateCallback;
+	node.geode->getOrCreateStateSet()->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
+	node.geode->getOrCreateStateSet()->addUniform(updateCallback->getNormalMatrixUniform());
+	node.geode->setCullCallback(updateCallback);
+
+	// the chunks are culled by the callback instead of being nodes of their own
+	m_cullStatistics->setNumInstances(m_matrices->size());
+	node.cullCallback = new BatchedChunkCullCallback(node.drawable, m_cullStatistics);
+	node.cullCallback->setLodSwitchDistances(m_lodSwitchDistances);
+	updateCallback->addNestedCallback(node.cullCallback);
+
+	for (unsigned int start = 0; start < m_matrices->size(); start += node.chunkSize)
+	{
+		addBatchedChunk(node, start, std::min(start + node.chunkSize, (unsigned int)m_matrices->size()));
+	}
+	m_batchedNodes.push_back(node);
+
+	return node.geode;
 }
 
-osg::ref_ptr<osg::Node> InstancedGeometryBuilder::getVertexAttribHardwareInstancedNode() const
+void InstancedGeometryBuilder::addBatchedChunk(BatchedNode& node, unsigned int start, unsigned int end) const
 {
-	// create custom instanced drawable
-	osg::ref_ptr<InstancedDrawable> drawable = new InstancedDrawable;
-	drawable->setVertexArray(dynamic_cast<osg::Vec3Array*>(m_geometry->getVertexArray()));
-	drawable->setNormalArray(dynamic_cast<osg::Vec3Array*>(m_geometry->getNormalArray()));
-	drawable->setTexCoordArray(dynamic_cast<osg::Vec2Array*>(m_geometry->getTexCoordArray(0)));
-	
-	osg::ref_ptr<osg::DrawElementsUByte> instancedPrimitive = dynamic_cast<osg::DrawElementsUByte*>(m_geometry->getPrimitiveSet(0)->clone(osg::CopyOp::DEEP_COPY_ALL));
-	instancedPrimitive->setNumInstances(m_matrices.size());
-	drawable->setDrawElements(instancedPrimitive);
-	drawable->setMatrixArray(m_matrices);
+	unsigned int firstDraw = node.drawable->getNumDraws();
+	for (unsigned int level = 0; level < getNumLodLevels(); ++level)
+	{
+		node.drawable->addDraw(level, start, end - start);
+	}
+	node.cullCallback->addChunk(firstDraw, end - start, computeInstanceBounds(node.localBounds, m_matrices->getData(start), end - start));
+}
 
-	// create geode and program to wrap the drawable
-	osg::ref_ptr<osg::Geode> geode = new osg::Geode;
-	geode->addDrawable(drawable);
-
-	osg::ref_ptr<osg::Program> program = new osg::Program;
-	osg::ref_ptr<osg::Shader> vsShader = osgDB::readShaderFile("../shader/attribute_instancing.vert");
-	osg::ref_ptr<osg::Shader> fsShader = osgDB::readShaderFile("../shader/attribute_instancing.frag");
-	program->addShader(vsShader);
-	program->addShader(fsShader);
-	program->addBindAttribLocation("vPosition", 0);
-	program->addBindAttribLocation("vNormal", 1);
-	program->addBindAttribLocation("vTexCoord", 2);
-	program->addBindAttribLocation("vInstanceModelMatrix", 3);
-	geode->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+void InstancedGeometryBuilder::resizeBatchedChunk(BatchedNode& node, unsigned int chunk, unsigned int end) const
+{
+	unsigned int start = chunk * node.chunkSize;
+	for (unsigned int level = 0; level < getNumLodLevels(); ++level)
+	{
+		node.drawable->setDrawInstances(chunk * getNumLodLevels() + level, start, end - start);
+	}
+	node.cullCallback->setChunk(chunk, end - start, computeInstanceBounds(node.localBounds, m_matrices->getData(start), end - start));
+}
+
+osg::ref_ptr<osg::Node> InstancedGeometryBuilder::createChunkedNode(ChunkTechnique technique, unsigned int maxInstances, bool quantized) const
+{
+	ChunkedNode node;
+	node.technique = technique;
+	node.quantized = quantized;
+	node.maxInstances = maxInstances;
+	node.chunkSize = std::min(maxInstances, m_maxInstancesPerChunk);
+	node.group = new osg::Group;
+
+	// sort the instances spatially, so every chunk covers a compact area of the terrain and can be culled as a whole
+	sortMatricesSpatially();
+	m_cullStatistics->setNumInstances(m_matrices->size());
+
+	if (m_instanceCulling)
+	{
+		// the instances of all chunks are culled in parallel before the chunks are traversed
+		node.chunkCullCallback = new ParallelChunkCullCallback(getJobSystem());
+		node.group->setCullCallback(node.chunkCullCallback);
+	}
+
+	// every chunk starts at a multiple of the chunk size, so added instances always go to the last chunk
+	unsigned int numChunks = (m_matrices->size() + node.chunkSize - 1) / node.chunkSize;
+	for (unsigned int i = 0; i < numChunks; ++i)
+	{
+		unsigned int start = i*node.chunkSize;
+		unsigned int end    = std::min((unsigned int)m_matrices->size(), (start + node.chunkSize));
+		createChunk(node, start, end);
+	}
+
+	m_chunkedNodes.push_back(node);
+
+	return node.group;
+}
+
+void InstancedGeometryBuilder::createChunk(ChunkedNode& node, unsigned int start, unsigned int end) const
+{
+	InstanceChunk chunk;
+	chunk.start = start;
+	chunk.end = end;
+	chunk.geode = new osg::Geode;
+	// all chunks share the arrays and their vertex buffer object, only the primitive sets are their own. The buffer
+	// objects were attached by setGeometry, so this only reads the geometry
+	chunk.geometry = new osg::Geometry(*m_geometry, osg::CopyOp::SHALLOW_COPY);
+	chunk.geode->addDrawable(chunk.geometry);
+
+	// first turn on hardware instancing for every primitive set, the indices are shared as well
+	chunk.geometry->removePrimitiveSet(0, chunk.geometry->getNumPrimitiveSets());
+	for (unsigned int i = 0; i < m_geometry->getNumPrimitiveSets(); ++i)
+	{
+		osg::PrimitiveSet* primitiveSet = m_geometry->getPrimitiveSet(i);
+		if (primitiveSet->getDrawElements())
+			chunk.geometry->addPrimitiveSet(new SharedDrawElements(primitiveSet->getDrawElements(), end-start));
+		else
+			chunk.geometry->addPrimitiveSet(static_cast<osg::PrimitiveSet*>(primitiveSet->clone(osg::CopyOp::SHALLOW_COPY)));
+		chunk.geometry->getPrimitiveSet(i)->setNumInstances(end-start);
+	}
+
+	// we need to turn off display lists for instancing to work
+	chunk.geometry->setUseDisplayList(false);
+	chunk.geometry->setUseVertexBufferObjects(true);
+
+	// instances can change while the previous frame is drawn
+	osg::StateSet* stateSet = chunk.geode->getOrCreateStateSet();
+	stateSet->setDataVariance(osg::Object::DYNAMIC);
+	chunk.geometry->setDataVariance(osg::Object::DYNAMIC);
+
+	// the instance data has room for a whole chunk, so instances can be added later
+	switch (node.technique)
+	{
+	case UNIFORM_CHUNKS:
+		if (node.quantized)
+		{
+			// every uvec4 element holds two packed instances
+			chunk.uniform = new osg::Uniform(osg::Uniform::UNSIGNED_INT_VEC4, "instanceData", (node.chunkSize+1)/2);
+		} else {
+			chunk.uniform = new osg::Uniform(osg::Uniform::FLOAT_MAT4, "instanceModelMatrix", node.chunkSize);
+		}
+		stateSet->addUniform(chunk.uniform);
+		break;
+
+	case TEXTURE_CHUNKS:
+		{
+			// the texture only uploads the instances that changed instead of the whole image
+			osg::ref_ptr<osg::TextureRectangle> texture = new osg::TextureRectangle;
+			chunk.image = new osg::Image;
+			if (node.quantized)
+			{
+				// integer texture with two packed instances per texel and 4096 texels per row
+				unsigned int height = (node.chunkSize + QUANTIZED_INSTANCES_PER_TEXTURE_ROW - 1u) / QUANTIZED_INSTANCES_PER_TEXTURE_ROW;
+				chunk.image->allocateImage(QUANTIZED_INSTANCES_PER_TEXTURE_ROW / 2u, height, 1, GL_RGBA_INTEGER_EXT, GL_UNSIGNED_INT);
+				texture->setInternalFormat(GL_RGBA32UI_EXT);
+				texture->setSourceFormat(GL_RGBA_INTEGER_EXT);
+				texture->setSourceType(GL_UNSIGNED_INT);
+				stateSet->addUniform(new osg::Uniform("instanceDataTexture", 1));
+			} else {
+				// 4096 matrices fill one row of the image, so the matrices are laid out contiguously like in our store
+				unsigned int height = (node.chunkSize + MATRICES_PER_TEXTURE_ROW - 1u) / MATRICES_PER_TEXTURE_ROW;
+				chunk.image->allocateImage(MATRICES_PER_TEXTURE_ROW * 4u, height, 1, GL_RGBA, GL_FLOAT);
+				texture->setInternalFormat(GL_RGBA32F_ARB);
+				texture->setSourceFormat(GL_RGBA);
+				texture->setSourceType(GL_FLOAT);
+				stateSet->addUniform(new osg::Uniform("instanceMatrixTexture", 1));
+			}
+			memset(chunk.image->data(), 0, chunk.image->getTotalSizeInBytes());
+
+			chunk.subloadCallback = new InstanceTextureSubloadCallback(chunk.image);
+			texture->setSubloadCallback(chunk.subloadCallback);
+			texture->setTextureSize(chunk.image->s(), chunk.image->t());
+			texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+			texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+			texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+			texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+			stateSet->setTextureAttributeAndModes(1, texture, osg::StateAttribute::ON);
+		}
+		break;
+
+	case UBO_CHUNKS:
+		{
+			// the buffer always covers the whole uniform block of the shader
+			if (node.quantized)
+				chunk.bufferArray = new osg::UIntArray(node.maxInstances*InstanceQuantization::WORDS_PER_INSTANCE);
+			else
+				chunk.bufferArray = new osg::FloatArray(node.maxInstances*16);
+
+			osg::ref_ptr<osg::UniformBufferObject> ubo = new osg::UniformBufferObject;
+			ubo->setUsage(GL_DYNAMIC_DRAW_ARB);
+			chunk.bufferArray->setBufferObject(ubo);
+
+			// the buffer object does not own its array, so the geode keeps it alive
+			chunk.geode->setUserData(chunk.bufferArray);
+
+			// create uniform buffer binding and add it to the stateset
+			osg::ref_ptr<osg::UniformBufferBinding> ubb = new osg::UniformBufferBinding(0, ubo, 0, chunk.bufferArray->getTotalDataSize());
+			stateSet->setAttributeAndModes(ubb, osg::StateAttribute::ON);
+		}
+		break;
+	}
+
+	// create bounding box callback for our part of the matrix store
+	chunk.boundingBoxCallback = new ComputeTextureBoundingBoxCallback(m_matrices, start, end);
+	chunk.geometry->setComputeBoundingBoxCallback(chunk.boundingBoxCallback);
 
 	// add matrix uniforms and update callback
 	osg::ref_ptr<osgExample::MatrixUniformUpdateCallback> updateCallback = new osgExample::MatrixUniformUpdateCallback;
-	geode->getOrCreateStateSet()->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
-	geode->getOrCreateStateSet()->addUniform(updateCallback->getNormalMatrixUniform());
-	geode->setCullCallback(updateCallback);
+	stateSet->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
+	stateSet->addUniform(updateCallback->getNormalMatrixUniform());
+	chunk.geode->setCullCallback(updateCallback);
+	chunk.countCallback = new CountInstancesCullCallback(m_cullStatistics, end-start);
+
+	if (m_instanceCulling)
+	{
+		chunk.instanceCullCallback = createInstanceCullCallback(node.quantized, false);
+		chunk.instanceCullCallback->setRange(start, end);
+		chunk.instanceCullCallback->setCountCallback(chunk.countCallback);
+		chunk.instanceCullCallback->setJobSystem(getJobSystem());
+
+		// dirty the gathered instances and draw only them
+		ChunkTechnique technique = node.technique;
+		bool quantized = node.quantized;
+		osg::ref_ptr<osg::Uniform> uniform = chunk.uniform;
+		osg::ref_ptr<InstanceTextureSubloadCallback> subloadCallback = chunk.subloadCallback;
+		osg::ref_ptr<osg::Array> bufferArray = chunk.bufferArray;
+		osg::ref_ptr<osg::Geometry> geometry = chunk.geometry;
+		chunk.instanceCullCallback->setTarget(getChunkData(node, chunk), [=](unsigned int numVisibleInstances)
+		{
+			switch (technique)
+			{
+			case UNIFORM_CHUNKS:
+				uniform->dirty();
+				break;
+			case TEXTURE_CHUNKS:
+				subloadCallback->dirtyTexels(0, quantized ? (numVisibleInstances + 1) / 2 : numVisibleInstances * 4);
+				break;
+			case UBO_CHUNKS:
+				bufferArray->dirty();
+				break;
+			}
+			for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+			{
+				geometry->getPrimitiveSet(i)->setNumInstances(numVisibleInstances);
+			}
+		});
+		updateCallback->addNestedCallback(chunk.instanceCullCallback);
+		node.chunkCullCallback->addChunk(chunk.instanceCullCallback);
+	}
+	updateCallback->addNestedCallback(chunk.countCallback);
 
-	return geode;
+	writeChunkInstances(node, chunk, start, end, true);
+
+	node.group->addChild(chunk.geode);
+	node.chunks.push_back(chunk);
 }
 
-osg::ref_ptr<osg::Node> InstancedGeometryBuilder::createHardwareInstancedGeode(unsigned int start, unsigned int end) const
+GLvoid* InstancedGeometryBuilder::getChunkData(const ChunkedNode& node, InstanceChunk& chunk) const
 {
-		// we don't have more matrices than uniform space so we only need one geode
-		osg::ref_ptr<osg::Geode>	geode = new osg::Geode;
-		osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry(*m_geometry, osg::CopyOp::DEEP_COPY_ALL);
-		geode->addDrawable(geometry);
+	// all techniques store the instances of a chunk contiguously from the beginning of their data
+	switch (node.technique)
+	{
+	case UNIFORM_CHUNKS:
+		return node.quantized ? (GLvoid*)&(*chunk.uniform->getUIntArray())[0] : (GLvoid*)&(*chunk.uniform->getFloatArray())[0];
+	case TEXTURE_CHUNKS:
+		return chunk.image->data();
+	case UBO_CHUNKS:
+		return (GLvoid*)chunk.bufferArray->getDataPointer();
+	}
+	return NULL;
+}
 
-		// first turn on hardware instancing for every primitive set
-		for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+void InstancedGeometryBuilder::writeChunkInstances(ChunkedNode& node, InstanceChunk& chunk, unsigned int start, unsigned int end, bool requantize) const
+{
+	if (end <= start)
+		return;
+
+	// with instance culling the cull callback gathers the visible instances from its source copy every frame
+	GLvoid* data = chunk.instanceCullCallback.valid() ? chunk.instanceCullCallback->getSourceData(chunk.start) : getChunkData(node, chunk);
+
+	if (node.quantized)
+	{
+		// instances that leave the range of the chunk need a new range for the whole chunk
+		GLuint* instances = static_cast<GLuint*>(data);
+		for (unsigned int i = start; i < end && !requantize; ++i)
+		{
+			requantize = !InstanceQuantization::quantizeInstance(m_matrices->getTransform(i), chunk.range, instances + (i - chunk.start) * InstanceQuantization::WORDS_PER_INSTANCE);
+		}
+
+		if (requantize)
 		{
-			geometry->getPrimitiveSet(i)->setNumInstances(end-start);
+			chunk.range = InstanceQuantization::quantize(*m_matrices, chunk.start, chunk.end, instances);
+			InstanceQuantization::setRangeUniforms(chunk.geode->getOrCreateStateSet(), chunk.range);
+			start = chunk.start;
+			end = chunk.end;
 		}
+	} else {
+		memcpy(static_cast<GLfloat*>(data) + (start - chunk.start) * 16, m_matrices->getData(start), m_matrices->getDataSize(start, end));
+	}
+
+	if (chunk.instanceCullCallback.valid())
+	{
+		chunk.instanceCullCallback->dirtyBounds(start, end);
+		chunk.geometry->dirtyBound();
+		return;
+	}
 
-		// we need to turn off display lists for instancing to work
-		geometry->setUseDisplayList(false);
-		geometry->setUseVertexBufferObjects(true);
+	// osg uploads uniforms and uniform buffers as a whole, the texture only uploads the changed texels
+	switch (node.technique)
+	{
+	case UNIFORM_CHUNKS:
+		chunk.uniform->dirty();
+		break;
+	case TEXTURE_CHUNKS:
+		if (node.quantized)
+			chunk.subloadCallback->dirtyTexels((start - chunk.start) / 2, (end - chunk.start + 1) / 2);
+		else
+			chunk.subloadCallback->dirtyTexels((start - chunk.start) * 4, (end - chunk.start) * 4);
+		break;
+	case UBO_CHUNKS:
+		chunk.bufferArray->dirty();
+		break;
+	}
+
+	chunk.geometry->dirtyBound();
+}
 
-		// create uniform array for matrices
-		osg::ref_ptr<osg::Uniform> instanceMatrixUniform = new osg::Uniform(osg::Uniform::FLOAT_MAT4, "instanceModelMatrix", end-start);
+void InstancedGeometryBuilder::resizeChunk(InstanceChunk& chunk, unsigned int end) const
+{
+	chunk.end = end;
+	for (unsigned int i = 0; i < chunk.geometry->getNumPrimitiveSets(); ++i)
+	{
+		chunk.geometry->getPrimitiveSet(i)->setNumInstances(chunk.end - chunk.start);
+	}
+	chunk.boundingBoxCallback->setRange(chunk.start, chunk.end);
+	chunk.countCallback->setNumInstances(chunk.end - chunk.start);
+	if (chunk.instanceCullCallback.valid())
+		chunk.instanceCullCallback->setRange(chunk.start, chunk.end);
+	chunk.geometry->dirtyBound();
+}
 
-		for (unsigned int i = start, j = 0; i < end; ++i, ++j)
+void InstancedGeometryBuilder::writeAttributeInstance(AttributeNode& node, unsigned int index) const
+{
+	unsigned int start = index;
+	unsigned int end = index + 1;
+	if (node.quantizedInstances.valid())
+	{
+		GLuint* instances = &(*node.quantizedInstances)[0];
+		if (!InstanceQuantization::quantizeInstance(m_matrices->getTransform(index), node.range, instances + index * InstanceQuantization::WORDS_PER_INSTANCE))
 		{
-			instanceMatrixUniform->setElement(j, m_matrices[i]);
+			// the instance left the range of all instances, so all of them have to be packed again
+			node.range = InstanceQuantization::quantize(*m_matrices, 0, m_matrices->size(), instances);
+			InstanceQuantization::setRangeUniforms(node.geode->getOrCreateStateSet(), node.range);
+			start = 0;
+			end = m_matrices->size();
 		}
-		geode->getOrCreateStateSet()->addUniform(instanceMatrixUniform);
-			
-		// add bounding box callback so osg computes the right bounding box for our geode
-		geometry->setComputeBoundingBoxCallback(new ComputeInstancedBoundingBoxCallback(instanceMatrixUniform));
+	}
 
-		// add matrix uniforms and update callback
-		osg::ref_ptr<osgExample::MatrixUniformUpdateCallback> updateCallback = new osgExample::MatrixUniformUpdateCallback;
-		geode->getOrCreateStateSet()->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
-		geode->getOrCreateStateSet()->addUniform(updateCallback->getNormalMatrixUniform());
-		geode->setCullCallback(updateCallback);
+	if (node.instanceCullCallback.valid())
+	{
+		const GLubyte* source = node.quantizedInstances.valid() ? reinterpret_cast<const GLubyte*>(&(*node.quantizedInstances)[start * InstanceQuantization::WORDS_PER_INSTANCE])
+																: reinterpret_cast<const GLubyte*>(m_matrices->getData(start));
+		size_t instanceSize = node.quantizedInstances.valid() ? InstanceQuantization::WORDS_PER_INSTANCE * sizeof(GLuint) : m_matrices->getDataSize(0, 1);
+		memcpy(node.instanceCullCallback->getSourceData(start), source, (end - start) * instanceSize);
+		node.instanceCullCallback->dirtyBounds(start, end);
+	}
 
-		return geode;
+	for (auto it = node.drawables.begin(); it != node.drawables.end(); ++it)
+	{
+		(*it)->dirtyInstances(start, end);
+	}
 }
 
-osg::ref_ptr<osg::Node> InstancedGeometryBuilder::createTextureHardwareInstancedGeode(unsigned int start, unsigned int end) const
+void InstancedGeometryBuilder::resizeAttributeInstances(AttributeNode& node) const
 {
-	osg::ref_ptr<osg::Geode>	geode = new osg::Geode;
-	osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry(*m_geometry, osg::CopyOp::DEEP_COPY_ALL);
-	geode->addDrawable(geometry);
+	unsigned int size = m_matrices->size();
+	if (node.quantizedInstances.valid())
+		node.quantizedInstances->resize(size * InstanceQuantization::WORDS_PER_INSTANCE);
+	for (auto it = node.drawables.begin(); it != node.drawables.end(); ++it)
+	{
+		(*it)->getDrawElements()->setNumInstances(size);
+	}
+	node.countCallback->setNumInstances(size);
 
-	// first turn on hardware instancing for every primitive set
-	for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+	if (node.instanceCullCallback.valid())
 	{
-		geometry->getPrimitiveSet(i)->setNumInstances(m_matrices.size());
+		// the compacted array of every level can hold all instances, its data moves when it grows
+		unsigned int previousSize = node.instanceCullCallback->getSourceSize();
+		for (unsigned int level = 0; level < node.drawables.size(); ++level)
+		{
+			// the drawable issues an instanced draw call even for zero instances, so an empty level draws nothing
+			osg::ref_ptr<osg::DrawElements> drawElements = node.drawables[level]->getDrawElements();
+			InstanceCullCallback::CompactCallback compactCallback = [=](unsigned int numVisibleInstances) { drawElements->setNumInstances(numVisibleInstances); };
+
+			if (node.quantizedInstances.valid())
+			{
+				osg::UIntArray* instances = static_cast<osg::UIntArray*>(node.compactedInstances[level].get());
+				instances->resize(std::max(size, 1u) * InstanceQuantization::WORDS_PER_INSTANCE);
+				node.instanceCullCallback->setTarget(&(*instances)[0], compactCallback, level);
+			} else {
+				osg::FloatArray* matrices = static_cast<osg::FloatArray*>(node.compactedInstances[level].get());
+				matrices->resize(std::max(size, 1u) * 16);
+				node.instanceCullCallback->setTarget(&(*matrices)[0], compactCallback, level);
+			}
+		}
+		node.instanceCullCallback->setRange(0, size);
+
+		// fill the source copy of the instances that were not culled before
+		for (unsigned int i = previousSize; i < size; ++i)
+		{
+			writeAttributeInstance(node, i);
+		}
 	}
+}
 
-	// we need to turn off display lists for instancing to work
-	geometry->setUseDisplayList(false);
-	geometry->setUseVertexBufferObjects(true);
-	
-	// create texture to encode all matrices
-	unsigned int height = ((end-start) / 4096u) + 1u;
-	osg::ref_ptr<osg::Image> image = new osg::Image;
-	image->allocateImage(16384, height, 1, GL_RGBA, GL_FLOAT);
-	image->setInternalTextureFormat(GL_RGBA32F_ARB);
-
-	for (unsigned int i = start, j = 0; i < end; ++i, ++j)
-	{
-		osg::Matrixf matrix = m_matrices[i];
-		float * data = (float*)image->data((j % 4096u) *4u, j / 4096u);
-		memcpy(data, matrix.ptr(), 16 * sizeof(float));
-	}
-
-	osg::ref_ptr<osg::TextureRectangle> texture = new osg::TextureRectangle(image);
-	texture->setInternalFormat(GL_RGBA32F_ARB);
-	texture->setSourceFormat(GL_RGBA);
-	texture->setSourceType(GL_FLOAT);
-	texture->setTextureSize(4, end-start);
-	texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
-	texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
-	texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_BORDER);
-	texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_BORDER);
-
-	geode->getOrCreateStateSet()->setTextureAttributeAndModes(1, texture, osg::StateAttribute::ON);
-	geode->getOrCreateStateSet()->addUniform(new osg::Uniform("instanceMatrixTexture", 1));
-
-	// copy part of matrix list and create bounding box callback
-	std::vector<osg::Matrixd> matrices;
-	matrices.insert(matrices.begin(), m_matrices.begin()+start, m_matrices.begin()+end);
-	geometry->setComputeBoundingBoxCallback(new ComputeTextureBoundingBoxCallback(matrices));
-	
-	// add matrix uniforms and update callback
-	osg::ref_ptr<osgExample::MatrixUniformUpdateCallback> updateCallback = new osgExample::MatrixUniformUpdateCallback;
-	geode->getOrCreateStateSet()->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
-	geode->getOrCreateStateSet()->addUniform(updateCallback->getNormalMatrixUniform());
-	geode->setCullCallback(updateCallback);
+osg::ref_ptr<JobSystem> InstancedGeometryBuilder::getJobSystem() const
+{
+	// all nodes share the worker threads
+	if (!m_jobSystem.valid())
+		m_jobSystem = new JobSystem(m_numCullThreads);
+	return m_jobSystem;
+}
+
+osg::ref_ptr<InstanceCullCallback> InstancedGeometryBuilder::createInstanceCullCallback(bool quantized, bool lod) const
+{
+	osg::BoundingBox localBounds = computeVertexBounds(dynamic_cast<const osg::Vec3Array*>(m_geometry->getVertexArray()));
+	if (lod)
+	{
+		// the bounds of an instance have to contain every level it can switch to
+		for (auto it = m_lodGeometries.begin(); it != m_lodGeometries.end(); ++it)
+		{
+			localBounds.expandBy(computeVertexBounds(dynamic_cast<const osg::Vec3Array*>((*it)->getVertexArray())));
+		}
+	}
 
-	return geode;
+	size_t instanceSize = quantized ? InstanceQuantization::WORDS_PER_INSTANCE * sizeof(GLuint) : m_matrices->getDataSize(0, 1);
+	osg::ref_ptr<InstanceCullCallback> cullCallback = new InstanceCullCallback(m_matrices, localBounds, instanceSize);
+	if (lod)
+		cullCallback->setLodSwitchDistances(m_lodSwitchDistances);
+	return cullCallback;
 }
 
-osg::ref_ptr<osg::Node> InstancedGeometryBuilder::createUBOHardwareInstancedGeode(unsigned int start, unsigned int end, unsigned int maxUBOMatrices) const
+osg::ref_ptr<InstancedDrawable> InstancedGeometryBuilder::createInstancedDrawable(osg::Geometry* geometry) const
 {
-	osg::ref_ptr<osg::Geode>	geode = new osg::Geode;
-	osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry(*m_geometry, osg::CopyOp::DEEP_COPY_ALL);
-	geode->addDrawable(geometry);
+	osg::ref_ptr<InstancedDrawable> drawable = new InstancedDrawable;
+	drawable->setVertexArray(dynamic_cast<osg::Vec3Array*>(geometry->getVertexArray()));
+	drawable->setNormalArray(dynamic_cast<osg::Vec3Array*>(geometry->getNormalArray()));
+	drawable->setTexCoordArray(dynamic_cast<osg::Vec2Array*>(geometry->getTexCoordArray(0)));
 
-	// first turn on hardware instancing for every primitive set
-	for (unsigned int i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+	osg::ref_ptr<osg::DrawElements> instancedPrimitive = dynamic_cast<osg::DrawElements*>(geometry->getPrimitiveSet(0)->clone(osg::CopyOp::DEEP_COPY_ALL));
+	instancedPrimitive->setNumInstances(m_matrices->size());
+	drawable->setDrawElements(instancedPrimitive);
+	drawable->setMatrixArray(m_matrices);
+	drawable->setStreamingInstances(m_streamingInstances);
+	drawable->setDataVariance(osg::Object::DYNAMIC);
+	return drawable;
+}
+
+void InstancedGeometryBuilder::writeNodes(unsigned int index) const
+{
+	for (auto it = m_chunkedNodes.begin(); it != m_chunkedNodes.end(); ++it)
 	{
-		geometry->getPrimitiveSet(i)->setNumInstances(m_matrices.size());
+		InstanceChunk& chunk = it->chunks[index / it->chunkSize];
+		writeChunkInstances(*it, chunk, index, index + 1, false);
 	}
 
-	// we need to turn off display lists for instancing to work
-	geometry->setUseDisplayList(false);
-	geometry->setUseVertexBufferObjects(true);
-	
-	// create uniform buffer object for all matrices
-	osg::FloatArray* matrixArray = new osg::FloatArray(maxUBOMatrices*16);
-	m_floatArrays.push_back(matrixArray);
-	for (unsigned int i = start, j = 0; i < end; ++i, ++j)
+	for (auto it = m_softwareNodes.begin(); it != m_softwareNodes.end(); ++it)
+	{
+		static_cast<osg::MatrixTransform*>(it->group->getChild(index))->setMatrix(osg::Matrixd(m_matrices->getTransform(index)));
+	}
+
+	for (auto it = m_attributeNodes.begin(); it != m_attributeNodes.end(); ++it)
 	{
-		for (unsigned int k = 0; k < 16; ++k)
+		writeAttributeInstance(*it, index);
+	}
+
+	for (auto it = m_batchedNodes.begin(); it != m_batchedNodes.end(); ++it)
+	{
+		unsigned int chunk = index / it->chunkSize;
+		it->drawable->dirtyInstances(index, index + 1);
+		resizeBatchedChunk(*it, chunk, std::min((chunk + 1) * it->chunkSize, (unsigned int)m_matrices->size()));
+	}
+}
+
+void InstancedGeometryBuilder::growNodes() const
+{
+	unsigned int index = m_matrices->size() - 1;
+	m_cullStatistics->setNumInstances(m_matrices->size());
+
+	// the new instance goes to the last chunk, or to a new one if the last chunk is full
+	for (auto it = m_chunkedNodes.begin(); it != m_chunkedNodes.end(); ++it)
+	{
+		if (index / it->chunkSize < it->chunks.size())
 		{
-			(*matrixArray)[j*16+k] =  m_matrices[i].ptr()[k];
+			InstanceChunk& chunk = it->chunks.back();
+			resizeChunk(chunk, index + 1);
+			writeChunkInstances(*it, chunk, index, index + 1, false);
+		} else {
+			createChunk(*it, index, index + 1);
 		}
 	}
-	osg::ref_ptr<osg::UniformBufferObject> ubo = new osg::UniformBufferObject;
-	ubo->setUsage(GL_STATIC_DRAW_ARB);
-	ubo->setDataVariance(osg::Object::STATIC);
-	matrixArray->setBufferObject(ubo);
-
-	// create uniform buffer binding and add it to the stateset
-	osg::ref_ptr<osg::UniformBufferBinding> ubb = new osg::UniformBufferBinding(0, ubo, 0, maxUBOMatrices*16*sizeof(GLfloat));
-	geode->getOrCreateStateSet()->setAttributeAndModes(ubb, osg::StateAttribute::ON);
 
-	// copy part of matrix list and create bounding box callback
-	std::vector<osg::Matrixd> matrices;
-	matrices.insert(matrices.begin(), m_matrices.begin()+start, m_matrices.begin()+end);
-	geometry->setComputeBoundingBoxCallback(new ComputeTextureBoundingBoxCallback(matrices));
+	for (auto it = m_softwareNodes.begin(); it != m_softwareNodes.end(); ++it)
+	{
+		osg::ref_ptr<osg::MatrixTransform> matrixTransform = new osg::MatrixTransform(osg::Matrixd(m_matrices->getTransform(index)));
+		matrixTransform->addChild(it->instance);
+		matrixTransform->setCullCallback(it->countCallback);
+		it->group->addChild(matrixTransform);
+	}
 
-	// add matrix uniforms and update callback
-	osg::ref_ptr<osgExample::MatrixUniformUpdateCallback> updateCallback = new osgExample::MatrixUniformUpdateCallback;
-	geode->getOrCreateStateSet()->addUniform(updateCallback->getModelViewProjectionMatrixUniform());
-	geode->getOrCreateStateSet()->addUniform(updateCallback->getNormalMatrixUniform());
-	geode->setCullCallback(updateCallback);
+	for (auto it = m_attributeNodes.begin(); it != m_attributeNodes.end(); ++it)
+	{
+		resizeAttributeInstances(*it);
+		if (!it->instanceCullCallback.valid())
+			writeAttributeInstance(*it, index);
+	}
 
-	return geode;
+	for (auto it = m_batchedNodes.begin(); it != m_batchedNodes.end(); ++it)
+	{
+		it->drawable->dirtyInstances(index, index + 1);
+		if (index / it->chunkSize < it->cullCallback->getNumChunks())
+			resizeBatchedChunk(*it, index / it->chunkSize, index + 1);
+		else
+			addBatchedChunk(*it, index, index + 1);
+	}
 }
 
-osg::ref_ptr<osg::Shader> InstancedGeometryBuilder::readShaderFile(const std::string& fileName, const std::string& preprocessorDefinitions) const
+void InstancedGeometryBuilder::shrinkNodes() const
 {
-	// open vertex shader file
-	std::ifstream vsShaderFile;
-    vsShaderFile.open(fileName.c_str(), std::ios_base::in);
+	unsigned int size = m_matrices->size();
+	m_cullStatistics->setNumInstances(size);
+
+	// the last instance was removed, so the last chunk loses one instance
+	for (auto it = m_chunkedNodes.begin(); it != m_chunkedNodes.end(); ++it)
+	{
+		InstanceChunk& chunk = it->chunks.back();
+		if (size > chunk.start)
+		{
+			resizeChunk(chunk, size);
+		} else {
+			it->group->removeChild(chunk.geode);
+			if (it->chunkCullCallback.valid())
+				it->chunkCullCallback->removeLastChunk();
+			it->chunks.pop_back();
+		}
+	}
+
+	for (auto it = m_softwareNodes.begin(); it != m_softwareNodes.end(); ++it)
+	{
+		it->group->removeChild(size);
+	}
+
+	for (auto it = m_attributeNodes.begin(); it != m_attributeNodes.end(); ++it)
+	{
+		resizeAttributeInstances(*it);
+	}
+
+	for (auto it = m_batchedNodes.begin(); it != m_batchedNodes.end(); ++it)
+	{
+		unsigned int lastChunk = it->cullCallback->getNumChunks() - 1;
+		if (size > lastChunk * it->chunkSize)
+		{
+			resizeBatchedChunk(*it, lastChunk, size);
+		} else {
+			for (unsigned int level = 0; level < getNumLodLevels(); ++level)
+			{
+				it->drawable->removeLastDraw();
+			}
+			it->cullCallback->removeLastChunk();
+		}
+	}
+}
 
-	if(!vsShaderFile.is_open()) {
-		std::cout << "Error: Could not open shader file " << fileName << std::endl;
-		return NULL;
+InstancedGeometryBuilder::InstanceHandle InstancedGeometryBuilder::addTransform(const osg::Matrixf& matrix)
+{
+	InstanceHandle handle;
+	if (m_freeHandles.empty())
+	{
+		handle = m_handleIndices.size();
+		m_handleIndices.push_back(m_matrices->size());
+	} else {
+		handle = m_freeHandles.back();
+		m_freeHandles.pop_back();
+		m_handleIndices[handle] = m_matrices->size();
 	}
+	m_indexHandles.push_back(handle);
+	m_matrices->addTransform(matrix);
+
+	// nodes reference the instances by index, so once they exist the order is fixed
+	if (hasNodes())
+		growNodes();
+	else
+		m_matricesSorted = false;
+
+	return handle;
+}
+
+bool InstancedGeometryBuilder::updateTransform(InstanceHandle handle, const osg::Matrixf& matrix)
+{
+	if (!isValidHandle(handle))
+		return false;
+
+	unsigned int index = m_handleIndices[handle];
+	m_matrices->getTransform(index) = matrix;
+	writeNodes(index);
+	return true;
+}
 
-	std::stringstream vsShaderStr;
-	std::string line;
-	std::getline(vsShaderFile, line);
-	vsShaderStr << line << std::endl;
-	vsShaderStr << preprocessorDefinitions << std::endl;
-	while (!vsShaderFile.eof()) {
-		std::getline(vsShaderFile, line);
-		vsShaderStr << line << std::endl;
+bool InstancedGeometryBuilder::useQuantizedInstances() const
+{
+	if (m_instanceFormat != QUANTIZED_INSTANCES)
+		return false;
+
+	if (!InstanceQuantization::canQuantize(*m_matrices, 0, m_matrices->size()))
+	{
+		std::cout << "Warning: Instance matrices contain more than translation, z rotation and uniform scale, using full matrices" << std::endl;
+		return false;
 	}
-	vsShaderFile.close();
 
-	return new osg::Shader(osg::Shader::VERTEX, vsShaderStr.str());
+	return true;
 }
 
+void InstancedGeometryBuilder::sortMatricesSpatially() const
+{
+	if (m_matricesSorted)
+		return;
+	m_matricesSorted = true;
+
+	if (m_matrices->size() < 2)
+		return;
+
+	// find the area covered by the instances
+	osg::BoundingBox bounds;
+	for (size_t i = 0; i < m_matrices->size(); ++i)
+	{
+		bounds.expandBy(m_matrices->getTransform(i).getTrans());
+	}
+	float scaleX = bounds.xMax() > bounds.xMin() ? 65535.0f / (bounds.xMax() - bounds.xMin()) : 0.0f;
+	float scaleY = bounds.yMax() > bounds.yMin() ? 65535.0f / (bounds.yMax() - bounds.yMin()) : 0.0f;
+
+	// order the instances along a z-order curve, so consecutive instances are also neighbours on the terrain
+	std::vector<std::pair<unsigned int, unsigned int> > keys(m_matrices->size());
+	for (size_t i = 0; i < m_matrices->size(); ++i)
+	{
+		osg::Vec3 position = m_matrices->getTransform(i).getTrans();
+		unsigned int x = (unsigned int)((position.x() - bounds.xMin()) * scaleX);
+		unsigned int y = (unsigned int)((position.y() - bounds.yMin()) * scaleY);
+		keys[i] = std::make_pair(spreadBits(x) | (spreadBits(y) << 1), (unsigned int)i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<unsigned int> order(keys.size());
+	std::vector<InstanceHandle> indexHandles(keys.size());
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		order[i] = keys[i].second;
+		indexHandles[i] = m_indexHandles[order[i]];
+		m_handleIndices[indexHandles[i]] = i;
+	}
+	m_matrices->reorder(order);
+	m_indexHandles.swap(indexHandles);
 }
+
+}
\ No newline at end of file
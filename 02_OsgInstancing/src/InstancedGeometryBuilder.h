@@ -26,13 +26,30 @@
 
 // std
 #include <vector>
+#include <algorithm>
+#include <functional>
 
 // osg
 #include <osg/Referenced>
 #include <osg/ref_ptr>
 #include <osg/Matrix>
 #include <osg/Geometry>
+#include <osg/Geode>
+#include <osg/Group>
 #include <osg/Node>
+#include <osg/Uniform>
+#include <osg/Image>
+
+// osgExample
+#include "InstanceTransformStore.h"
+#include "InstanceCullStatistics.h"
+#include "InstanceQuantization.h"
+#include "InstanceTextureSubloadCallback.h"
+#include "ComputeTextureBoundingBoxCallback.h"
+#include "InstancedDrawable.h"
+#include "BatchedInstancedDrawable.h"
+#include "InstanceCullCallback.h"
+#include "ShaderProgramCache.h"
 
 namespace osgExample
 {
@@ -40,45 +57,240 @@ namespace osgExample
 class InstancedGeometryBuilder : public osg::Referenced
 {
 public:
+	enum InstanceFormat
+	{
+		MATRIX_INSTANCES,		// full float mat4 per instance(64 bytes)
+		QUANTIZED_INSTANCES		// packed position, z rotation and scale per instance(8 bytes), see InstanceQuantization
+	};
+
+	// stable id of an instance, the index of an instance changes when the matrices are sorted or removed
+	typedef unsigned int InstanceHandle;
+	static const InstanceHandle INVALID_INSTANCE_HANDLE = 0xffffffffu;
+
 	InstancedGeometryBuilder()
 		:	m_maxMatrixUniforms(16),
 			m_maxTextureResolution(16384u * 4096u),
-			m_maxUniformBlockSize(16384)
+			m_maxUniformBlockSize(16384),
+			m_maxInstancesPerChunk(1024),
+			m_instanceFormat(MATRIX_INSTANCES),
+			m_streamingInstances(false),
+			m_instanceCulling(false),
+			m_numCullThreads(0),
+			m_matrices(new InstanceTransformStore),
+			m_matricesSorted(false),
+			m_cullStatistics(new InstanceCullStatistics),
+			m_programCache(new ShaderProgramCache)
 	{
 	}
 	
 	InstancedGeometryBuilder(GLint maxMatrixUniforms, GLint maxUniformBlockSize)
 		:	m_maxMatrixUniforms(maxMatrixUniforms),
 			m_maxTextureResolution(16384u * 4096u),
-			m_maxUniformBlockSize(maxUniformBlockSize)
+			m_maxUniformBlockSize(maxUniformBlockSize),
+			m_maxInstancesPerChunk(1024),
+			m_instanceFormat(MATRIX_INSTANCES),
+			m_streamingInstances(false),
+			m_instanceCulling(false),
+			m_numCullThreads(0),
+			m_matrices(new InstanceTransformStore),
+			m_matricesSorted(false),
+			m_cullStatistics(new InstanceCullStatistics),
+			m_programCache(new ShaderProgramCache)
 	{
 	}
 	
-	inline void setGeometry(osg::ref_ptr<osg::Geometry> geometry) { m_geometry = geometry; }
+	// attaches the buffer objects the chunks share to the arrays and indices, so call it before the scene is drawn
+	void setGeometry(osg::ref_ptr<osg::Geometry> geometry);
 	inline osg::ref_ptr<osg::Geometry> getGeometry() const { return m_geometry; }
 
-	inline void addMatrix(const osg::Matrixd& matrix) { m_matrices.push_back(matrix); }
-	inline osg::Matrixd getMatrix(size_t index) const { return m_matrices[index]; }
-	inline void clearMatrices() { m_matrices.clear(); }
+	/**
+	 Adds a coarser geometry that is drawn for instances farther away from the eye than switchDistance, the
+	 geometry set by setGeometry is the finest level. The vertex attribute technique bins the visible instances
+	 by distance while culling them and draws every level with its own instanced draw call, the software technique
+	 uses an osg::LOD that measures the distance in world space as well. The chunked techniques always draw the finest level.
+	*/
+	void addLodGeometry(float switchDistance, osg::ref_ptr<osg::Geometry> geometry);
+	inline void clearLodGeometries() { m_lodGeometries.clear(); m_lodSwitchDistances.clear(); }
+	inline unsigned int getNumLodLevels() const { return m_lodGeometries.size() + 1; }
+
+	// quantized instances are only used if every matrix can be represented, otherwise the builder falls back to matrices
+	inline void setInstanceFormat(InstanceFormat instanceFormat) { m_instanceFormat = instanceFormat; }
+	inline InstanceFormat getInstanceFormat() const { return m_instanceFormat; }
+
+	// upper bound of instances in one chunk, smaller chunks get culled more precisely but need more draw calls
+	inline void setMaxInstancesPerChunk(unsigned int maxInstancesPerChunk) { m_maxInstancesPerChunk = std::max(maxInstancesPerChunk, 1u); }
+	inline unsigned int getMaxInstancesPerChunk() const { return m_maxInstancesPerChunk; }
+
+	// the vertex attribute technique copies all instances to a ring buffer every frame, for instances that change every frame
+	inline void setStreamingInstances(bool streamingInstances) { m_streamingInstances = streamingInstances; }
+	inline bool getStreamingInstances() const { return m_streamingInstances; }
+
+	// tests every instance against the view frustum during cull and only draws the visible ones, chunks are still
+	// culled as a whole first. The software technique always culls single instances, the vertex attribute technique
+	// also culls single instances if there is more than one level of detail
+	inline void setInstanceCulling(bool instanceCulling) { m_instanceCulling = instanceCulling; }
+	inline bool getInstanceCulling() const { return m_instanceCulling; }
+	// threads that cull the instances of the chunks in parallel, including the cull thread, 0 uses one per core
+	inline void setNumCullThreads(unsigned int numCullThreads) { m_numCullThreads = numCullThreads; m_jobSystem = NULL; }
+	inline unsigned int getNumCullThreads() const { return m_numCullThreads; }
+
+	/**
+	 Adds, changes or removes a single instance. Nodes created before are updated in place: only the instance data
+	 of the affected chunks is written and uploaded again and only their bounds are recomputed. Changes to existing
+	 nodes have to be made from the update traversal or an event handler.
+	*/
+	InstanceHandle addMatrix(const osg::Matrixd& matrix);
+	InstanceHandle addMatrix(const osg::Matrixf& matrix);
+	bool updateMatrix(InstanceHandle handle, const osg::Matrixd& matrix);
+	bool updateMatrix(InstanceHandle handle, const osg::Matrixf& matrix);
+	bool removeMatrix(InstanceHandle handle);
+
+	inline bool isValidHandle(InstanceHandle handle) const { return handle < m_handleIndices.size() && m_handleIndices[handle] != INVALID_INSTANCE_HANDLE; }
+	inline const osg::Matrixf& getMatrix(InstanceHandle handle) const { return m_matrices->getTransform(m_handleIndices[handle]); }
+	inline void reserveMatrices(size_t numMatrices) { m_matrices->reserve(numMatrices); m_handleIndices.reserve(numMatrices); m_indexHandles.reserve(numMatrices); }
+	/**
+	 Appends numMatrices matrices in parallel. The generator is called from several threads at once and has to fill
+	 the matrices [begin-end) of the new ones, their handles are consecutive. Meant for placing the instances
+	 before the nodes are created, afterwards the matrices are added one by one.
+	*/
+	typedef std::function<void(size_t begin, size_t end, osg::Matrixf* matrices)> MatrixGenerator;
+	void generateMatrices(size_t numMatrices, const MatrixGenerator& generator);
+	// nodes created earlier keep referencing the old store, so start a new one instead of clearing it
+	void clearMatrices();
+	inline osg::ref_ptr<const InstanceTransformStore> getMatrices() const { return m_matrices; }
+
+	// drawn and culled instances of the last frame, counted by all nodes this builder created
+	inline osg::ref_ptr<InstanceCullStatistics> getCullStatistics() const { return m_cullStatistics; }
+	// programs of all techniques, shared by every node the builder creates
+	inline osg::ref_ptr<ShaderProgramCache> getProgramCache() const { return m_programCache; }
+
+	// prints the memory of the mesh and the instance data of every chunked node in RAM, the buffer objects and
+	// textures hold the same amount on the gpu
+	void printMemoryReport() const;
 
 	osg::ref_ptr<osg::Node> getSoftwareInstancedNode() const;
 	osg::ref_ptr<osg::Node> getHardwareInstancedNode() const;
 	osg::ref_ptr<osg::Node> getTextureHardwareInstancedNode() const;
 	osg::ref_ptr<osg::Node> getUBOHardwareInstancedNode() const;
 	osg::ref_ptr<osg::Node> getVertexAttribHardwareInstancedNode() const;
+	// all chunks and levels of detail in one multi draw indirect call, always uses matrices
+	osg::ref_ptr<osg::Node> getBatchedHardwareInstancedNode() const;
 
 private:
-	osg::ref_ptr<osg::Node>   createHardwareInstancedGeode(unsigned int start, unsigned int end) const;
-	osg::ref_ptr<osg::Node>   createTextureHardwareInstancedGeode(unsigned int start, unsigned int end) const;
-	osg::ref_ptr<osg::Node>	  createUBOHardwareInstancedGeode(unsigned int start, unsigned int end, unsigned int maxUBOMatrices) const;
-	osg::ref_ptr<osg::Shader> readShaderFile(const std::string& fileName, const std::string& preprocessorDefinitions) const;
+	enum ChunkTechnique
+	{
+		UNIFORM_CHUNKS,
+		TEXTURE_CHUNKS,
+		UBO_CHUNKS
+	};
+
+	// geode of one chunk of instances and the resources that hold its instance data
+	struct InstanceChunk
+	{
+		unsigned int									start;
+		unsigned int									end;
+		InstanceQuantization::Range						range;
+		osg::ref_ptr<osg::Geode>						geode;
+		osg::ref_ptr<osg::Geometry>						geometry;
+		osg::ref_ptr<osg::Uniform>						uniform;
+		osg::ref_ptr<osg::Image>						image;
+		osg::ref_ptr<InstanceTextureSubloadCallback>	subloadCallback;
+		osg::ref_ptr<osg::Array>						bufferArray;
+		osg::ref_ptr<ComputeTextureBoundingBoxCallback> boundingBoxCallback;
+		osg::ref_ptr<CountInstancesCullCallback>		countCallback;
+		osg::ref_ptr<InstanceCullCallback>				instanceCullCallback;
+	};
+
+	// node of a technique that splits the instances into chunks of chunkSize instances
+	struct ChunkedNode
+	{
+		ChunkTechnique				technique;
+		bool						quantized;
+		unsigned int				chunkSize;
+		unsigned int				maxInstances;
+		osg::ref_ptr<osg::Group>	group;
+		std::vector<InstanceChunk>	chunks;
+		osg::ref_ptr<ParallelChunkCullCallback> chunkCullCallback;
+	};
+
+	// node of the software technique, child i transforms instance i
+	struct SoftwareNode
+	{
+		osg::ref_ptr<osg::Group>					group;
+		osg::ref_ptr<osg::Node>						instance;
+		osg::ref_ptr<CountInstancesCullCallback>	countCallback;
+	};
+
+	// node of the vertex attribute technique, a single drawable with all instances per level of detail
+	struct AttributeNode
+	{
+		osg::ref_ptr<osg::Geode>					geode;
+		std::vector<osg::ref_ptr<InstancedDrawable> > drawables;
+		osg::ref_ptr<osg::UIntArray>				quantizedInstances;
+		InstanceQuantization::Range					range;
+		osg::ref_ptr<CountInstancesCullCallback>	countCallback;
+		osg::ref_ptr<InstanceCullCallback>			instanceCullCallback;
+		std::vector<osg::ref_ptr<osg::Array> >		compactedInstances;
+	};
+
+	// node of the batched technique, chunk i owns the draws i * levels to (i + 1) * levels
+	struct BatchedNode
+	{
+		osg::ref_ptr<osg::Geode>					geode;
+		osg::ref_ptr<BatchedInstancedDrawable>		drawable;
+		osg::ref_ptr<BatchedChunkCullCallback>		cullCallback;
+		osg::BoundingBox							localBounds;
+		unsigned int								chunkSize;
+	};
+
+	osg::ref_ptr<osg::Node>	  createChunkedNode(ChunkTechnique technique, unsigned int maxInstances, bool quantized) const;
+	void					  createChunk(ChunkedNode& node, unsigned int start, unsigned int end) const;
+	GLvoid*					  getChunkData(const ChunkedNode& node, InstanceChunk& chunk) const;
+	void					  writeChunkInstances(ChunkedNode& node, InstanceChunk& chunk, unsigned int start, unsigned int end, bool requantize) const;
+	void					  resizeChunk(InstanceChunk& chunk, unsigned int end) const;
+	void					  writeAttributeInstance(AttributeNode& node, unsigned int index) const;
+	void					  resizeAttributeInstances(AttributeNode& node) const;
+	void					  addBatchedChunk(BatchedNode& node, unsigned int start, unsigned int end) const;
+	void					  resizeBatchedChunk(BatchedNode& node, unsigned int chunk, unsigned int end) const;
+	osg::ref_ptr<InstanceCullCallback> createInstanceCullCallback(bool quantized, bool lod) const;
+	osg::ref_ptr<InstancedDrawable> createInstancedDrawable(osg::Geometry* geometry) const;
+	osg::ref_ptr<JobSystem>	  getJobSystem() const;
+	bool					  useQuantizedInstances() const;
+	void					  sortMatricesSpatially() const;
+	InstanceHandle			  addTransform(const osg::Matrixf& matrix);
+	bool					  updateTransform(InstanceHandle handle, const osg::Matrixf& matrix);
+	void					  writeNodes(unsigned int index) const;
+	void					  growNodes() const;
+	void					  shrinkNodes() const;
+	inline bool				  hasNodes() const { return !m_chunkedNodes.empty() || !m_softwareNodes.empty() || !m_attributeNodes.empty() || !m_batchedNodes.empty(); }
 
 	GLint						m_maxMatrixUniforms;
 	unsigned int				m_maxTextureResolution;
 	GLint						m_maxUniformBlockSize;
+	unsigned int				m_maxInstancesPerChunk;
+	InstanceFormat				m_instanceFormat;
+	bool						m_streamingInstances;
+	bool						m_instanceCulling;
+	unsigned int				m_numCullThreads;
+	mutable osg::ref_ptr<JobSystem> m_jobSystem;
 	osg::ref_ptr<osg::Geometry> m_geometry;
-	std::vector<osg::Matrixd>   m_matrices;
-	mutable std::vector<osg::ref_ptr<osg::FloatArray> > m_floatArrays;
+	std::vector<osg::ref_ptr<osg::Geometry> > m_lodGeometries;
+	std::vector<float>			m_lodSwitchDistances;
+	osg::ref_ptr<InstanceTransformStore> m_matrices;
+	mutable bool				m_matricesSorted;
+	osg::ref_ptr<InstanceCullStatistics> m_cullStatistics;
+	osg::ref_ptr<ShaderProgramCache> m_programCache;
+
+	// index of every handle and handle of every index, both are reordered with the matrices
+	mutable std::vector<unsigned int>	m_handleIndices;
+	mutable std::vector<InstanceHandle> m_indexHandles;
+	std::vector<InstanceHandle>			m_freeHandles;
+
+	// nodes created for the current matrices, they are updated by addMatrix, updateMatrix and removeMatrix
+	mutable std::vector<ChunkedNode>	m_chunkedNodes;
+	mutable std::vector<SoftwareNode>	m_softwareNodes;
+	mutable std::vector<AttributeNode>	m_attributeNodes;
+	mutable std::vector<BatchedNode>	m_batchedNodes;
 };
 
 }
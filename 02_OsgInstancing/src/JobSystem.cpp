@@ -0,0 +1,163 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "JobSystem.h"
+
+// std
+#include <algorithm>
+
+namespace osgExample
+{
+
+JobSystem::JobSystem(unsigned int numThreads)
+	:	m_numQueuedJobs(0u),
+		m_nextQueue(0u),
+		m_stop(false)
+{
+	if (!numThreads)
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (unsigned int i = 0; i < numThreads; ++i)
+	{
+		m_queues.push_back(std::unique_ptr<Queue>(new Queue));
+	}
+	for (unsigned int i = 0; i + 1 < numThreads; ++i)
+	{
+		m_workers.push_back(std::thread(&JobSystem::run, this, (size_t)i));
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (auto it = m_workers.begin(); it != m_workers.end(); ++it)
+	{
+		it->join();
+	}
+}
+
+void JobSystem::parallelFor(size_t count, size_t grainSize, const RangeFunction& function)
+{
+	if (!count)
+		return;
+
+	grainSize = std::max(grainSize, (size_t)1u);
+	size_t numJobs = (count + grainSize - 1) / grainSize;
+	if (numJobs == 1 || m_workers.empty())
+	{
+		function(0, count);
+		return;
+	}
+
+	// count the jobs before queueing them, so the counter never drops below zero
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_numQueuedJobs += numJobs;
+	}
+
+	// spread the jobs round robin, so every worker finds work in its own queue first
+	std::atomic<size_t> pendingJobs(numJobs);
+	size_t firstQueue = m_nextQueue++;
+	for (size_t i = 0; i < numJobs; ++i)
+	{
+		Job job = { &function, i * grainSize, std::min((i + 1) * grainSize, count), &pendingJobs };
+		Queue& queue = *m_queues[(firstQueue + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back(job);
+	}
+	m_wakeUp.notify_all();
+
+	// help until our jobs are done, the jobs executed here may belong to other callers as well
+	size_t ownQueue = m_queues.size() - 1;
+	Job job;
+	while (pendingJobs.load() > 0)
+	{
+		if (popJob(ownQueue, job) || stealJob(ownQueue, job))
+			execute(job);
+		else
+			std::this_thread::yield();
+	}
+}
+
+bool JobSystem::popJob(size_t queue, Job& job)
+{
+	Queue& ownQueue = *m_queues[queue];
+	std::lock_guard<std::mutex> lock(ownQueue.mutex);
+	if (ownQueue.jobs.empty())
+		return false;
+
+	// the newest job is the most likely one to still be in the cache
+	job = ownQueue.jobs.back();
+	ownQueue.jobs.pop_back();
+	--m_numQueuedJobs;
+	return true;
+}
+
+bool JobSystem::stealJob(size_t queue, Job& job)
+{
+	for (size_t i = 1; i < m_queues.size(); ++i)
+	{
+		Queue& otherQueue = *m_queues[(queue + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(otherQueue.mutex);
+		if (otherQueue.jobs.empty())
+			continue;
+
+		// steal the oldest job, the owner works on the other end of the queue
+		job = otherQueue.jobs.front();
+		otherQueue.jobs.pop_front();
+		--m_numQueuedJobs;
+		return true;
+	}
+	return false;
+}
+
+void JobSystem::execute(const Job& job)
+{
+	(*job.function)(job.begin, job.end);
+	--(*job.pendingJobs);
+}
+
+void JobSystem::run(size_t queue)
+{
+	Job job;
+	for (;;)
+	{
+		if (popJob(queue, job) || stealJob(queue, job))
+		{
+			execute(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_wakeUp.wait(lock, [this] { return m_stop || m_numQueuedJobs.load() > 0; });
+		if (m_stop)
+			return;
+	}
+}
+
+}
\ No newline at end of file
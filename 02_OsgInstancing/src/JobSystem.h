@@ -0,0 +1,97 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _JOB_SYSTEM_H
+#define _JOB_SYSTEM_H
+
+// std
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// osg
+#include <osg/Referenced>
+
+namespace osgExample
+{
+
+/**
+ Small work stealing job system. Every worker thread owns a queue, takes its own jobs from the back and steals from
+ the front of the other queues once it runs dry. parallelFor splits a range into jobs, spreads them over the queues
+ and lets the calling thread work on them until all are done, so it can be called from inside a job as well.
+*/
+class JobSystem : public osg::Referenced
+{
+public:
+	typedef std::function<void(size_t begin, size_t end)> RangeFunction;
+
+	// numThreads includes the calling thread, 0 uses one thread per core
+	explicit JobSystem(unsigned int numThreads = 0);
+
+	inline unsigned int getNumThreads() const { return m_workers.size() + 1; }
+
+	// calls function for consecutive ranges of at most grainSize elements of [0-count) and returns when all are done
+	void parallelFor(size_t count, size_t grainSize, const RangeFunction& function);
+
+protected:
+	virtual ~JobSystem();
+
+private:
+	struct Job
+	{
+		const RangeFunction*	function;
+		size_t					begin;
+		size_t					end;
+		std::atomic<size_t>*	pendingJobs;
+	};
+
+	struct Queue
+	{
+		std::mutex			mutex;
+		std::deque<Job>		jobs;
+	};
+
+	bool popJob(size_t queue, Job& job);
+	bool stealJob(size_t queue, Job& job);
+	void execute(const Job& job);
+	void run(size_t queue);
+
+	// the last queue is shared by all threads that call parallelFor from outside
+	std::vector<std::unique_ptr<Queue> >	m_queues;
+	std::vector<std::thread>				m_workers;
+	std::mutex								m_sleepMutex;
+	std::condition_variable					m_wakeUp;
+	std::atomic<size_t>						m_numQueuedJobs;
+	std::atomic<size_t>						m_nextQueue;
+	bool									m_stop;
+};
+
+}
+
+#endif
\ No newline at end of file
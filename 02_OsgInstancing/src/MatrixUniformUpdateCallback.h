@@ -36,6 +36,9 @@ public:
 			m_modelViewProjectMatrix->set(modelViewProjectionMatrix);
 			m_normalMatrix->set(normalMatrix);
 		}
+
+		// run nested callbacks like the instance counting
+		traverse(node, nv);
     }
 
 	inline osg::ref_ptr<osg::Uniform> getModelViewProjectionMatrixUniform() const { return m_modelViewProjectMatrix; }
@@ -0,0 +1,96 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ShaderProgramCache.h"
+
+// std
+#include <iostream>
+#include <sstream>
+
+// osgExample
+#include "EmbeddedShaders.h"
+
+namespace osgExample
+{
+
+osg::ref_ptr<osg::Program> ShaderProgramCache::getProgram(const std::string& name, const std::string& preprocessorDefinitions, const ProgramSetup& setup)
+{
+	// the techniques build their nodes in the background, so the cache is shared between threads
+	std::lock_guard<std::mutex> lock(m_mutex);
+	ProgramKey key(name, preprocessorDefinitions);
+	auto it = m_programs.find(key);
+	if (it != m_programs.end())
+	{
+		++m_numHits;
+		return it->second;
+	}
+
+	++m_numMisses;
+	osg::ref_ptr<osg::Program> program = new osg::Program;
+	program->setName(name);
+	osg::ref_ptr<osg::Shader> vsShader = createShader(name + ".vert", osg::Shader::VERTEX, preprocessorDefinitions);
+	osg::ref_ptr<osg::Shader> fsShader = createShader(name + ".frag", osg::Shader::FRAGMENT, "");
+	if (vsShader.valid())
+		program->addShader(vsShader);
+	if (fsShader.valid())
+		program->addShader(fsShader);
+
+	// bindings are part of the program, so they are added before anyone else can use it
+	if (setup)
+		setup(program);
+
+	m_programs[key] = program;
+	return program;
+}
+
+osg::ref_ptr<osg::Shader> ShaderProgramCache::createShader(const std::string& fileName, osg::Shader::Type type, const std::string& preprocessorDefinitions)
+{
+	const char* source = getEmbeddedShaderSource(fileName.c_str());
+	if (source == NULL)
+	{
+		std::cout << "Error: Shader " << fileName << " is not embedded" << std::endl;
+		return NULL;
+	}
+
+	if (preprocessorDefinitions.empty())
+		return new osg::Shader(type, source);
+
+	// the definitions have to follow the #version and #extension directives
+	std::istringstream shaderFile(source);
+	std::stringstream shaderStr;
+	std::string line;
+	bool definitionsInserted = false;
+	while (std::getline(shaderFile, line)) {
+		if (!definitionsInserted && line.compare(0, 8, "#version") != 0 && line.compare(0, 10, "#extension") != 0) {
+			shaderStr << preprocessorDefinitions << std::endl;
+			definitionsInserted = true;
+		}
+		shaderStr << line << std::endl;
+	}
+	if (!definitionsInserted)
+		shaderStr << preprocessorDefinitions << std::endl;
+
+	return new osg::Shader(type, shaderStr.str());
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,80 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _SHADER_PROGRAM_CACHE_H
+#define _SHADER_PROGRAM_CACHE_H
+
+// std
+#include <string>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <functional>
+
+// osg
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+#include <osg/Program>
+#include <osg/Shader>
+
+namespace osgExample
+{
+
+/**
+ Shares the programs of the instancing techniques between chunks, nodes and scene rebuilds, so a program is only compiled
+ and linked once per technique and set of preprocessor definitions. A program keeps its compiled per context state as long
+ as it is alive, so rebuilding the scene with the same MAX_INSTANCES does not recompile any GLSL.
+*/
+class ShaderProgramCache : public osg::Referenced
+{
+public:
+	// adds the attribute and uniform block bindings to a new program
+	typedef std::function<void(osg::Program*)> ProgramSetup;
+
+	ShaderProgramCache() : m_numHits(0), m_numMisses(0) {}
+
+	// returns the program of the embedded shaders name.vert and name.frag, the definitions are inserted into the vertex shader
+	osg::ref_ptr<osg::Program> getProgram(const std::string& name, const std::string& preprocessorDefinitions, const ProgramSetup& setup = ProgramSetup());
+
+	inline size_t getNumPrograms() const { std::lock_guard<std::mutex> lock(m_mutex); return m_programs.size(); }
+	inline unsigned int getNumHits() const { std::lock_guard<std::mutex> lock(m_mutex); return m_numHits; }
+	inline unsigned int getNumMisses() const { std::lock_guard<std::mutex> lock(m_mutex); return m_numMisses; }
+
+	// drops all programs, they are compiled again the next time they are used
+	inline void clear() { std::lock_guard<std::mutex> lock(m_mutex); m_programs.clear(); }
+
+	// creates a shader from an embedded source and inserts the definitions after the #version and #extension directives
+	static osg::ref_ptr<osg::Shader> createShader(const std::string& fileName, osg::Shader::Type type, const std::string& preprocessorDefinitions);
+
+protected:
+	typedef std::pair<std::string, std::string> ProgramKey;
+
+	mutable std::mutex	m_mutex;
+	std::map<ProgramKey, osg::ref_ptr<osg::Program> > m_programs;
+	unsigned int		m_numHits;
+	unsigned int		m_numMisses;
+};
+
+}
+
+#endif
\ No newline at end of file
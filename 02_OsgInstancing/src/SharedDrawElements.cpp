@@ -0,0 +1,119 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "SharedDrawElements.h"
+
+// std
+#include <iostream>
+
+// osg
+#include <osg/State>
+#include <osg/BufferObject>
+
+namespace osgExample
+{
+
+SharedDrawElements::SharedDrawElements()
+	:	osg::PrimitiveSet(PrimitiveType)
+{
+}
+
+SharedDrawElements::SharedDrawElements(osg::ref_ptr<osg::DrawElements> drawElements, int numInstances)
+	:	osg::PrimitiveSet(PrimitiveType, drawElements->getMode(), numInstances),
+		m_drawElements(drawElements)
+{
+	// the shared indices need their own buffer object, the geometries of the chunks never see them
+	if (!m_drawElements->getElementBufferObject())
+		m_drawElements->setElementBufferObject(new osg::ElementBufferObject);
+}
+
+SharedDrawElements::SharedDrawElements(const SharedDrawElements& other, const osg::CopyOp& copyOp)
+	:	osg::PrimitiveSet(other, copyOp),
+		m_drawElements(other.m_drawElements)
+{
+}
+
+void SharedDrawElements::draw(osg::State& state, bool useVertexBufferObjects) const
+{
+	if (!m_drawElements)
+		return;
+
+	GLenum dataType;
+	switch(m_drawElements->getType())
+	{
+	case osg::PrimitiveSet::DrawElementsUBytePrimitiveType:
+		dataType = GL_UNSIGNED_BYTE;
+		break;
+	case osg::PrimitiveSet::DrawElementsUShortPrimitiveType:
+		dataType = GL_UNSIGNED_SHORT;
+		break;
+	case osg::PrimitiveSet::DrawElementsUIntPrimitiveType:
+	default:
+		dataType = GL_UNSIGNED_INT;
+		break;
+	}
+
+	// same as osg::DrawElements::draw, but with the instance count of this chunk
+	const GLvoid* indices = m_drawElements->getDataPointer();
+	if (useVertexBufferObjects)
+	{
+		osg::GLBufferObject* ebo = m_drawElements->getOrCreateGLBufferObject(state.getContextID());
+		state.bindElementBufferObject(ebo);
+		if (ebo)
+			indices = (const GLvoid*)(ebo->getOffset(m_drawElements->getBufferIndex()));
+	}
+
+	if (_numInstances >= 1)
+		state.glDrawElementsInstanced(_mode, m_drawElements->getNumIndices(), dataType, indices, _numInstances);
+	else
+		glDrawElements(_mode, m_drawElements->getNumIndices(), dataType, indices);
+}
+
+void SharedDrawElements::accept(osg::PrimitiveFunctor& functor) const
+{
+	if (m_drawElements.valid())
+		m_drawElements->accept(functor);
+}
+
+void SharedDrawElements::accept(osg::PrimitiveIndexFunctor& functor) const
+{
+	if (m_drawElements.valid())
+		m_drawElements->accept(functor);
+}
+
+unsigned int SharedDrawElements::index(unsigned int pos) const
+{
+	return m_drawElements->index(pos);
+}
+
+unsigned int SharedDrawElements::getNumIndices() const
+{
+	return m_drawElements.valid() ? m_drawElements->getNumIndices() : 0u;
+}
+
+void SharedDrawElements::offsetIndices(int offset)
+{
+	std::cout << "Warning: Indices shared between chunks can not be offset" << std::endl;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _SHARED_DRAW_ELEMENTS_H
+#define _SHARED_DRAW_ELEMENTS_H
+
+// osg
+#include <osg/ref_ptr>
+#include <osg/PrimitiveSet>
+
+namespace osgExample
+{
+
+/**
+ Draws the indices of another DrawElements with its own instance count. All chunks of a technique reference the
+ same DrawElements, so its indices exist once in memory and once as element buffer object, while every chunk
+ draws only the number of instances it holds.
+*/
+class SharedDrawElements : public osg::PrimitiveSet
+{
+public:
+	SharedDrawElements();
+	SharedDrawElements(osg::ref_ptr<osg::DrawElements> drawElements, int numInstances);
+	SharedDrawElements(const SharedDrawElements& other, const osg::CopyOp& copyOp = osg::CopyOp::SHALLOW_COPY);
+
+	META_Object(osgExample, SharedDrawElements)
+
+	inline osg::ref_ptr<osg::DrawElements> getSharedDrawElements() const { return m_drawElements; }
+
+	virtual void draw(osg::State& state, bool useVertexBufferObjects) const;
+	virtual void accept(osg::PrimitiveFunctor& functor) const;
+	virtual void accept(osg::PrimitiveIndexFunctor& functor) const;
+	virtual unsigned int index(unsigned int pos) const;
+	virtual unsigned int getNumIndices() const;
+	// the indices belong to all chunks, so they can not be offset for one of them
+	virtual void offsetIndices(int offset);
+
+protected:
+	virtual ~SharedDrawElements() {}
+
+private:
+	osg::ref_ptr<osg::DrawElements>	m_drawElements;
+};
+
+}
+
+#endif
\ No newline at end of file
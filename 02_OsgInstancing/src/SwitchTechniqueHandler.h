@@ -24,80 +24,128 @@
 #ifndef _SWITCH_TECHNIQUE_HANDLER_H
 #define _SWITCH_TECHNIQUE_HANDLER_H
 
-namespace osgExample {
-
 // std
 #include <iostream>
+#include <future>
+#include <chrono>
+#include <vector>
 
 // osg
 #include <osg/ref_ptr>
 #include <osg/Switch>
+#include <osg/Stats>
+#include <osg/Timer>
 #include <osgViewer/Viewer>
 #include <osgViewer/ViewerEventHandlers>
 
+// osgExample
+#include "InstanceCullStatistics.h"
+
+namespace osgExample {
+
+/**
+ Switches between the instancing techniques and rebuilds the scene in a different size. A rebuild runs on a
+ worker thread while the old scene keeps rendering, the new scene is swapped in at the start of the first frame
+ after it is ready. Only the visible technique is built with the scene, the others are built in the background
+ the first time they are selected, the previously visible technique is shown until they are ready. One build runs at a time.
+*/
 class SwitchInstancingHandler : public osgGA::GUIEventHandler
 {
 public:
-	typedef osg::ref_ptr<osg::Switch> (*SetupSceneFuncPtr)(unsigned int, unsigned int);
+	// builds the instances and the given technique, the other techniques are placeholders
+	typedef osg::ref_ptr<osg::Switch> (*SetupSceneFuncPtr)(unsigned int, unsigned int, unsigned int);
+	// builds a technique for the instances of the last setup scene
+	typedef osg::ref_ptr<osg::Node> (*BuildTechniqueFuncPtr)(unsigned int);
 
-	SwitchInstancingHandler(osg::ref_ptr<osgViewer::Viewer> viewer, osg::ref_ptr<osg::Switch> switchNode, SetupSceneFuncPtr setupScene)
-		:	m_viewer(viewer),
-			m_switch(switchNode),
+	// the techniques are the first children of the switch, the light source follows them
+	static const unsigned int NUM_TECHNIQUES = 6;
+	static const unsigned int LIGHT_SOURCE_CHILD = 6;
+
+	SwitchInstancingHandler(osg::ref_ptr<osgViewer::Viewer> viewer, osg::ref_ptr<osg::Switch> switchNode, unsigned int technique, SetupSceneFuncPtr setupScene, BuildTechniqueFuncPtr buildTechnique, osg::ref_ptr<InstanceCullStatistics> cullStatistics)
+		:	m_switch(switchNode),
+			m_viewer(viewer),
 			m_size(64.0f),
-			m_setupScene(setupScene)
+			m_technique(technique),
+			m_builtTechniques(NUM_TECHNIQUES, false),
+			m_buildingTechnique(NUM_TECHNIQUES),
+			m_buildStart(0),
+			m_lastProgressReport(0),
+			m_setupScene(setupScene),
+			m_buildTechnique(buildTechnique),
+			m_cullStatistics(cullStatistics)
 	{
+		m_builtTechniques[technique] = true;
 	}
 
 	virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa)
 	{
+		if (ea.getEventType() == osgGA::GUIEventAdapter::FRAME)
+		{
+			// the cull traversal of the last frame is finished, so hand its instance counts to the stats handler
+			m_cullStatistics->nextFrame();
+			unsigned int frameNumber = m_viewer->getFrameStamp()->getFrameNumber();
+			osg::Stats* stats = m_viewer->getViewerStats();
+			if (stats && frameNumber > 0)
+			{
+				stats->setAttribute(frameNumber - 1, "Instances drawn", (double)m_cullStatistics->getLastFrameDrawnInstances());
+				stats->setAttribute(frameNumber - 1, "Instances culled", (double)m_cullStatistics->getLastFrameCulledInstances());
+				stats->setAttribute(frameNumber - 1, "Draw calls", (double)m_cullStatistics->getLastFrameDrawCalls());
+				stats->setAttribute(frameNumber - 1, "State changes", (double)m_cullStatistics->getLastFrameStateChanges());
+			}
+
+			// nothing is traversed yet, so the finished build can be swapped in without a lock
+			finishBuild();
+			return false;
+		}
+
 		if (ea.getEventType() == osgGA::GUIEventAdapter::KEYUP)
 		{
 			switch(ea.getKey())
 			{
 			case osgGA::GUIEventAdapter::KEY_1:
-				m_switch->setSingleChildOn(0);
-				m_switch->setValue(5, true);
+				selectTechnique(0);
 				std::cout << "Switched to software instancing" << std::endl;
 				return true;
 				break;
 			case osgGA::GUIEventAdapter::KEY_2:
-				m_switch->setSingleChildOn(1);
-				m_switch->setValue(5, true);
+				selectTechnique(1);
 				std::cout << "Switched to hardware instancing with uniforms" << std::endl;
 				return true;
 				break;
 			case osgGA::GUIEventAdapter::KEY_3:
-				m_switch->setSingleChildOn(2);
-				m_switch->setValue(5, true);
+				selectTechnique(2);
 				std::cout << "Switched to hardware instancing with textures" << std::endl;
 				return true;
 				break;
 			case osgGA::GUIEventAdapter::KEY_4:
-				m_switch->setSingleChildOn(3);
-				m_switch->setValue(5, true);
+				selectTechnique(3);
 				std::cout << "Switched to hardware instancing with uniform buffer objects" << std::endl;
 				return true;
 				break;
 			case osgGA::GUIEventAdapter::KEY_5:
-				m_switch->setSingleChildOn(4);
-				m_switch->setValue(5, true);
+				selectTechnique(4);
 				std::cout << "Switched to hardware instancing with vertex attribute divisor" << std::endl;
 				return true;
 				break;
+			case osgGA::GUIEventAdapter::KEY_6:
+				selectTechnique(5);
+				std::cout << "Switched to batched hardware instancing with multi draw indirect" << std::endl;
+				return true;
+				break;
+			case osgGA::GUIEventAdapter::KEY_C:
+				std::cout << "Instances drawn: " << m_cullStatistics->getLastFrameDrawnInstances()
+						  << ", culled: " << m_cullStatistics->getLastFrameCulledInstances()
+						  << " of " << m_cullStatistics->getNumInstances()
+						  << ", draw calls: " << m_cullStatistics->getLastFrameDrawCalls()
+						  << ", state changes: " << m_cullStatistics->getLastFrameStateChanges() << std::endl;
+				return true;
+				break;
 			case osgGA::GUIEventAdapter::KEY_Plus:
-				m_size *= 2.0f;
-				m_size = std::min(std::max(m_size, 8.0f), 1024.0f);
-				m_switch = m_setupScene((unsigned int)m_size, (unsigned int)m_size);
-				m_viewer->setSceneData(m_switch);
-				std::cout << "Increased scene size to " << m_size << "x" << m_size << std::endl;
+				rebuildScene(std::min(std::max(m_size * 2.0f, 8.0f), 1024.0f));
 				return true;
 				break;
 			case osgGA::GUIEventAdapter::KEY_Minus:
-				m_size *= 0.5f;
-				m_size = std::min(std::max(m_size, 8.0f), 1024.0f);
-				m_switch = m_setupScene((unsigned int)m_size, (unsigned int)m_size);
-				m_viewer->setSceneData(m_switch);
-				std::cout << "Decreased scene size to " << m_size << "x" << m_size << std::endl;
+				rebuildScene(std::min(std::max(m_size * 0.5f, 8.0f), 1024.0f));
 				return true;
 				break;
 			default:
@@ -109,11 +157,92 @@ public:
 		return false;
 	}
 private:
+	inline bool isBuilding() const { return m_sceneBuild.valid() || m_techniqueBuild.valid(); }
+
+	void showTechnique(unsigned int technique)
+	{
+		m_switch->setSingleChildOn(technique);
+		m_switch->setValue(LIGHT_SOURCE_CHILD, true);
+	}
+
+	void selectTechnique(unsigned int technique)
+	{
+		m_technique = technique;
+
+		// an unbuilt technique is only a placeholder, so the visible one keeps rendering until the build is swapped in
+		if (m_builtTechniques[technique])
+		{
+			showTechnique(technique);
+			return;
+		}
+
+		// a scene that is being rebuilt gets the selected technique when it is swapped in
+		if (!isBuilding())
+		{
+			m_buildingTechnique = technique;
+			m_buildStart = m_lastProgressReport = osg::Timer::instance()->tick();
+			m_techniqueBuild = std::async(std::launch::async, m_buildTechnique, technique);
+			std::cout << "Building the technique in the background" << std::endl;
+		}
+	}
+
+	void rebuildScene(float size)
+	{
+		if (isBuilding())
+		{
+			std::cout << "Still building, try again when it is done" << std::endl;
+			return;
+		}
+
+		m_size = size;
+		m_buildingTechnique = m_technique;
+		m_buildStart = m_lastProgressReport = osg::Timer::instance()->tick();
+		m_sceneBuild = std::async(std::launch::async, m_setupScene, (unsigned int)m_size, (unsigned int)m_size, m_technique);
+		std::cout << "Rebuilding the scene with " << m_size << "x" << m_size << " instances in the background" << std::endl;
+	}
+
+	void finishBuild()
+	{
+		if (!isBuilding())
+			return;
+
+		osg::Timer_t now = osg::Timer::instance()->tick();
+		if (m_sceneBuild.valid() && m_sceneBuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		{
+			m_switch = m_sceneBuild.get();
+			m_viewer->setSceneData(m_switch);
+			std::fill(m_builtTechniques.begin(), m_builtTechniques.end(), false);
+			m_builtTechniques[m_buildingTechnique] = true;
+			showTechnique(m_buildingTechnique);
+			std::cout << "Rebuilt the scene with " << m_size << "x" << m_size << " instances in " << osg::Timer::instance()->delta_s(m_buildStart, now) << " s" << std::endl;
+			selectTechnique(m_technique);
+		} else if (m_techniqueBuild.valid() && m_techniqueBuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+			m_switch->setChild(m_buildingTechnique, m_techniqueBuild.get());
+			m_builtTechniques[m_buildingTechnique] = true;
+			std::cout << "Built the technique in " << osg::Timer::instance()->delta_s(m_buildStart, now) << " s" << std::endl;
+			selectTechnique(m_technique);
+		} else if (osg::Timer::instance()->delta_s(m_lastProgressReport, now) >= 1.0) {
+			m_lastProgressReport = now;
+			std::cout << "Still building(" << osg::Timer::instance()->delta_s(m_buildStart, now) << " s)" << std::endl;
+		}
+	}
+
 	osg::ref_ptr<osg::Switch>		m_switch;
 	osg::ref_ptr<osgViewer::Viewer> m_viewer;
 	float							m_size;
+	unsigned int					m_technique;
+	std::vector<bool>				m_builtTechniques;
+
+	// at most one of the builds is running
+	std::future<osg::ref_ptr<osg::Switch> >	m_sceneBuild;
+	std::future<osg::ref_ptr<osg::Node> >	m_techniqueBuild;
+	unsigned int					m_buildingTechnique;
+	osg::Timer_t					m_buildStart;
+	osg::Timer_t					m_lastProgressReport;
 
 	SetupSceneFuncPtr				m_setupScene;
+	BuildTechniqueFuncPtr			m_buildTechnique;
+	osg::ref_ptr<InstanceCullStatistics> m_cullStatistics;
 };
 
 }
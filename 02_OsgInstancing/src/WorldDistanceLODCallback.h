@@ -0,0 +1,69 @@
+/*
+	The MIT License (MIT)
+
+	Copyright (c) 2013 Marcel Pursche
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+	the Software, and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+	CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _WORLD_DISTANCE_LOD_CALLBACK_H
+#define _WORLD_DISTANCE_LOD_CALLBACK_H
+
+// std
+#include <algorithm>
+
+// osg
+#include <osg/Node>
+#include <osg/LOD>
+#include <osgUtil/CullVisitor>
+
+namespace osgExample
+{
+
+/**
+ Cull callback for an osg::LOD that is shared by transforms with different scales. osg measures the distance to the
+ eye in the coordinate system of the LOD, so a scaled instance would switch at scaled distances. This callback
+ selects the child by the distance of the center in world space instead, like the instanced techniques.
+*/
+class WorldDistanceLODCallback : public osg::NodeCallback
+{
+public:
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+	{
+		osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+		osg::LOD* lod = dynamic_cast<osg::LOD*>(node);
+		if (!cv || !lod || lod->getRangeMode() != osg::LOD::DISTANCE_FROM_EYE_POINT)
+		{
+			traverse(node, nv);
+			return;
+		}
+
+		// the view matrix is rigid, so the length of the center in eye space is its distance in world space
+		float distance = (lod->getCenter() * (*cv->getModelViewMatrix())).length();
+		unsigned int numChildren = std::min(lod->getNumChildren(), lod->getNumRanges());
+		for (unsigned int i = 0; i < numChildren; ++i)
+		{
+			if (lod->getMinRange(i) <= distance && distance < lod->getMaxRange(i))
+				lod->getChild(i)->accept(*nv);
+		}
+	}
+};
+
+}
+
+#endif
@@ -27,6 +27,9 @@
 #define _USE_MATH_DEFINES 1 // fix for visual studio
 #include <cmath>
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
 
 // glew
 #include <GL/glew.h>
@@ -44,15 +47,24 @@
 #include <osgDB/ReadFile>
 #include <osg/Light>
 #include <osg/LightSource>
+#include <osg/ArgumentParser>
+#include <osg/Timer>
+#include <osg/Polytope>
 
 // osgExample
 #include "InstancedGeometryBuilder.h"
 #include "SwitchTechniqueHandler.h"
 #include "ASCFileLoader.h"
+#include "HeightMapSampler.h"
 #include "LightUniformUpdateCallback.h"
+#include "InstanceCullCallback.h"
+#include "InstanceBounds.h"
+#include "CounterRandom.h"
 
 osgExample::ASCFileLoader g_fileLoader;
 osg::ref_ptr<osgExample::InstancedGeometryBuilder> g_builder;
+bool g_memoryReport = false;
+unsigned int g_seed = 0u;
 
 void initOpenGL(osg::GraphicsContext* context, GLint& maxNumUniforms, GLint& maxUniformBlockSize)
 {
@@ -128,47 +140,311 @@ osg::ref_ptr<osg::Geometry> createQuads()
 	return geometry;
 }
 
-osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y)
+osg::ref_ptr<osg::Geometry> createLodQuad()
+{
+	// the coarser level only keeps the first of the two quads
+	osg::ref_ptr<osg::Geometry> geometry = createQuads();
+	static_cast<osg::DrawElementsUByte*>(geometry->getPrimitiveSet(0))->resize(6);
+	return geometry;
+}
+
+int benchmarkLoader(const std::string& fileName, unsigned int iterations)
+{
+	osgExample::ASCFileLoader streamLoader;
+	osgExample::ASCFileLoader parallelLoader;
+	streamLoader.setUseCache(false);
+	parallelLoader.setUseCache(false);
+	
+	// determine file size to compute the throughput
+	std::ifstream fileStream(fileName.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+	double fileSizeMB = (double)fileStream.tellg() / (1024.0 * 1024.0);
+	fileStream.close();
+
+	if (fileSizeMB <= 0.0)
+	{
+		std::cout << "Error could not load file: " << fileName << std::endl;
+		return 1;
+	}
+
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	for (unsigned int i = 0; i < iterations; ++i)
+	{
+		streamLoader.loadFromFile(fileName, osgExample::ASCFileLoader::STREAM_LOAD);
+	}
+	double streamTime = osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick()) / iterations;
+
+	start = osg::Timer::instance()->tick();
+	for (unsigned int i = 0; i < iterations; ++i)
+	{
+		parallelLoader.loadFromFile(fileName, osgExample::ASCFileLoader::PARALLEL_LOAD);
+	}
+	double parallelTime = osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick()) / iterations;
+
+	// both loaders have to produce exactly the same height map
+	size_t numSamples = (size_t)streamLoader.getWidth() * (size_t)streamLoader.getHeight();
+	bool identical = streamLoader.getWidth() == parallelLoader.getWidth() && streamLoader.getHeight() == parallelLoader.getHeight() &&
+					 (!numSamples || memcmp(streamLoader.getHeightMap(), parallelLoader.getHeightMap(), numSamples * sizeof(float)) == 0);
+
+	std::cout << "ASC loader benchmark: " << fileName << " (" << fileSizeMB << " MB, " << streamLoader.getWidth() << "x" << streamLoader.getHeight() << ")" << std::endl;
+	std::cout << "stream:   " << streamTime * 1000.0 << " ms, " << fileSizeMB / streamTime << " MB/s" << std::endl;
+	std::cout << "parallel: " << parallelTime * 1000.0 << " ms, " << fileSizeMB / parallelTime << " MB/s" << std::endl;
+	std::cout << "speedup:  " << streamTime / parallelTime << "x, height maps " << (identical ? "identical" : "DIFFER") << std::endl;
+
+	return identical ? 0 : 1;
+}
+
+int benchmarkSampling(const std::string& fileName, unsigned int numSamples)
+{
+	osgExample::ASCFileLoader loader;
+	loader.loadFromFile(fileName);
+	if (!loader.getWidth() || !loader.getHeight())
+	{
+		std::cout << "Error could not load file: " << fileName << std::endl;
+		return 1;
+	}
+
+	// random sample positions, including some outside of the height map to exercise clamping
+	std::vector<float> positionsX(numSamples), positionsY(numSamples), heights(numSamples), batchHeights(numSamples);
+	srand(42);
+	for (unsigned int i = 0; i < numSamples; ++i)
+	{
+		positionsX[i] = ((float)rand() / (float)RAND_MAX) * (loader.getWidth() + 20.0f) - 10.0f;
+		positionsY[i] = ((float)rand() / (float)RAND_MAX) * (loader.getHeight() + 20.0f) - 10.0f;
+	}
+
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	for (unsigned int i = 0; i < numSamples; ++i)
+	{
+		heights[i] = loader.getNearestHeight(positionsX[i], positionsY[i]);
+	}
+	double perCallTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+
+	start = osg::Timer::instance()->tick();
+	loader.getNearestHeights(&positionsX[0], &positionsY[0], &batchHeights[0], numSamples);
+	double batchTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+	bool identical = memcmp(&heights[0], &batchHeights[0], numSamples * sizeof(float)) == 0;
+
+	start = osg::Timer::instance()->tick();
+	for (unsigned int i = 0; i < numSamples; ++i)
+	{
+		heights[i] = loader.getBilinearHeight(positionsX[i], positionsY[i]);
+	}
+	double bilinearPerCallTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+
+	start = osg::Timer::instance()->tick();
+	loader.getBilinearHeights(&positionsX[0], &positionsY[0], &batchHeights[0], numSamples);
+	double bilinearBatchTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+
+	std::cout << "Height sampling benchmark: " << numSamples << " samples, " << osgExample::getHeightMapSamplerInstructionSet() << " kernels" << std::endl;
+	std::cout << "nearest per call:  " << perCallTime << " ms" << std::endl;
+	std::cout << "nearest batched:   " << batchTime << " ms (" << perCallTime / batchTime << "x), results " << (identical ? "identical" : "DIFFER") << std::endl;
+	std::cout << "bilinear per call: " << bilinearPerCallTime << " ms" << std::endl;
+	std::cout << "bilinear batched:  " << bilinearBatchTime << " ms (" << bilinearPerCallTime / bilinearBatchTime << "x)" << std::endl;
+
+	return identical ? 0 : 1;
+}
+
+int benchmarkCulling(unsigned int numInstances, unsigned int iterations)
+{
+	// random instances on a 4096x4096 terrain, seen from above one corner like in the example
+	osg::ref_ptr<osgExample::InstanceTransformStore> transforms = new osgExample::InstanceTransformStore;
+	transforms->reserve(numInstances);
+	srand(42);
+	for (unsigned int i = 0; i < numInstances; ++i)
+	{
+		osg::Vec3 position(((float)rand() / (float)RAND_MAX) * 4096.0f, ((float)rand() / (float)RAND_MAX) * 4096.0f, 0.0f);
+		transforms->addTransform(osg::Matrixf::rotate((float)rand(), osg::Vec3(0.0f, 0.0f, 1.0f)) * osg::Matrixf::translate(position));
+	}
+
+	osg::Matrixd viewMatrix = osg::Matrixd::lookAt(osg::Vec3d(0.0, 0.0, 200.0), osg::Vec3d(2048.0, 2048.0, 0.0), osg::Vec3d(0.0, 0.0, 1.0));
+	osg::Matrixd projectionMatrix = osg::Matrixd::perspective(45.0, 4.0 / 3.0, 1.0, 4000.0);
+	osg::Polytope frustum;
+	frustum.setToUnitFrustum();
+	frustum.transformProvidingInverse(viewMatrix * projectionMatrix);
+
+	osg::ref_ptr<osg::Geometry> geometry = createQuads();
+	osg::BoundingBox localBounds = osgExample::computeVertexBounds(dynamic_cast<osg::Vec3Array*>(geometry->getVertexArray()));
+
+	std::cout << "Instance culling benchmark: " << numInstances << " instances, " << iterations << " iterations" << std::endl;
+	std::vector<float> compactedInstances(numInstances * 16);
+	double singleThreadTime = 0.0;
+	for (unsigned int numThreads = 1; numThreads <= 32; numThreads *= 2)
+	{
+		osg::ref_ptr<osgExample::InstanceCullCallback> cullCallback = new osgExample::InstanceCullCallback(transforms, localBounds, 16 * sizeof(float));
+		cullCallback->setRange(0, numInstances);
+		memcpy(cullCallback->getSourceData(0), transforms->getData(), transforms->getDataSize(0, numInstances));
+		cullCallback->dirtyBounds(0, numInstances);
+		cullCallback->setTarget(&compactedInstances[0], osgExample::InstanceCullCallback::CompactCallback());
+		cullCallback->setJobSystem(new osgExample::JobSystem(numThreads));
+
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		for (unsigned int i = 0; i < iterations; ++i)
+		{
+			cullCallback->cullInstances(frustum, osg::Vec3());
+		}
+		double time = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) / iterations;
+		if (numThreads == 1)
+			singleThreadTime = time;
+
+		std::cout << numThreads << " threads: " << time << " ms (" << singleThreadTime / time << "x), "
+				  << cullCallback->getNumVisibleInstances() << " visible" << std::endl;
+	}
+
+	return 0;
+}
+
+int benchmarkStreaming(osg::ref_ptr<osgViewer::Viewer> viewer, unsigned int numFrames)
+{
+	// every frame rewrites all transforms like a simulation would, rendered with the vertex attribute technique
+	const unsigned int instanceCounts[] = { 100000u, 1000000u };
+	const unsigned int warmUpFrames = 10u;
+	viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+
+	std::cout << "Streaming benchmark: " << numFrames << " frames, persistent mapping " << (GLEW_ARB_buffer_storage ? "available" : "not available, orphaning") << std::endl;
+	for (unsigned int c = 0; c < sizeof(instanceCounts) / sizeof(instanceCounts[0]); ++c)
+	{
+		unsigned int numInstances = instanceCounts[c];
+		unsigned int side = (unsigned int)ceil(sqrt((double)numInstances));
+
+		for (unsigned int streaming = 0; streaming < 2; ++streaming)
+		{
+			osg::ref_ptr<osgExample::InstancedGeometryBuilder> builder = new osgExample::InstancedGeometryBuilder;
+			builder->setGeometry(createQuads());
+			builder->setStreamingInstances(streaming != 0);
+
+			std::vector<osgExample::InstancedGeometryBuilder::InstanceHandle> handles(numInstances);
+			std::vector<osg::Vec3> positions(numInstances);
+			builder->reserveMatrices(numInstances);
+			for (unsigned int i = 0; i < numInstances; ++i)
+			{
+				positions[i] = osg::Vec3((i % side) * 4.0f, (i / side) * 4.0f, 0.0f);
+				handles[i] = builder->addMatrix(osg::Matrixf::translate(positions[i]));
+			}
+
+			viewer->setSceneData(builder->getVertexAttribHardwareInstancedNode());
+			float extent = side * 4.0f;
+			viewer->getCamera()->setViewMatrixAsLookAt(osg::Vec3(extent * 0.5f, -extent * 0.5f, extent), osg::Vec3(extent * 0.5f, extent * 0.5f, 0.0f), osg::Vec3(0.0f, 0.0f, 1.0f));
+
+			double updateTime = 0.0;
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			for (unsigned int frame = 0; frame < warmUpFrames + numFrames; ++frame)
+			{
+				if (frame == warmUpFrames)
+				{
+					updateTime = 0.0;
+					start = osg::Timer::instance()->tick();
+				}
+
+				// spin every instance around its z axis
+				osg::Timer_t updateStart = osg::Timer::instance()->tick();
+				for (unsigned int i = 0; i < numInstances; ++i)
+				{
+					builder->updateMatrix(handles[i], osg::Matrixf::rotate(frame * 0.05f + i, osg::Vec3(0.0f, 0.0f, 1.0f)) * osg::Matrixf::translate(positions[i]));
+				}
+				updateTime += osg::Timer::instance()->delta_m(updateStart, osg::Timer::instance()->tick());
+
+				viewer->frame();
+			}
+			double frameTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) / numFrames;
+
+			std::cout << numInstances << " instances, " << (streaming ? "ring buffer:  " : "dirty ranges: ")
+					  << frameTime << " ms per frame, " << updateTime / numFrames << " ms writing transforms" << std::endl;
+		}
+	}
+
+	return 0;
+}
+
+osg::ref_ptr<osg::Node> buildTechnique(unsigned int technique)
+{
+	osg::ref_ptr<osg::Node> node;
+	switch (technique)
+	{
+	case 0:
+		node = g_builder->getSoftwareInstancedNode();
+		break;
+	case 1:
+		node = g_builder->getHardwareInstancedNode();
+		break;
+	case 2:
+		node = g_builder->getTextureHardwareInstancedNode();
+		break;
+	case 3:
+		node = g_builder->getUBOHardwareInstancedNode();
+		break;
+	case 4:
+		node = g_builder->getVertexAttribHardwareInstancedNode();
+		break;
+	default:
+		node = g_builder->getBatchedHardwareInstancedNode();
+		break;
+	}
+
+	if (g_memoryReport)
+		g_builder->printMemoryReport();
+	return node;
+}
+
+osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y, unsigned int technique)
 {
 	osg::ref_ptr<osg::Switch>	switchNode = new osg::Switch;
+	osg::Timer_t start = osg::Timer::instance()->tick();
 
 	// setup the instanced geometry builder
 	g_builder->setGeometry(createQuads());
 	
 	osg::Vec2 blockSize((float)g_fileLoader.getWidth() / (float)x, (float)g_fileLoader.getHeight() / (float)y);
-	osg::Vec3 scale(2.0f, 2.0f, 1.0f);
-
-	// create some matrices
-	std::vector<osg::Matrixd> matrices;
 	g_builder->clearMatrices();
-	srand(time(NULL));
-	for (unsigned int i = 0; i < x; ++i)
+
+	// every instance draws its random numbers from its own index, so the placement only depends on the seed
+	size_t numInstances = (size_t)x * (size_t)y;
+	unsigned int seed = g_seed;
+	g_builder->generateMatrices(numInstances, [&](size_t begin, size_t end, osg::Matrixf* matrices)
 	{
-		for (unsigned int j = 0; j < y; ++j)
+		// first draw the positions of the range, so all heights can be sampled in one batch
+		size_t count = end - begin;
+		std::vector<float> positionsX(count), positionsY(count), heights(count);
+		for (size_t k = begin; k < end; ++k)
+		{
+			unsigned int i = k / y;
+			unsigned int j = k % y;
+			positionsX[k - begin] = i * blockSize.x() + (osgExample::counterRandom(seed, k, 0) % 100) * 0.02f;
+			positionsY[k - begin] = j * blockSize.y() + (osgExample::counterRandom(seed, k, 1) % 100) * 0.02f;
+		}
+		g_fileLoader.getNearestHeights(&positionsX[0], &positionsY[0], &heights[0], count);
+
+		for (size_t k = begin; k < end; ++k)
 		{
-			// get random angle and random scale
-			double angle = (rand() % 360) / 180.0 * M_PI;
-			double scale = (rand() % 10)  + 1.0;
-
-			// calculate position
-			osg::Vec3 position(i * blockSize.x(), j * blockSize.y(), 0.0f);
-			osg::Vec3 jittering((rand() % 100) * 0.02f, (rand() % 100) * 0.02f, 0.0f);
-			position += jittering;
-			position.z() = g_fileLoader.getNearestHeight(position.x(), position.y());
-			position.x() *= 2.0f;
-			position.y() *= 2.0f;
-
-			osg::Matrixd modelMatrix =  osg::Matrixd::scale(scale, scale, scale) * osg::Matrixd::rotate(angle, osg::Vec3d(0.0, 0.0, 1.0)) * osg::Matrixd::translate(position);
-			g_builder->addMatrix(modelMatrix);
-			matrices.push_back(modelMatrix);
+			// random angle and random scale, scale * rotation around z * translation written out
+			float angle = (float)((osgExample::counterRandom(seed, k, 2) % 360) / 180.0 * M_PI);
+			float scale = (float)(osgExample::counterRandom(seed, k, 3) % 10 + 1);
+			float sine = sinf(angle) * scale;
+			float cosine = cosf(angle) * scale;
+			size_t index = k - begin;
+			matrices[index].set(cosine, sine, 0.0f, 0.0f,
+								-sine, cosine, 0.0f, 0.0f,
+								0.0f, 0.0f, scale, 0.0f,
+								positionsX[index] * 2.0f, positionsY[index] * 2.0f, heights[index], 1.0f);
 		}
+	});
+
+	// report how the tile cache performed during instance placement
+	if (g_fileLoader.isTiled())
+	{
+		osgExample::TiledHeightMap::Statistics statistics = g_fileLoader.getTiledHeightMap().getStatistics();
+		std::cout << "Height map tile cache: " << statistics.getHitRate() * 100.0 << "% hit rate, "
+				  << statistics.bytesPaged / (1024.0 * 1024.0) << " MB paged, "
+				  << statistics.evictions << " evictions, "
+				  << g_fileLoader.getTiledHeightMap().getResidentBytes() / (1024.0 * 1024.0) << " MB resident" << std::endl;
+		g_fileLoader.getTiledHeightMap().resetStatistics();
+	}
+	std::cout << "Placed " << numInstances << " instances in " << osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick()) << " s" << std::endl;
+
+	// the other techniques are built the first time they are selected
+	for (unsigned int i = 0; i < osgExample::SwitchInstancingHandler::NUM_TECHNIQUES; ++i)
+	{
+		switchNode->addChild(i == technique ? buildTechnique(i) : new osg::Group, i == technique);
 	}
-	
-	switchNode->addChild(g_builder->getSoftwareInstancedNode(), false);
-	switchNode->addChild(g_builder->getHardwareInstancedNode(), false);
-	switchNode->addChild(g_builder->getTextureHardwareInstancedNode(), false);
-	switchNode->addChild(g_builder->getUBOHardwareInstancedNode(), false);
-	switchNode->addChild(g_builder->getVertexAttribHardwareInstancedNode(), true);
 
 	// load texture and add it to the quad
 	osg::ref_ptr<osg::Image> image = osgDB::readImageFile("../data/grass.png");
@@ -204,16 +480,216 @@ osg::ref_ptr<osg::Switch> setupScene(unsigned int x, unsigned int y)
 	return switchNode;
 }
 
+// averages of one technique and scene size, the times are in ms
+struct TechniqueBenchmarkResult
+{
+	std::string		technique;
+	unsigned int	size;
+	double			frameTime;
+	double			cullTime;
+	double			drawTime;
+	double			gpuTime;
+	double			drawnInstances;
+	double			drawCalls;
+	double			stateChanges;
+};
+
+void writeBenchmarkResults(const std::vector<TechniqueBenchmarkResult>& results, std::ostream& stream, bool json)
+{
+	if (json)
+	{
+		stream << "[" << std::endl;
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const TechniqueBenchmarkResult& result = results[i];
+			stream << "\t{\"technique\": \"" << result.technique << "\", \"size\": " << result.size
+				   << ", \"instances\": " << result.size * result.size << ", \"frame_ms\": " << result.frameTime
+				   << ", \"cull_ms\": " << result.cullTime << ", \"draw_ms\": " << result.drawTime << ", \"gpu_ms\": " << result.gpuTime
+				   << ", \"drawn_instances\": " << result.drawnInstances << ", \"draw_calls\": " << result.drawCalls
+				   << ", \"state_changes\": " << result.stateChanges << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+		}
+		stream << "]" << std::endl;
+	} else {
+		stream << "technique,size,instances,frame_ms,cull_ms,draw_ms,gpu_ms,drawn_instances,draw_calls,state_changes" << std::endl;
+		for (auto it = results.begin(); it != results.end(); ++it)
+		{
+			stream << it->technique << "," << it->size << "," << it->size * it->size << "," << it->frameTime << ","
+				   << it->cullTime << "," << it->drawTime << "," << it->gpuTime << "," << it->drawnInstances << ","
+				   << it->drawCalls << "," << it->stateChanges << std::endl;
+		}
+	}
+}
+
+int benchmarkTechniques(osg::ref_ptr<osgViewer::Viewer> viewer, unsigned int numFrames, unsigned int maxSize, const std::string& outputFile)
+{
+	const char* techniqueNames[] = {"software", "uniform", "texture", "ubo", "attribute", "batched"};
+	const unsigned int warmUpFrames = 10u;
+	// a MatrixTransform per instance takes minutes to build and cull above this size
+	const unsigned int maxSoftwareSize = 256u;
+	viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+
+	// keep the stats of all measured frames, osg only keeps the last few by default
+	osg::ref_ptr<osg::Camera> camera = viewer->getCamera();
+	camera->setStats(new osg::Stats("Camera", warmUpFrames + numFrames + 10u));
+	camera->getStats()->collectStats("rendering", true);
+	camera->getStats()->collectStats("gpu", true);
+
+	// look at the whole terrain from the south
+	float extentX = g_fileLoader.getWidth() * 2.0f;
+	float extentY = g_fileLoader.getHeight() * 2.0f;
+	camera->setViewMatrixAsLookAt(osg::Vec3(extentX * 0.5f, -extentY * 0.25f, std::max(extentX, extentY) * 0.5f), osg::Vec3(extentX * 0.5f, extentY * 0.5f, 0.0f), osg::Vec3(0.0f, 0.0f, 1.0f));
+
+	std::vector<TechniqueBenchmarkResult> results;
+	osg::ref_ptr<osgExample::InstanceCullStatistics> cullStatistics = g_builder->getCullStatistics();
+	for (unsigned int size = 8u; size <= maxSize; size *= 2u)
+	{
+		osg::ref_ptr<osg::Switch> scene;
+		for (unsigned int technique = 0; technique < osgExample::SwitchInstancingHandler::NUM_TECHNIQUES; ++technique)
+		{
+			if (technique == 0 && size > maxSoftwareSize)
+			{
+				std::cout << "Skipping " << techniqueNames[technique] << " with " << size << "x" << size << " instances" << std::endl;
+				continue;
+			}
+
+			// the scene is placed once per size, the techniques are added to it one by one
+			if (!scene.valid())
+			{
+				scene = setupScene(size, size, technique);
+				viewer->setSceneData(scene);
+			} else {
+				scene->setChild(technique, buildTechnique(technique));
+			}
+			scene->setSingleChildOn(technique);
+			scene->setValue(osgExample::SwitchInstancingHandler::LIGHT_SOURCE_CHILD, true);
+
+			TechniqueBenchmarkResult result = {techniqueNames[technique], size, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+			unsigned int firstFrame = 0u;
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			for (unsigned int frame = 0; frame < warmUpFrames + numFrames; ++frame)
+			{
+				if (frame == warmUpFrames)
+				{
+					firstFrame = viewer->getFrameStamp()->getFrameNumber() + 1u;
+					start = osg::Timer::instance()->tick();
+				}
+
+				viewer->frame();
+
+				// the counts of a frame are complete after its cull traversal
+				cullStatistics->nextFrame();
+				if (frame >= warmUpFrames)
+				{
+					result.drawnInstances += cullStatistics->getLastFrameDrawnInstances();
+					result.drawCalls += cullStatistics->getLastFrameDrawCalls();
+					result.stateChanges += cullStatistics->getLastFrameStateChanges();
+				}
+			}
+			result.frameTime = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) / numFrames;
+			result.drawnInstances /= numFrames;
+			result.drawCalls /= numFrames;
+			result.stateChanges /= numFrames;
+
+			// the stats hold seconds, gpu times arrive a few frames late and may be missing for the last frames
+			unsigned int lastFrame = viewer->getFrameStamp()->getFrameNumber();
+			camera->getStats()->getAveragedAttribute(firstFrame, lastFrame, "Cull traversal time taken", result.cullTime);
+			camera->getStats()->getAveragedAttribute(firstFrame, lastFrame, "Draw traversal time taken", result.drawTime);
+			camera->getStats()->getAveragedAttribute(firstFrame, lastFrame, "GPU draw time taken", result.gpuTime);
+			result.cullTime *= 1000.0;
+			result.drawTime *= 1000.0;
+			result.gpuTime *= 1000.0;
+
+			std::cout << result.technique << " " << size << "x" << size << ": " << result.frameTime << " ms per frame, cull "
+					  << result.cullTime << " ms, draw " << result.drawTime << " ms, gpu " << result.gpuTime << " ms" << std::endl;
+			results.push_back(result);
+
+			// free the technique before the next one is built
+			scene->setChild(technique, new osg::Group);
+		}
+	}
+
+	// the format follows the extension of the output file, csv without one
+	bool json = outputFile.size() >= 5 && outputFile.compare(outputFile.size() - 5, 5, ".json") == 0;
+	if (outputFile.empty())
+	{
+		writeBenchmarkResults(results, std::cout, false);
+	} else {
+		std::ofstream stream(outputFile.c_str());
+		if (!stream)
+		{
+			std::cout << "Error could not write benchmark results to: " << outputFile << std::endl;
+			return 1;
+		}
+		writeBenchmarkResults(results, stream, json);
+		std::cout << "Wrote benchmark results to " << outputFile << std::endl;
+	}
+
+	return 0;
+}
+
 int main(int argc, char** argv)
 {
+	osg::ArgumentParser arguments(&argc, argv);
+
+	// benchmark the height map loaders without opening a window
+	std::string benchmarkFile = "../data/crater.asc";
+	if (arguments.read("--benchmark-loader", benchmarkFile) || arguments.read("--benchmark-loader"))
+	{
+		unsigned int iterations = 10;
+		arguments.read("--iterations", iterations);
+		return benchmarkLoader(benchmarkFile, std::max(iterations, 1u));
+	}
+
+	// benchmark batched against per call height sampling
+	unsigned int numSamples = 1024u * 1024u;
+	if (arguments.read("--benchmark-sampling", numSamples) || arguments.read("--benchmark-sampling"))
+	{
+		return benchmarkSampling("../data/crater.asc", std::max(numSamples, 1u));
+	}
+
+	// scale instance culling across threads
+	unsigned int numCulledInstances = 4u * 1024u * 1024u;
+	if (arguments.read("--benchmark-culling", numCulledInstances) || arguments.read("--benchmark-culling"))
+	{
+		unsigned int iterations = 10;
+		arguments.read("--iterations", iterations);
+		return benchmarkCulling(std::max(numCulledInstances, 1u), std::max(iterations, 1u));
+	}
+
 	osg::ref_ptr<osgViewer::Viewer> viewer = new osgViewer::Viewer;
 
-	viewer->setUpViewInWindow(100, 100, 800, 600);
+	// the technique benchmark renders into an offscreen pbuffer, so it also runs on machines without a display
+	unsigned int numBenchmarkFrames = 100u;
+	bool benchmark = arguments.read("--benchmark", numBenchmarkFrames) || arguments.read("--benchmark");
+	if (benchmark)
+	{
+		osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+		traits->readDISPLAY();
+		traits->setUndefinedScreenDetailsToDefaultScreen();
+		traits->width = 800;
+		traits->height = 600;
+		traits->pbuffer = true;
+		traits->doubleBuffer = false;
+		osg::ref_ptr<osg::GraphicsContext> context = osg::GraphicsContext::createGraphicsContext(traits);
+		if (!context.valid())
+		{
+			std::cout << "Error could not create an offscreen pbuffer for the benchmark" << std::endl;
+			return 1;
+		}
 
-	// get window and set name
-	osgViewer::ViewerBase::Windows windows;
-	viewer->getWindows(windows);
-	windows[0]->setWindowName("OpenSceneGraph Instancing Example");
+		viewer->getCamera()->setGraphicsContext(context);
+		viewer->getCamera()->setViewport(0, 0, traits->width, traits->height);
+		viewer->getCamera()->setProjectionMatrixAsPerspective(30.0, (double)traits->width / (double)traits->height, 1.0, 100000.0);
+		viewer->getCamera()->setDrawBuffer(GL_FRONT);
+		viewer->getCamera()->setReadBuffer(GL_FRONT);
+	} else {
+		viewer->setUpViewInWindow(100, 100, 800, 600);
+
+		// get window and set name
+		osgViewer::ViewerBase::Windows windows;
+		viewer->getWindows(windows);
+		windows[0]->setWindowName("OpenSceneGraph Instancing Example");
+	}
 
 	// get context to determine max number of uniforms in vertex shader
 	osgViewer::ViewerBase::Contexts contexts;
@@ -223,30 +699,96 @@ int main(int argc, char** argv)
 	initOpenGL(contexts[0], maxNumUniforms, maxUniformBlockSize);
 	//contexts[0]->getState()->setUseModelViewAndProjectionUniforms(true);
 
+	// compare streaming every transform through the ring buffer with uploading dirty ranges
+	unsigned int numStreamingFrames = 200u;
+	if (arguments.read("--benchmark-streaming", numStreamingFrames) || arguments.read("--benchmark-streaming"))
+	{
+		return benchmarkStreaming(viewer, std::max(numStreamingFrames, 1u));
+	}
+
 	// we need to reserve some space for modelViewMatrix, projectionMatrix, modelViewProjectionMatrix and normalMatrix, we also need 16 float uniforms per matrix
 	unsigned int maxInstanceMatrices = (maxNumUniforms-64) / 16;
 
+	// optionally page the elevation model in tiles with a memory budget in MB
+	double tileBudget = 0.0;
+	if (arguments.read("--tile-budget", tileBudget))
+	{
+		g_fileLoader.setTileMemoryBudget((size_t)(std::max(tileBudget, 0.0) * 1024.0 * 1024.0));
+	}
+
 	// load elevation model from asc
+	osg::Timer_t loadStart = osg::Timer::instance()->tick();
 	g_fileLoader.loadFromFile("../data/crater.asc");
+	std::cout << "Loaded height map in " << osg::Timer::instance()->delta_m(loadStart, osg::Timer::instance()->tick()) << " ms"
+			  << (g_fileLoader.isLoadedFromCache() ? " (from cache)" : "") << std::endl;
 
 	// create scene
 	g_builder = new osgExample::InstancedGeometryBuilder(maxInstanceMatrices, maxUniformBlockSize);
-	osg::ref_ptr<osg::Switch> scene = setupScene(64, 64);
+	if (arguments.read("--quantized"))
+		g_builder->setInstanceFormat(osgExample::InstancedGeometryBuilder::QUANTIZED_INSTANCES);
+	unsigned int maxInstancesPerChunk = 0;
+	if (arguments.read("--chunk-size", maxInstancesPerChunk))
+		g_builder->setMaxInstancesPerChunk(maxInstancesPerChunk);
+	if (arguments.read("--streaming"))
+		g_builder->setStreamingInstances(true);
+	if (arguments.read("--instance-culling"))
+		g_builder->setInstanceCulling(true);
+	unsigned int numCullThreads = 0;
+	if (arguments.read("--cull-threads", numCullThreads))
+		g_builder->setNumCullThreads(numCullThreads);
+	g_memoryReport = arguments.read("--memory-report");
+	g_seed = (unsigned int)time(NULL);
+	arguments.read("--seed", g_seed);
+	std::cout << "Instance placement seed: " << g_seed << std::endl;
+	float lodDistance = 0.0f;
+	if (arguments.read("--lod", lodDistance))
+		g_builder->addLodGeometry(lodDistance, createLodQuad());
+	if (benchmark)
+	{
+		unsigned int maxBenchmarkSize = 1024u;
+		arguments.read("--benchmark-max-size", maxBenchmarkSize);
+		std::string benchmarkOutput;
+		arguments.read("--benchmark-output", benchmarkOutput);
+		return benchmarkTechniques(viewer, std::max(numBenchmarkFrames, 1u), std::min(std::max(maxBenchmarkSize, 8u), 1024u), benchmarkOutput);
+	}
+
+	const unsigned int initialTechnique = 4;
+	osg::ref_ptr<osg::Switch> scene = setupScene(64, 64, initialTechnique);
 	viewer->setSceneData(scene);
 
 	 // add the state manipulator
     viewer->addEventHandler(new osgGA::StateSetManipulator(viewer->getCamera()->getOrCreateStateSet()));
 
-	// add the stats handler
-    viewer->addEventHandler(new osgViewer::StatsHandler);
-	viewer->addEventHandler(new osgExample::SwitchInstancingHandler(viewer, scene, setupScene));
+	// add the stats handler with the number of drawn and culled instances
+	osg::ref_ptr<osgViewer::StatsHandler> statsHandler = new osgViewer::StatsHandler;
+	statsHandler->addUserStatsLine("Instances drawn", osg::Vec4(0.2f, 1.0f, 0.2f, 1.0f), osg::Vec4(0.2f, 1.0f, 0.2f, 0.5f), "Instances drawn", 1.0, false, false, "", "", 0.0);
+	statsHandler->addUserStatsLine("Instances culled", osg::Vec4(1.0f, 0.2f, 0.2f, 1.0f), osg::Vec4(1.0f, 0.2f, 0.2f, 0.5f), "Instances culled", 1.0, false, false, "", "", 0.0);
+	statsHandler->addUserStatsLine("Draw calls", osg::Vec4(0.2f, 0.6f, 1.0f, 1.0f), osg::Vec4(0.2f, 0.6f, 1.0f, 0.5f), "Draw calls", 1.0, false, false, "", "", 0.0);
+	statsHandler->addUserStatsLine("State changes", osg::Vec4(1.0f, 0.8f, 0.2f, 1.0f), osg::Vec4(1.0f, 0.8f, 0.2f, 0.5f), "State changes", 1.0, false, false, "", "", 0.0);
+    viewer->addEventHandler(statsHandler);
+	viewer->addEventHandler(new osgExample::SwitchInstancingHandler(viewer, scene, initialTechnique, setupScene, buildTechnique, g_builder->getCullStatistics()));
 
 	// print usage
 	std::cout << "OpenSceneraph Instancing Example" << std::endl;
 	std::cout << "================================" << std::endl << std::endl;
-	std::cout << "Switch between instancing techniques: 1, 2, 3, 4, 5" << std::endl;
+	std::cout << "Switch between instancing techniques: 1, 2, 3, 4, 5, 6" << std::endl;
 	std::cout << "Increase/decrease scene complexety: +/-" << std::endl;
 	std::cout << "Cycle through different status informations(FPS and other stats): s" << std::endl;
+	std::cout << "Print drawn and culled instances, draw calls and state changes of the last frame: c" << std::endl;
+	std::cout << "Benchmark height map loading(command line): --benchmark-loader [file] [--iterations n]" << std::endl;
+	std::cout << "Benchmark height sampling(command line): --benchmark-sampling [n]" << std::endl;
+	std::cout << "Benchmark streaming 100k/1M animated instances(command line): --benchmark-streaming [frames]" << std::endl;
+	std::cout << "Page height map tiles with a memory budget in MB(command line): --tile-budget n" << std::endl;
+	std::cout << "Use quantized instances instead of matrices(command line): --quantized" << std::endl;
+	std::cout << "Set the maximum number of instances per culling chunk(command line): --chunk-size n" << std::endl;
+	std::cout << "Stream the instances of the vertex attribute technique through a ring buffer(command line): --streaming" << std::endl;
+	std::cout << "Cull single instances against the view frustum(command line): --instance-culling" << std::endl;
+	std::cout << "Set the number of threads culling single instances(command line): --cull-threads n" << std::endl;
+	std::cout << "Benchmark instance culling with 1-32 threads(command line): --benchmark-culling [n] [--iterations n]" << std::endl;
+	std::cout << "Draw a single quad for instances farther away than the distance(command line): --lod distance" << std::endl;
+	std::cout << "Print the memory of the chunked techniques after every build(command line): --memory-report" << std::endl;
+	std::cout << "Place the instances reproducibly from a seed(command line): --seed n" << std::endl;
+	std::cout << "Benchmark all techniques offscreen with 8x8 to 1024x1024 instances(command line): --benchmark [frames] [--benchmark-max-size n] [--benchmark-output file.csv|file.json]" << std::endl;
 
 	return viewer->run();
 }
\ No newline at end of file
@@ -1,14 +1,23 @@
 #include "ConvertToLevelOfDetailGeometryVisitor.h"
 #include "LevelOfDetailDrawElements.h"
 #include "HalfEdge.h"
+#include "ParallelFor.h"
+#include "LodTriangleClassifier.h"
 
 #include <osg/Array>
 #include <osg/Geode>
 #include <osg/TriangleIndexFunctor>
+#include <osg/Timer>
 
 #include <iostream>
 #include <memory>
 #include <cmath>
+#include <cstdint>
+#include <climits>
+#include <atomic>
+#include <map>
+#include <set>
+#include <algorithm>
 
 using namespace std;
 using namespace osg;
@@ -16,30 +25,121 @@ using namespace osg;
 namespace osgUtil
 {
 
+void ConversionStatistics::add(const ConversionStatistics& rhs)
+{
+	numGeometries += rhs.numGeometries;
+	numTriangles += rhs.numTriangles;
+	numWeldedVertices += rhs.numWeldedVertices;
+	numNonManifoldEdges += rhs.numNonManifoldEdges;
+	halfEdgeTime += rhs.halfEdgeTime;
+	oppositeTime += rhs.oppositeTime;
+	protectedVertexTime += rhs.protectedVertexTime;
+	lodTime += rhs.lodTime;
+	wallTime += rhs.wallTime;
+}
+
+void ConvertToLevelOfDetailGeometryVisitor::apply(Node& node)
+{
+	traverse(node);
+
+	// the traversal is back at the node it started at, so all geodes are collected
+	if (getNodePath().size() <= 1) { convertCollectedGeometries(); }
+}
+
 void ConvertToLevelOfDetailGeometryVisitor::apply(Geode& geode)
 {
-	// convert all geometries to lod geometries
-	vector<ref_ptr<LevelOfDetailGeometry> > lodGeometries;
-	for (size_t i = 0; i < geode.getNumDrawables(); ++i)
+	// the geometries are converted together after the traversal
+	_geodes.push_back(&geode);
+
+	if (getNodePath().size() <= 1) { convertCollectedGeometries(); }
+}
+
+void ConvertToLevelOfDetailGeometryVisitor::convertCollectedGeometries()
+{
+	Timer_t start = Timer::instance()->tick();
+
+	// every geode and geometry is converted once, even if it is shared
+	vector<ref_ptr<Geode> > geodes;
+	set<Geode*> visitedGeodes;
+	vector<ref_ptr<Geometry> > geometries;
+	map<Geometry*, size_t> geometryIndices;
+	for (auto geode: _geodes)
 	{
-		ref_ptr<Geometry> geometry = dynamic_cast<Geometry*>(geode.getDrawable(i));
+		if (!visitedGeodes.insert(geode.get()).second) { continue; }
+		geodes.push_back(geode);
 
-		if (geometry)
+		for (size_t i = 0; i < geode->getNumDrawables(); ++i)
 		{
-			lodGeometries.push_back(convert(geometry));			
+			Geometry* geometry = dynamic_cast<Geometry*>(geode->getDrawable(i));
+			if (geometry && geometryIndices.insert(make_pair(geometry, geometries.size())).second)
+			{
+				geometries.push_back(geometry);
+			}
 		}
 	}
+	_geodes.clear();
 
-	// replace geometries of the geode
-	geode.removeDrawables(0, geode.getNumDrawables());
+	// start with the largest geometries, so the threads finish at about the same time
+	vector<size_t> order(geometries.size());
+	vector<size_t> numIndices(geometries.size(), 0);
+	for (size_t i = 0; i < geometries.size(); ++i)
+	{
+		order[i] = i;
+		for (size_t j = 0; j < geometries[i]->getNumPrimitiveSets(); ++j)
+		{
+			numIndices[i] += geometries[i]->getPrimitiveSet(j)->getNumIndices();
+		}
+	}
+	sort(order.begin(), order.end(), [&](size_t a, size_t b) { return numIndices[a] > numIndices[b]; });
+
+	// each thread takes the next geometry until all are converted, the stages of a geometry use the cores left over
+	size_t numThreads = getNumTasks(geometries.size(), 1);
+	size_t maxTasksPerGeometry = std::max<size_t>(getNumCores() / std::max<size_t>(geometries.size(), 1), 1);
+	vector<ref_ptr<LevelOfDetailGeometry> > lodGeometries(geometries.size());
+	vector<ConversionStatistics> statistics(geometries.size());
+	atomic<size_t> nextGeometry(0);
+	parallelFor(numThreads, numThreads, [&](size_t, size_t, size_t)
+	{
+		for (size_t i = nextGeometry++; i < geometries.size(); i = nextGeometry++)
+		{
+			lodGeometries[order[i]] = convert(geometries[order[i]], statistics[order[i]], maxTasksPerGeometry);
+		}
+	});
+
+	for (size_t i = 0; i < geometries.size(); ++i)
+	{
+		if (statistics[i].numNonManifoldEdges > 0)
+		{
+			cout << "Warning: " << geometries[i]->getName() << " has " << statistics[i].numNonManifoldEdges << " non-manifold edges." << endl;
+		}
+		_statistics.add(statistics[i]);
+	}
 
-	for (auto it: lodGeometries)
+	// replace geometries of the geodes
+	for (auto geode: geodes)
 	{
-		geode.addDrawable(it);
+		vector<ref_ptr<LevelOfDetailGeometry> > geodeLodGeometries;
+		for (size_t i = 0; i < geode->getNumDrawables(); ++i)
+		{
+			Geometry* geometry = dynamic_cast<Geometry*>(geode->getDrawable(i));
+			if (geometry)
+			{
+				geodeLodGeometries.push_back(lodGeometries[geometryIndices[geometry]]);
+			}
+		}
+
+		geode->removeDrawables(0, geode->getNumDrawables());
+
+		for (auto it: geodeLodGeometries)
+		{
+			geode->addDrawable(it);
+		}
 	}
+
+	_statistics.wallTime += Timer::instance()->delta_s(start, Timer::instance()->tick());
 }
 
-ref_ptr<LevelOfDetailGeometry> ConvertToLevelOfDetailGeometryVisitor::convert(ref_ptr<Geometry> geometry) const
+ref_ptr<LevelOfDetailGeometry> ConvertToLevelOfDetailGeometryVisitor::convert(ref_ptr<Geometry> geometry, ConversionStatistics& statistics, size_t maxTasks) const
 {
 	// assertions
 	if (!geometry) { return NULL; }
@@ -62,15 +162,28 @@ ref_ptr<LevelOfDetailGeometry> ConvertToLevelOfDetailGeometryVisitor::convert(re
 	lodGeometry->setMaxBounds(max);
 
     // collect half edges
+    Timer_t start = Timer::instance()->tick();
     vector<HalfEdge> halfEdges;
-    if (!collectHalfEdges(geometry, lodGeometry, &halfEdges)) { return NULL; }
+    if (!collectHalfEdges(geometry, lodGeometry, &halfEdges, statistics)) { return NULL; }
+    Timer_t halfEdgesCollected = Timer::instance()->tick();
 
     // find half edges opposites sort protected vertices to the front
-	findHalfEdgeOpposite(&halfEdges);    
+	size_t numNonManifoldEdges = findHalfEdgeOpposite(&halfEdges, maxTasks);
+    Timer_t oppositesFound = Timer::instance()->tick();
     findAndSortProtectedVertices(geometry, lodGeometry, &halfEdges);
+    Timer_t protectedVerticesSorted = Timer::instance()->tick();
     
 	// collect triangles and create list sorted by LODs
-    if (!collectLod(lodGeometry, min, max, lodGeometry->getNumberOfProtectedVertices())) { return NULL; }
+    if (!collectLod(lodGeometry, min, max, lodGeometry->getNumberOfProtectedVertices(), maxTasks)) { return NULL; }
+    Timer_t lodCollected = Timer::instance()->tick();
+
+    statistics.numGeometries++;
+    statistics.numTriangles += halfEdges.size() / 3;
+    statistics.numNonManifoldEdges += numNonManifoldEdges;
+    statistics.halfEdgeTime += Timer::instance()->delta_s(start, halfEdgesCollected);
+    statistics.oppositeTime += Timer::instance()->delta_s(halfEdgesCollected, oppositesFound);
+    statistics.protectedVertexTime += Timer::instance()->delta_s(oppositesFound, protectedVerticesSorted);
+    statistics.lodTime += Timer::instance()->delta_s(protectedVerticesSorted, lodCollected);
 
     // recompute bounds
 	lodGeometry->computeBound();
@@ -78,14 +191,23 @@ ref_ptr<LevelOfDetailGeometry> ConvertToLevelOfDetailGeometryVisitor::convert(re
 	return lodGeometry;
 }
 
-template<class VertexArray, class Vector> void _collectHalfEdges(osg::ref_ptr<osg::Geometry> geometry,
-                                                                 osg::ref_ptr<osg::LevelOfDetailGeometry>  lodGeometry,
-                                                                 std::vector<HalfEdge>* halfEdges)
+template<class VertexArray, class Vector> size_t _collectHalfEdges(osg::ref_ptr<osg::Geometry> geometry,
+                                                                   osg::ref_ptr<osg::LevelOfDetailGeometry>  lodGeometry,
+                                                                   std::vector<HalfEdge>* halfEdges)
 {
 	TriangleIndexFunctor<HalfEdgeTriangleCollector<VertexArray, Vector> > triangleCollector;
 	triangleCollector._vertexArray = dynamic_cast<VertexArray*>(geometry->getVertexArray());
     triangleCollector._halfEdges = halfEdges;
 
+    // there are at most as many positions as vertices and a half edge per index
+    size_t numIndices = 0;
+	for (size_t i = 0; i < geometry->getNumPrimitiveSets(); ++i)
+	{
+        numIndices += geometry->getPrimitiveSet(i)->getNumIndices();
+	}
+    triangleCollector._vertexWelder.reserve(triangleCollector._vertexArray->size());
+    halfEdges->reserve(numIndices);
+
 	for (size_t i = 0; i < geometry->getNumPrimitiveSets(); ++i)
 	{
         ref_ptr<PrimitiveSet> primtive = geometry->getPrimitiveSet(i);
@@ -94,29 +216,32 @@ template<class VertexArray, class Vector> void _collectHalfEdges(osg::ref_ptr<os
         primtive->accept(triangleCollector);
         lodGeometry->addPrimitiveSet(triangleCollector._drawElements);
 	}
+
+    return triangleCollector._vertexWelder.size();
 }
 
 bool ConvertToLevelOfDetailGeometryVisitor::collectHalfEdges(osg::ref_ptr<osg::Geometry> geometry,
                                                    osg::ref_ptr<osg::LevelOfDetailGeometry>  lodGeometry,
-                                                   std::vector<HalfEdge>*      halfEdges) const
+                                                   std::vector<HalfEdge>*      halfEdges,
+                                                   ConversionStatistics& statistics) const
 {
     switch(geometry->getVertexArray()->getType())
 	{
 		case Array::Vec3ArrayType:
 		{
-            _collectHalfEdges<Vec3Array, Vec3>(geometry, lodGeometry, halfEdges);
+            statistics.numWeldedVertices += _collectHalfEdges<Vec3Array, Vec3>(geometry, lodGeometry, halfEdges);
 		} break;
 		case Array::Vec3dArrayType:
 		{
-			_collectHalfEdges<Vec3dArray, Vec3d>(geometry, lodGeometry, halfEdges);
+			statistics.numWeldedVertices += _collectHalfEdges<Vec3dArray, Vec3d>(geometry, lodGeometry, halfEdges);
 		} break;
 		case Array::Vec3bArrayType:
 		{
-			_collectHalfEdges<Vec3bArray, Vec3b>(geometry, lodGeometry, halfEdges);
+			statistics.numWeldedVertices += _collectHalfEdges<Vec3bArray, Vec3b>(geometry, lodGeometry, halfEdges);
 		} break;
 		case Array::Vec3sArrayType:
 		{
-			_collectHalfEdges<Vec3sArray, Vec3s>(geometry, lodGeometry, halfEdges);
+			statistics.numWeldedVertices += _collectHalfEdges<Vec3sArray, Vec3s>(geometry, lodGeometry, halfEdges);
 		} break;
 		default:
 			// unknown vertex format
@@ -179,28 +304,60 @@ ref_ptr<PrimitiveSet>  createLevelOfDetailDrawPrimitive(vector<ref_ptr<DrawEleme
 template<class VertexArray, class Vector> void _collectLod(ref_ptr<Geometry> geometry,
 														   float min,
 														   float max,
-                                                           int numProtectedVertices)
+                                                           int numProtectedVertices,
+                                                           size_t maxTasks)
 {
     vector<ref_ptr<PrimitiveSet> > drawElements;
     size_t numVertices = geometry->getVertexArray()->getNumElements();
+    LodTriangleClassifier classifier(min, max, numProtectedVertices);
+    vector<unsigned int> triangles;
+    vector<unsigned char> lods;
     for (size_t i = 0; i < geometry->getNumPrimitiveSets(); ++i)
 	{
-
+        // first collect the triangles, then compute the lods of all of them in one pass
         TriangleIndexFunctor<LodTriangleCollector<VertexArray, Vector> > triangleCollector;
 	    triangleCollector._vertexArray = dynamic_cast<VertexArray*>(geometry->getVertexArray());
-	    triangleCollector._min = min;
-	    triangleCollector._max = max;
-        triangleCollector._numProtectedVertices = numProtectedVertices;
+        triangleCollector._triangles = &triangles;
+        triangles.clear();
+        triangles.reserve(geometry->getPrimitiveSet(i)->getNumIndices());
+        geometry->getPrimitiveSet(i)->accept(triangleCollector);        
+
+        // every task classifies a range of the triangles and sorts them into its own buckets
+        size_t numTriangles = triangles.size() / 3;
+        size_t numTasks = std::min(getNumTasks(numTriangles, 1 << 14), maxTasks);
+        lods.resize(numTriangles);
+        vector<vector<unsigned int> > taskBuckets(numTasks * LodTriangleClassifier::NUM_LODS);
+        parallelFor(numTasks, numTriangles, [&](size_t task, size_t begin, size_t end)
+        {
+            if (begin == end) { return; }
+            classifier.classify(&triangleCollector._vertexArray->front(), &triangles[3 * begin], end - begin, &lods[begin]);
 
+            vector<unsigned int>* buckets = &taskBuckets[task * LodTriangleClassifier::NUM_LODS];
+            for (size_t j = begin; j < end; ++j)
+            {
+                buckets[lods[j]].insert(buckets[lods[j]].end(), &triangles[3 * j], &triangles[3 * j] + 3);
+            }
+        });
+
+        // concatenate the buckets of the tasks per lod, so the triangles of a lod keep their order
         vector<ref_ptr<DrawElementsUInt> > lodDrawElements;
-        for (size_t j = 0; j < 32; ++j)
+        for (size_t j = 0; j < LodTriangleClassifier::NUM_LODS; ++j)
 	    {
+            size_t lodSize = 0;
+            for (size_t task = 0; task < numTasks; ++task)
+            {
+                lodSize += taskBuckets[task * LodTriangleClassifier::NUM_LODS + j].size();
+            }
+
 		    lodDrawElements.push_back(new DrawElementsUInt(GL_TRIANGLES));
+            lodDrawElements.back()->reserve(lodSize);
+            for (size_t task = 0; task < numTasks; ++task)
+            {
+                const vector<unsigned int>& bucket = taskBuckets[task * LodTriangleClassifier::NUM_LODS + j];
+                lodDrawElements.back()->insert(lodDrawElements.back()->end(), bucket.begin(), bucket.end());
+            }
 	    }
-        triangleCollector._lodDrawElements = &lodDrawElements;
-	
-		
-        geometry->getPrimitiveSet(i)->accept(triangleCollector);        
+
         drawElements.push_back(createLevelOfDetailDrawPrimitive(&lodDrawElements, numVertices));
 	}
 
@@ -216,25 +373,26 @@ template<class VertexArray, class Vector> void _collectLod(ref_ptr<Geometry> geo
 bool ConvertToLevelOfDetailGeometryVisitor::collectLod(ref_ptr<Geometry> geometry,
 											 float min,
 											 float max,
-                                             int numProtectedVertices) const
+                                             int numProtectedVertices,
+                                             size_t maxTasks) const
 {
 	switch(geometry->getVertexArray()->getType())
 	{
 		case Array::Vec3ArrayType:
 		{
-			_collectLod<Vec3Array, Vec3>(geometry, min, max, numProtectedVertices);
+			_collectLod<Vec3Array, Vec3>(geometry, min, max, numProtectedVertices, maxTasks);
 		} break;
 		case Array::Vec3dArrayType:
 		{
-			_collectLod<Vec3dArray, Vec3d>(geometry, min, max, numProtectedVertices);
+			_collectLod<Vec3dArray, Vec3d>(geometry, min, max, numProtectedVertices, maxTasks);
 		} break;
 		case Array::Vec3bArrayType:
 		{
-			_collectLod<Vec3bArray, Vec3b>(geometry, min, max, numProtectedVertices);
+			_collectLod<Vec3bArray, Vec3b>(geometry, min, max, numProtectedVertices, maxTasks);
 		} break;
 		case Array::Vec3sArrayType:
 		{
-			_collectLod<Vec3sArray, Vec3s>(geometry, min, max, numProtectedVertices);
+			_collectLod<Vec3sArray, Vec3s>(geometry, min, max, numProtectedVertices, maxTasks);
 		} break;
 		default:
 			// unknown vertex format
@@ -245,26 +403,128 @@ bool ConvertToLevelOfDetailGeometryVisitor::collectLod(ref_ptr<Geometry> geometr
 	return true;
 }
 
-void ConvertToLevelOfDetailGeometryVisitor::findHalfEdgeOpposite(vector<HalfEdge>* halfEdges) const
+/**
+ @brief undirected edge, the key holds the smaller vertex ID in the upper and the larger in the lower bits
+*/
+struct EdgeKey
+{
+	uint64_t key;
+	size_t halfEdge;
+};
+
+void radixSortEdgeKeys(vector<EdgeKey>& keys, unsigned int numBits, size_t maxTasks)
+{
+	// least significant digit first, every pass is stable, so equal keys stay sorted by half edge
+	const unsigned int digitBits = 8;
+	const size_t numDigits = size_t(1) << digitBits;
+	size_t numTasks = std::min(getNumTasks(keys.size(), 1 << 16), maxTasks);
+	vector<EdgeKey> sortedKeys(keys.size());
+	vector<size_t> offsets(numTasks * numDigits);
+
+	for (unsigned int shift = 0; shift < numBits; shift += digitBits)
+	{
+		// count the digits of every task
+		fill(offsets.begin(), offsets.end(), 0);
+		parallelFor(numTasks, keys.size(), [&](size_t task, size_t begin, size_t end)
+		{
+			size_t* histogram = &offsets[task * numDigits];
+			for (size_t i = begin; i < end; ++i)
+			{
+				histogram[(keys[i].key >> shift) & (numDigits - 1)]++;
+			}
+		});
+
+		// turn the counts into offsets, the tasks of a digit write behind each other; skip the pass if all keys have the same digit
+		size_t offset = 0;
+		bool sorted = false;
+		for (size_t digit = 0; digit < numDigits; ++digit)
+		{
+			size_t digitCount = 0;
+			for (size_t task = 0; task < numTasks; ++task)
+			{
+				size_t count = offsets[task * numDigits + digit];
+				offsets[task * numDigits + digit] = offset;
+				offset += count;
+				digitCount += count;
+			}
+			sorted |= (digitCount == keys.size());
+		}
+		if (sorted) { continue; }
+
+		parallelFor(numTasks, keys.size(), [&](size_t task, size_t begin, size_t end)
+		{
+			size_t* taskOffsets = &offsets[task * numDigits];
+			for (size_t i = begin; i < end; ++i)
+			{
+				sortedKeys[taskOffsets[(keys[i].key >> shift) & (numDigits - 1)]++] = keys[i];
+			}
+		});
+		keys.swap(sortedKeys);
+	}
+}
+
+size_t ConvertToLevelOfDetailGeometryVisitor::findHalfEdgeOpposite(vector<HalfEdge>* halfEdges, size_t maxTasks) const
 {
-	map<pair<unsigned int, unsigned int>, size_t> oppositeMap;
+	if (halfEdges->empty()) { return 0; }
 
+	// the keys only need the bits of the largest vertex ID twice
+	unsigned int maxVertexID = 0;
 	for (size_t i = 0; i < halfEdges->size(); ++i)
 	{
-		HalfEdge* halfEdge = &halfEdges->at(i);
-		pair<unsigned int, unsigned int> index(halfEdge->vertexID, halfEdges->at(halfEdge->next).vertexID);
-		pair<unsigned int, unsigned int> oppositeIndex(halfEdges->at(halfEdge->next).vertexID, halfEdge->vertexID);
+		maxVertexID = std::max(maxVertexID, halfEdges->at(i).vertexID);
+	}
+	unsigned int vertexBits = 1;
+	while (vertexBits < 32 && (maxVertexID >> vertexBits) != 0) { ++vertexBits; }
+
+	vector<EdgeKey> keys(halfEdges->size());
+	parallelFor(std::min(getNumTasks(keys.size(), 1 << 16), maxTasks), keys.size(), [&](size_t, size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const HalfEdge& halfEdge = (*halfEdges)[i];
+			uint64_t first = halfEdge.vertexID;
+			uint64_t second = (*halfEdges)[halfEdge.next].vertexID;
+			keys[i].key = (std::min(first, second) << vertexBits) | std::max(first, second);
+			keys[i].halfEdge = i;
+		}
+	});
+	radixSortEdgeKeys(keys, 2 * vertexBits, maxTasks);
+
+	// half edges of the same edge are now adjacent and sorted by index
+	size_t numNonManifoldEdges = 0;
+	for (size_t begin = 0; begin < keys.size(); )
+	{
+		size_t end = begin + 1;
+		while (end < keys.size() && keys[end].key == keys[begin].key) { ++end; }
 
-		oppositeMap[index] = i;
+		// link each half edge with the last one in the other direction, a manifold edge has exactly one in each direction
+		size_t lastHalfEdge[2] = { LLONG_MAX, LLONG_MAX };
+		size_t numHalfEdges[2] = { 0, 0 };
+		for (size_t i = begin; i < end; ++i)
+		{
+			size_t index = keys[i].halfEdge;
+			HalfEdge* halfEdge = &halfEdges->at(index);
+			int direction = (halfEdge->vertexID < halfEdges->at(halfEdge->next).vertexID) ? 0 : 1;
+
+			lastHalfEdge[direction] = index;
+			numHalfEdges[direction]++;
+			if (lastHalfEdge[1 - direction] != LLONG_MAX)
+			{
+				halfEdge->opposite = lastHalfEdge[1 - direction];
+				halfEdges->at(lastHalfEdge[1 - direction]).opposite = index;
+			}
+		}
 
-		// try to find the opposite half edge
-		auto oppositeIt = oppositeMap.find(oppositeIndex);
-		if (oppositeIt != oppositeMap.end())
+		// shared by more than two triangles or by two triangles with different winding
+		if (numHalfEdges[0] > 1 || numHalfEdges[1] > 1)
 		{
-			halfEdge->opposite = oppositeIt->second;
-			halfEdges->at(oppositeIt->second).opposite = i;
+			numNonManifoldEdges++;
 		}
-	}	
+
+		begin = end;
+	}
+
+	return numNonManifoldEdges;
 }
 
 void ConvertToLevelOfDetailGeometryVisitor::findAndSortProtectedVertices(ref_ptr<Geometry> geometry, ref_ptr<LevelOfDetailGeometry> lodGeometry, std::vector<HalfEdge>* halfEdges) const
@@ -277,33 +537,13 @@ void ConvertToLevelOfDetailGeometryVisitor::findAndSortProtectedVertices(ref_ptr
 	Geometry::ArrayList& texCoordArrays = geometry->getTexCoordArrayList();
 	Geometry::ArrayList& vertexAttribArrays = geometry->getVertexAttribArrayList();	
 
-	ref_ptr<Array> protectedVertices = createArrayOfType(vertexArray);
-	ref_ptr<Array> regularVertices = createArrayOfType(vertexArray);
-	ref_ptr<Array> protectedNormals = createArrayOfType(normalArray);
-	ref_ptr<Array> regularNormals = createArrayOfType(normalArray);
-	ref_ptr<Array> protectedColors = createArrayOfType(colorArray);
-	ref_ptr<Array> regularColors = createArrayOfType(colorArray);
-	ref_ptr<Array> protectedSecondaryColors = createArrayOfType(secondaryColorArray);
-	ref_ptr<Array> regularSecondaryColors = createArrayOfType(secondaryColorArray);
-	ref_ptr<Array> protectedFogCoords = createArrayOfType(fogCoordArray);
-	ref_ptr<Array> regularFogCoords = createArrayOfType(fogCoordArray);
-	vector<ref_ptr<Array> > protectedTexCoords;
-	vector<ref_ptr<Array> > regularTexCoords;
-	for (auto texCoordArray: texCoordArrays)
-	{
-		protectedTexCoords.push_back(createArrayOfType(texCoordArray));
-		regularTexCoords.push_back(createArrayOfType(texCoordArray));
-	}
-	vector<ref_ptr<Array> > protectedVertexAttribs;
-	vector<ref_ptr<Array> > regularVertexAttribs;
-	for (auto vertexAttribArray: vertexAttribArrays)
+	// first find protected vertices
+    unsigned int numVertexIDs = 0;
+    for (size_t i = 0; i < halfEdges->size(); ++i)
 	{
-		protectedVertexAttribs.push_back(createArrayOfType(vertexAttribArray));
-		regularVertexAttribs.push_back(createArrayOfType(vertexAttribArray));
+        numVertexIDs = std::max(numVertexIDs, halfEdges->at(i).vertexID + 1);
 	}
-
-	// first find protected vertices
-    set<unsigned int> protectedVertexSet;
+    vector<bool> protectedVertexIDs(numVertexIDs, false);
     for (size_t i = 0; i < halfEdges->size(); ++i)
 	{
 		HalfEdge* halfEdge = &halfEdges->at(i);
@@ -313,96 +553,66 @@ void ConvertToLevelOfDetailGeometryVisitor::findAndSortProtectedVertices(ref_ptr
         if (halfEdge->opposite == LLONG_MAX)
 		{
 			// no opposite add this half edge and the next to the set
-			protectedVertexSet.insert(halfEdge->vertexID);
-            protectedVertexSet.insert(nextEdge->vertexID);          
+			protectedVertexIDs[halfEdge->vertexID] = true;
+            protectedVertexIDs[nextEdge->vertexID] = true;
 		}
         else if (prevEdge->opposite == LLONG_MAX)
         {
             // prev half edge has no opposite add this and the previous to the set
-			protectedVertexSet.insert(halfEdge->vertexID);
-            protectedVertexSet.insert(prevEdge->vertexID);
+			protectedVertexIDs[halfEdge->vertexID] = true;
+            protectedVertexIDs[prevEdge->vertexID] = true;
         }
 	}
-    
-    map<unsigned int, unsigned int> protectedVertexIDMap;
-   	map<unsigned int, unsigned int> regularVertexIDMap;
 
+    // then compute the new index of every used vertex, protected vertices come first, both in the order the half edges use them
+    const unsigned int unusedVertex = UINT_MAX;
+    vector<unsigned int> newIndices(vertexArray->getNumElements(), unusedVertex);
+    vector<unsigned int> protectedIndices;
+    vector<unsigned int> regularIndices;
+    protectedIndices.reserve(newIndices.size());
+    regularIndices.reserve(newIndices.size());
 	for (size_t i = 0; i < halfEdges->size(); ++i)
 	{
-		HalfEdge* halfEdge = &halfEdges->at(i);
-		auto protectedIt = protectedVertexIDMap.find(halfEdge->originalVertexID);
-		auto regularIt = regularVertexIDMap.find(halfEdge->originalVertexID);
-        
-        if (protectedVertexSet.find(halfEdge->vertexID) != protectedVertexSet.end() &&
-			protectedIt == protectedVertexIDMap.end())
-		{
-			// protected vertex buffer
-            addElementTo(protectedVertices, vertexArray, halfEdge->originalVertexID);
-			addElementTo(protectedNormals, normalArray, halfEdge->originalVertexID);
-			addElementTo(protectedColors, colorArray, halfEdge->originalVertexID);
-			addElementTo(protectedSecondaryColors, secondaryColorArray, halfEdge->originalVertexID);
-			addElementTo(protectedFogCoords, fogCoordArray, halfEdge->originalVertexID);
-			for (size_t j = 0; j < protectedTexCoords.size(); ++j)
-			{
-				addElementTo(protectedTexCoords[j], texCoordArrays[j], halfEdge->originalVertexID);
-			}
-			for (size_t j = 0; j < protectedVertexAttribs.size(); ++j)
-			{
-				addElementTo(protectedVertexAttribs[j], vertexAttribArrays[j], halfEdge->originalVertexID);
-			}
+		const HalfEdge& halfEdge = (*halfEdges)[i];
+        if (halfEdge.originalVertexID >= newIndices.size() || newIndices[halfEdge.originalVertexID] != unusedVertex) { continue; }
 
-			protectedVertexIDMap[halfEdge->originalVertexID] = protectedVertices->getNumElements()-1;
+        if (protectedVertexIDs[halfEdge.vertexID])
+		{
+            newIndices[halfEdge.originalVertexID] = protectedIndices.size();
+			protectedIndices.push_back(halfEdge.originalVertexID);
 		}
-		else if (regularIt == regularVertexIDMap.end())
+		else
         {
-			// regular vertex buffer
-			addElementTo(regularVertices, vertexArray, halfEdge->originalVertexID);
-			addElementTo(regularNormals, normalArray, halfEdge->originalVertexID);
-			addElementTo(regularColors, colorArray, halfEdge->originalVertexID);
-			addElementTo(regularSecondaryColors, secondaryColorArray, halfEdge->originalVertexID);
-			addElementTo(regularFogCoords, fogCoordArray, halfEdge->originalVertexID);
-			for (size_t j = 0; j < regularTexCoords.size(); ++j)
-			{
-				addElementTo(regularTexCoords[j], texCoordArrays[j], halfEdge->originalVertexID);
-			}
-			for (size_t j = 0; j < regularVertexAttribs.size(); ++j)
-			{
-				addElementTo(regularVertexAttribs[j], vertexAttribArrays[j], halfEdge->originalVertexID);
-			}
-
-			regularVertexIDMap[halfEdge->originalVertexID] = regularVertices->getNumElements()-1;
+            newIndices[halfEdge.originalVertexID] = regularIndices.size();
+			regularIndices.push_back(halfEdge.originalVertexID);
 		}
 	}
-    
-	// merge both buckets and replace old vertex array
-	size_t numFixedVertices = protectedVertices->getNumElements();
-	mergeArrays(protectedVertices, regularVertices);
-	mergeArrays(protectedNormals, regularNormals);
-	mergeArrays(protectedColors, regularColors);
-	mergeArrays(protectedSecondaryColors, regularSecondaryColors);
-	mergeArrays(protectedFogCoords, regularFogCoords);
-	for (size_t j = 0; j < regularTexCoords.size(); ++j)
-	{
-		mergeArrays(protectedTexCoords[j], regularTexCoords[j]);
-	}
-	for (size_t j = 0; j < regularVertexAttribs.size(); ++j)
-	{
-		mergeArrays(protectedVertexAttribs[j], regularVertexAttribs[j]);
-	}
-
-	lodGeometry->setVertexArray(protectedVertices);
-    if (normalArray && normalArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setNormalArray(protectedNormals); }
-    if (colorArray && colorArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setColorArray(protectedColors); }
-    if (secondaryColorArray && secondaryColorArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setSecondaryColorArray(protectedSecondaryColors); }
-    if (fogCoordArray && fogCoordArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setFogCoordArray(protectedFogCoords); }
 
-    for (size_t j = 0; j < protectedTexCoords.size(); ++j)
+    // the regular vertices follow the protected ones, so the permutation lists the old index of every new vertex
+	size_t numFixedVertices = protectedIndices.size();
+    for (auto regularIndex: regularIndices)
+    {
+        newIndices[regularIndex] += numFixedVertices;
+    }
+    vector<unsigned int> sourceIndices;
+    sourceIndices.reserve(protectedIndices.size() + regularIndices.size());
+    sourceIndices.insert(sourceIndices.end(), protectedIndices.begin(), protectedIndices.end());
+    sourceIndices.insert(sourceIndices.end(), regularIndices.begin(), regularIndices.end());
+
+	// gather every per vertex array in the new order
+	lodGeometry->setVertexArray(permuteArray(vertexArray, sourceIndices));
+    if (normalArray && normalArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setNormalArray(permuteArray(normalArray, sourceIndices)); }
+    if (colorArray && colorArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setColorArray(permuteArray(colorArray, sourceIndices)); }
+    if (secondaryColorArray && secondaryColorArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setSecondaryColorArray(permuteArray(secondaryColorArray, sourceIndices)); }
+    if (fogCoordArray && fogCoordArray->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setFogCoordArray(permuteArray(fogCoordArray, sourceIndices)); }
+
+    for (size_t j = 0; j < texCoordArrays.size(); ++j)
 	{
-        if (texCoordArrays[j] && texCoordArrays[j]->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setTexCoordArray(j, protectedTexCoords[j]); }
+        if (texCoordArrays[j] && texCoordArrays[j]->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setTexCoordArray(j, permuteArray(texCoordArrays[j], sourceIndices)); }
 	}
-	for (size_t j = 0; j < protectedVertexAttribs.size(); ++j)
+	for (size_t j = 0; j < vertexAttribArrays.size(); ++j)
 	{
-        if (vertexAttribArrays[j] && vertexAttribArrays[j]->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setVertexAttribArray(j, protectedVertexAttribs[j]); }
+        if (vertexAttribArrays[j] && vertexAttribArrays[j]->getBinding() == Array::BIND_PER_VERTEX) { lodGeometry->setVertexAttribArray(j, permuteArray(vertexAttribArrays[j], sourceIndices)); }
 	}
 
 
@@ -413,16 +623,10 @@ void ConvertToLevelOfDetailGeometryVisitor::findAndSortProtectedVertices(ref_ptr
         // translate vertexIDs to new ID
 	    for (size_t j = 0; j < lodDrawElements->size(); ++j)
 	    {
-		    auto protectedIt = protectedVertexIDMap.find(lodDrawElements->at(j));
-		    auto normalIt = regularVertexIDMap.find(lodDrawElements->at(j));
-
-		    if (protectedIt != protectedVertexIDMap.end())
+            unsigned int index = (*lodDrawElements)[j];
+            if (index < newIndices.size() && newIndices[index] != unusedVertex)
 		    {
-			    lodDrawElements->at(j) = protectedIt->second;
-		    }
-		    else if (normalIt != regularVertexIDMap.end())
-		    {
-			    lodDrawElements->at(j) = normalIt->second + numFixedVertices;
+			    (*lodDrawElements)[j] = newIndices[index];
 		    }
 		    else
 		    {
@@ -437,260 +641,78 @@ void ConvertToLevelOfDetailGeometryVisitor::findAndSortProtectedVertices(ref_ptr
 	lodGeometry->setNumberOfProtectedVertices(numFixedVertices);
 }
 
-ref_ptr<Array> ConvertToLevelOfDetailGeometryVisitor::createArrayOfType(osg::ref_ptr<osg::Array> rhs) const
-{
-	if (rhs == NULL)
-		return NULL;
-
-    ref_ptr<Array> array = NULL;
-	switch (rhs->getType())
-	{
-	case Array::ByteArrayType:
-        array = new ByteArray();
-		break;
-	case Array::ShortArrayType:
-		array = new ShortArray();
-		break;
-	case Array::IntArrayType:
-		array = new IntArray();
-		break;
-	case Array::UByteArrayType:
-		array = new UByteArray();
-		break;
-	case Array::UShortArrayType:
-		array = new UShortArray();
-		break;
-	case Array::UIntArrayType:
-		array = new UIntArray();
-		break;
-	case Array::Vec4ubArrayType:
-		array = new Vec4ubArray();
-		break;
-	case Array::FloatArrayType:
-		array = new FloatArray();
-		break;
-	case Array::Vec2ArrayType:
-		array = new Vec2Array();
-		break;
-	case Array::Vec3ArrayType:
-		array = new Vec3Array();
-		break;
-	case Array::Vec4ArrayType:
-		array = new Vec4Array();
-		break;
-	case Array::Vec2sArrayType:
-		array = new Vec2sArray();
-		break;
-	case Array::Vec3sArrayType:
-		array = new Vec3sArray();
-		break;
-	case Array::Vec4sArrayType:
-		array = new Vec4sArray();
-		break;
-    case Array::Vec2bArrayType:
-		array = new Vec2bArray();
-		break;
-	case Array::Vec3bArrayType:
-		array = new Vec3bArray();
-		break;
-	case Array::Vec4bArrayType:
-		array = new Vec4bArray();
-		break;
-    case Array::DoubleArrayType:
-		array = new DoubleArray();
-		break;
-	case Array::Vec2dArrayType:
-		array = new Vec2dArray();
-		break;
-	case Array::Vec3dArrayType:
-		array = new Vec3dArray();
-		break;
-	case Array::Vec4dArrayType:
-		array = new Vec4dArray();
-		break;  
-	case Array::MatrixArrayType:
-		array = new MatrixfArray();
-		break;
-	}
-
-    array->setBinding(rhs->getBinding());
-    return array;
-}
-
-
-template<class ArrayType> void _addElementTo(osg::ref_ptr<osg::Array> dst, osg::ref_ptr<osg::Array> src, size_t element)
+template<class ArrayType> ref_ptr<Array> _permuteArray(ref_ptr<Array> array, const vector<unsigned int>& sourceIndices)
 {
-	// cast the arrays to the right type
-	ArrayType* source = dynamic_cast<ArrayType*>(src.get());
-	ArrayType* destination = dynamic_cast<ArrayType*>(dst.get());
+	// the type was checked by the caller
+	const ArrayType* source = static_cast<const ArrayType*>(array.get());
+	ref_ptr<ArrayType> permutedArray = new ArrayType();
+	permutedArray->reserve(sourceIndices.size());
 
-	destination->push_back(source->at(element));
-}
-
-void ConvertToLevelOfDetailGeometryVisitor::addElementTo(osg::ref_ptr<osg::Array> dst, osg::ref_ptr<osg::Array> src, size_t element) const
-{
-	// assert that we have an source and destination array, that they have the same type, that we access an existing element, and that the binding type is bind per vertex
-	if (!dst || ! src) { return; }
-	if (dst->getType() != src->getType()) { return; }
-	if (element >= src->getNumElements()) { return; }
-    if (dst->getBinding() != Array::BIND_PER_VERTEX) { return; }
-
-	switch(src->getType())
+	for (auto index: sourceIndices)
 	{
-	case Array::ByteArrayType:
-		_addElementTo<ByteArray>(dst, src, element);
-		break;
-	case Array::ShortArrayType:
-		_addElementTo<ShortArray>(dst, src, element);
-		break;
-	case Array::IntArrayType:
-		_addElementTo<IntArray>(dst, src, element);
-		break;
-	case Array::UByteArrayType:
-		_addElementTo<UByteArray>(dst, src, element);
-		break;
-	case Array::UShortArrayType:
-		_addElementTo<UShortArray>(dst, src, element);
-		break;
-	case Array::UIntArrayType:
-		_addElementTo<UIntArray>(dst, src, element);
-		break;
-	case Array::Vec4ubArrayType:
-		_addElementTo<Vec4ubArray>(dst, src, element);
-		break;
-	case Array::FloatArrayType:
-		_addElementTo<FloatArray>(dst, src, element);
-		break;
-	case Array::Vec2ArrayType:
-		_addElementTo<Vec2Array>(dst, src, element);
-		break;
-	case Array::Vec3ArrayType:
-		_addElementTo<Vec3Array>(dst, src, element);
-		break;
-	case Array::Vec4ArrayType:
-		_addElementTo<Vec4Array>(dst, src, element);
-		break;
-	case Array::Vec2sArrayType:
-		_addElementTo<Vec2sArray>(dst, src, element);
-		break;
-	case Array::Vec3sArrayType:
-		_addElementTo<Vec3sArray>(dst, src, element);
-		break;
-	case Array::Vec4sArrayType:
-		_addElementTo<Vec4sArray>(dst, src, element);
-		break;
-    case Array::Vec2bArrayType:
-		_addElementTo<Vec2bArray>(dst, src, element);
-		break;
-	case Array::Vec3bArrayType:
-		_addElementTo<Vec3bArray>(dst, src, element);
-		break;
-	case Array::Vec4bArrayType:
-		_addElementTo<Vec4bArray>(dst, src, element);
-		break;
-    case Array::DoubleArrayType:
-		_addElementTo<DoubleArray>(dst, src, element);
-		break;
-	case Array::Vec2dArrayType:
-		_addElementTo<Vec2dArray>(dst, src, element);
-		break;
-	case Array::Vec3dArrayType:
-		_addElementTo<Vec3dArray>(dst, src, element);
-		break;
-	case Array::Vec4dArrayType:
-		_addElementTo<Vec4dArray>(dst, src, element);
-		break;  
-	case Array::MatrixArrayType:
-		_addElementTo<MatrixfArray>(dst, src, element);
-		break;
+		// skip elements that are missing in short arrays
+		if (index < source->size()) { permutedArray->push_back((*source)[index]); }
 	}
-}
 
-template<class ArrayType> void _mergeArrays(osg::ref_ptr<osg::Array> first, osg::ref_ptr<osg::Array> second)
-{
-	ArrayType* _first = dynamic_cast<ArrayType*>(first.get());
-	ArrayType* _second = dynamic_cast<ArrayType*>(second.get());
-
-	_first->reserve(_first->size() + _second->size());
-	_first->insert(_first->end(), _second->begin(), _second->end());
-	_first->dirty();
+	permutedArray->setBinding(array->getBinding());
+	return permutedArray;
 }
 
-void ConvertToLevelOfDetailGeometryVisitor::mergeArrays(osg::ref_ptr<osg::Array> first, osg::ref_ptr<osg::Array> second) const
+ref_ptr<Array> ConvertToLevelOfDetailGeometryVisitor::permuteArray(ref_ptr<Array> array, const vector<unsigned int>& sourceIndices) const
 {
-	// assert that we have an source and destination array, and that they have the same type
-	if (!first || ! second) { return; }
-	if (first->getType() != second->getType()) { return; }
-    if (first->getBinding() != Array::BIND_PER_VERTEX) { return; }
+	// assert that we have an array that is bound per vertex
+	if (!array) { return NULL; }
+    if (array->getBinding() != Array::BIND_PER_VERTEX) { return NULL; }
 
-	switch(first->getType())
+	switch (array->getType())
 	{
 	case Array::ByteArrayType:
-		_mergeArrays<ByteArray>(first, second);
-		break;
+		return _permuteArray<ByteArray>(array, sourceIndices);
 	case Array::ShortArrayType:
-		_mergeArrays<ShortArray>(first, second);
-		break;
+		return _permuteArray<ShortArray>(array, sourceIndices);
 	case Array::IntArrayType:
-		_mergeArrays<IntArray>(first, second);
-		break;
+		return _permuteArray<IntArray>(array, sourceIndices);
 	case Array::UByteArrayType:
-		_mergeArrays<UByteArray>(first, second);
-		break;
+		return _permuteArray<UByteArray>(array, sourceIndices);
 	case Array::UShortArrayType:
-		_mergeArrays<UShortArray>(first, second);
-		break;
+		return _permuteArray<UShortArray>(array, sourceIndices);
 	case Array::UIntArrayType:
-		_mergeArrays<UIntArray>(first, second);
-		break;
+		return _permuteArray<UIntArray>(array, sourceIndices);
 	case Array::Vec4ubArrayType:
-		_mergeArrays<Vec4ubArray>(first, second);
-		break;
+		return _permuteArray<Vec4ubArray>(array, sourceIndices);
 	case Array::FloatArrayType:
-		_mergeArrays<FloatArray>(first, second);
-		break;
+		return _permuteArray<FloatArray>(array, sourceIndices);
 	case Array::Vec2ArrayType:
-		_mergeArrays<Vec2Array>(first, second);
-		break;
+		return _permuteArray<Vec2Array>(array, sourceIndices);
 	case Array::Vec3ArrayType:
-		_mergeArrays<Vec3Array>(first, second);
-		break;
+		return _permuteArray<Vec3Array>(array, sourceIndices);
 	case Array::Vec4ArrayType:
-		_mergeArrays<Vec4Array>(first, second);
-		break;
+		return _permuteArray<Vec4Array>(array, sourceIndices);
 	case Array::Vec2sArrayType:
-		_mergeArrays<Vec2sArray>(first, second);
-		break;
+		return _permuteArray<Vec2sArray>(array, sourceIndices);
 	case Array::Vec3sArrayType:
-		_mergeArrays<Vec3sArray>(first, second);
-		break;
+		return _permuteArray<Vec3sArray>(array, sourceIndices);
 	case Array::Vec4sArrayType:
-		_mergeArrays<Vec4sArray>(first, second);
-		break;
+		return _permuteArray<Vec4sArray>(array, sourceIndices);
     case Array::Vec2bArrayType:
-		_mergeArrays<Vec2bArray>(first, second);
-		break;
+		return _permuteArray<Vec2bArray>(array, sourceIndices);
 	case Array::Vec3bArrayType:
-		_mergeArrays<Vec3bArray>(first, second);
-		break;
+		return _permuteArray<Vec3bArray>(array, sourceIndices);
 	case Array::Vec4bArrayType:
-		_mergeArrays<Vec4bArray>(first, second);
-		break;
+		return _permuteArray<Vec4bArray>(array, sourceIndices);
     case Array::DoubleArrayType:
-		_mergeArrays<DoubleArray>(first, second);
-		break;
+		return _permuteArray<DoubleArray>(array, sourceIndices);
 	case Array::Vec2dArrayType:
-		_mergeArrays<Vec2dArray>(first, second);
-		break;
+		return _permuteArray<Vec2dArray>(array, sourceIndices);
 	case Array::Vec3dArrayType:
-		_mergeArrays<Vec3dArray>(first, second);
-		break;
+		return _permuteArray<Vec3dArray>(array, sourceIndices);
 	case Array::Vec4dArrayType:
-		_mergeArrays<Vec4dArray>(first, second);
-		break;  
+		return _permuteArray<Vec4dArray>(array, sourceIndices);
 	case Array::MatrixArrayType:
-		_mergeArrays<MatrixfArray>(first, second);
-		break;
+		return _permuteArray<MatrixfArray>(array, sourceIndices);
+	default:
+		// unknown array type
+		return NULL;
 	}
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <osg/Array>
 #include <osg/Geode>
@@ -13,6 +14,38 @@ namespace osgUtil
 
 struct HalfEdge;
 
+/**
+ @brief Number of converted triangles and the time in seconds spent in each stage of the conversion
+*/
+struct ConversionStatistics
+{
+	ConversionStatistics()
+		: numGeometries(0)
+		, numTriangles(0)
+		, numWeldedVertices(0)
+		, numNonManifoldEdges(0)
+		, halfEdgeTime(0.0)
+		, oppositeTime(0.0)
+		, protectedVertexTime(0.0)
+		, lodTime(0.0)
+		, wallTime(0.0)
+	{}
+
+	// the stage times are summed over all threads, wallTime is the time the conversion took
+	double getTotalTime() const { return halfEdgeTime + oppositeTime + protectedVertexTime + lodTime; }
+	void add(const ConversionStatistics& rhs);
+
+	size_t numGeometries;
+	size_t numTriangles;
+	size_t numWeldedVertices;
+	size_t numNonManifoldEdges;
+	double halfEdgeTime;
+	double oppositeTime;
+	double protectedVertexTime;
+	double lodTime;
+	double wallTime;
+};
+
 class OSG_EXPORT ConvertToLevelOfDetailGeometryVisitor : public osg::NodeVisitor
 {
 public:
@@ -21,21 +54,36 @@ public:
 	{
 	}
 
+	virtual void apply(osg::Node& node);
 	virtual void apply(osg::Geode& geode);
+
+	// converts the geometries of all geodes the traversal collected on a thread pool and swaps them in,
+	// apply() calls it when it leaves the node the traversal started at
+	void convertCollectedGeometries();
+
+	// statistics of all geometries converted by this visitor
+	const ConversionStatistics& getStatistics() const { return _statistics; }
+	void resetStatistics() { _statistics = ConversionStatistics(); }
 protected:
-	osg::ref_ptr<osg::LevelOfDetailGeometry> convert(osg::ref_ptr<osg::Geometry> geometry) const;
+	// a conversion may use up to maxTasks threads for its stages, the geometries are converted in parallel as well
+	osg::ref_ptr<osg::LevelOfDetailGeometry> convert(osg::ref_ptr<osg::Geometry> geometry, ConversionStatistics& statistics, size_t maxTasks) const;
     bool collectHalfEdges(osg::ref_ptr<osg::Geometry> geometry,
                           osg::ref_ptr<osg::LevelOfDetailGeometry>  lodGeometry,
-                          std::vector<HalfEdge>*      halfEdges) const;
+                          std::vector<HalfEdge>*      halfEdges,
+                          ConversionStatistics& statistics) const;
 	bool collectLod(osg::ref_ptr<osg::Geometry> geometry,
                     float min,
                     float max,
-                    int numProtectedVertices) const;
-	void findHalfEdgeOpposite(std::vector<HalfEdge>* halfEdges) const;
+                    int numProtectedVertices,
+                    size_t maxTasks) const;
+	// returns the number of non-manifold edges, their half edges are linked in the order of the triangles
+	size_t findHalfEdgeOpposite(std::vector<HalfEdge>* halfEdges, size_t maxTasks) const;
     void findAndSortProtectedVertices(osg::ref_ptr<osg::Geometry> geometry, osg::ref_ptr<osg::LevelOfDetailGeometry> lodGeometry, std::vector<HalfEdge>* halfEdges) const;
-	osg::ref_ptr<osg::Array> createArrayOfType(osg::ref_ptr<osg::Array> rhs) const;
-	void addElementTo(osg::ref_ptr<osg::Array> dst, osg::ref_ptr<osg::Array> src, size_t element) const;
-	void mergeArrays(osg::ref_ptr<osg::Array> first, osg::ref_ptr<osg::Array> second) const;
+	// returns a copy of a per vertex array, whose element i is element sourceIndices[i] of array
+	osg::ref_ptr<osg::Array> permuteArray(osg::ref_ptr<osg::Array> array, const std::vector<unsigned int>& sourceIndices) const;
+
+	std::vector<osg::ref_ptr<osg::Geode> > _geodes;
+	ConversionStatistics _statistics;
 };
 
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <cstring>
+#include <cstdint>
 
 // osg
 #include <osg/ref_ptr>
@@ -34,6 +36,90 @@ struct HalfEdge
 	size_t opposite;
 };
 
+/**
+ @brief Assigns the same ID to all vertices with the same position
+
+ Open addressing hash table with linear probing over the exact bits of the position, IDs are assigned in the order
+ in which the positions are first seen. Positive and negative zero are treated as the same position like operator==
+ does.
+*/
+template<class Vector> class VertexWelder
+{
+public:
+	typedef typename Vector::value_type value_type;
+
+	VertexWelder()
+		: _mask(0)
+	{}
+
+	// reserves space for the number of unique positions, so the table doesn't have to grow while welding
+	void reserve(size_t numVertices)
+	{
+		_positions.reserve(numVertices);
+		if (numVertices * 2 > _slots.size()) { rehash(numVertices * 2); }
+	}
+
+	// returns the ID of the position, a new ID if the position wasn't seen before
+	unsigned int weld(const Vector& position)
+	{
+		// keep the table at most half full, so the probe sequences stay short
+		if ((_positions.size() + 1) * 2 > _slots.size()) { rehash((_positions.size() + 1) * 2); }
+
+		for (size_t slot = hash(position) & _mask; ; slot = (slot + 1) & _mask)
+		{
+			unsigned int entry = _slots[slot];
+			if (entry == 0)
+			{
+				// empty slot, the position is new
+				_positions.push_back(position);
+				_slots[slot] = static_cast<unsigned int>(_positions.size());
+				return static_cast<unsigned int>(_positions.size() - 1);
+			}
+			if (_positions[entry - 1] == position)
+			{
+				return entry - 1;
+			}
+		}
+	}
+
+	size_t size() const { return _positions.size(); }
+
+	static size_t hash(const Vector& position)
+	{
+		uint64_t h = 0;
+		for (int i = 0; i < 3; ++i)
+		{
+			// -0 compares equal to 0, so it has to hash to the same slot
+			value_type component = (position[i] == value_type(0)) ? value_type(0) : position[i];
+			uint64_t bits = 0;
+			memcpy(&bits, &component, sizeof(value_type));
+			h = (h ^ bits) * 0x9E3779B97F4A7C15ull;
+			h ^= h >> 29;
+		}
+		return static_cast<size_t>(h);
+	}
+protected:
+	void rehash(size_t minSlots)
+	{
+		size_t numSlots = 16;
+		while (numSlots < minSlots) { numSlots *= 2; }
+
+		// 0 marks an empty slot, all other entries are ID + 1
+		_slots.assign(numSlots, 0);
+		_mask = numSlots - 1;
+		for (size_t i = 0; i < _positions.size(); ++i)
+		{
+			size_t slot = hash(_positions[i]) & _mask;
+			while (_slots[slot] != 0) { slot = (slot + 1) & _mask; }
+			_slots[slot] = static_cast<unsigned int>(i + 1);
+		}
+	}
+
+	std::vector<Vector>			_positions;
+	std::vector<unsigned int>	_slots;
+	size_t						_mask;
+};
+
 /**
  TriangleCollector template to collect half edges and sort triangles for op buffer
 */
@@ -41,41 +127,40 @@ struct HalfEdge
 template<class VertexArray, class Vector> struct HalfEdgeTriangleCollector
 {
 	osg::ref_ptr<VertexArray>				_vertexArray;
-	std::map<Vector, unsigned int>          _vertexIDMap;
-	unsigned int                            _vertexIDCounter;
+	VertexWelder<Vector>					_vertexWelder;
 	std::vector<HalfEdge>*                  _halfEdges;
     osg::ref_ptr<osg::DrawElementsUInt>     _drawElements;
 
     HalfEdgeTriangleCollector()
         : _vertexArray(NULL)
 		, _halfEdges(NULL)
-		, _vertexIDCounter(0)
         , _drawElements(NULL)
     {
 	}
 	                    
     void operator()(unsigned int pos1, unsigned int pos2, unsigned int pos3)
     {
+			const Vector& vertex1 = _vertexArray->at(pos1);
+			const Vector& vertex2 = _vertexArray->at(pos2);
+			const Vector& vertex3 = _vertexArray->at(pos3);
+
 			// skip collapsed triangles
-			if (_vertexArray->at(pos1) == _vertexArray->at(pos2)  ||
-				_vertexArray->at(pos1) == _vertexArray->at(pos3)  ||
-				_vertexArray->at(pos2) == _vertexArray->at(pos3))
+			if (vertex1 == vertex2  ||
+				vertex1 == vertex3  ||
+				vertex2 == vertex3)
 			{
 				return;
 			}
 			
-			// try to find vertices in ID map
-			auto it = _vertexIDMap.find(_vertexArray->at(pos1));
-			if (it == _vertexIDMap.end()) { _vertexIDMap[_vertexArray->at(pos1)] = _vertexIDCounter++; }
-			it = _vertexIDMap.find(_vertexArray->at(pos2));
-			if (it == _vertexIDMap.end()) { _vertexIDMap[_vertexArray->at(pos2)] = _vertexIDCounter++; }
-			it = _vertexIDMap.find(_vertexArray->at(pos3));
-			if (it == _vertexIDMap.end()) { _vertexIDMap[_vertexArray->at(pos3)] = _vertexIDCounter++; }
+			// one lookup per corner, the IDs follow the order in which the positions are first seen
+			unsigned int vertexID1 = _vertexWelder.weld(vertex1);
+			unsigned int vertexID2 = _vertexWelder.weld(vertex2);
+			unsigned int vertexID3 = _vertexWelder.weld(vertex3);
 
 			// add half edges of the triangle
-			_halfEdges->push_back(HalfEdge(_vertexIDMap[_vertexArray->at(pos1)], pos1));
-			_halfEdges->push_back(HalfEdge(_vertexIDMap[_vertexArray->at(pos2)], pos2));
-			_halfEdges->push_back(HalfEdge(_vertexIDMap[_vertexArray->at(pos3)], pos3));
+			_halfEdges->push_back(HalfEdge(vertexID1, pos1));
+			_halfEdges->push_back(HalfEdge(vertexID2, pos2));
+			_halfEdges->push_back(HalfEdge(vertexID3, pos3));
 			size_t lastIndex = _halfEdges->size() - 1;
 			_halfEdges->at(lastIndex-2).next = lastIndex-1;
 			_halfEdges->at(lastIndex-2).prev = lastIndex;
@@ -91,18 +176,17 @@ template<class VertexArray, class Vector> struct HalfEdgeTriangleCollector
     }
 };
 
+/**
+ TriangleCollector template to collect the triangles that are not collapsed, LodTriangleClassifier sorts them by lod
+*/
 template<class VertexArray, class Vector> struct LodTriangleCollector
 {
-    osg::ref_ptr<VertexArray>							_vertexArray;
-	std::vector<osg::ref_ptr<osg::DrawElementsUInt> >*  _lodDrawElements;
-	float _min;
-	float _max;
-    unsigned int _numProtectedVertices;
+    osg::ref_ptr<VertexArray>	_vertexArray;
+	std::vector<unsigned int>*	_triangles;
 
     LodTriangleCollector()
         : _vertexArray(NULL)
-		, _lodDrawElements(NULL)
-        , _numProtectedVertices(0)
+		, _triangles(NULL)
     {		
 	}
 	                    
@@ -115,36 +199,10 @@ template<class VertexArray, class Vector> struct LodTriangleCollector
 			{
 				return;
 			}
-                      
-			
-			// quantize vertices with different precisions to determine the lod, where triangles don't collapse
-			for (int k = 1; k <= 32; ++k)
-			{
-				float precision = pow(2.0f, k);
-				Vector vertices[3] = { _vertexArray->at(pos1),
-									   _vertexArray->at(pos2),
-									   _vertexArray->at(pos3) };
-
-				Vec3ui qVertices[3] = {   quantize(k, _min, _max, vertices[0]),
-									      quantize(k, _min, _max, vertices[1]),
-										  quantize(k, _min, _max, vertices[2]) };
-
-                Vector newVertices[3] = { (pos1 < _numProtectedVertices) ?  vertices[0] : dequantize<Vector>(k, _min, _max, qVertices[0]),
-                                          (pos2 < _numProtectedVertices) ?  vertices[1] : dequantize<Vector>(k, _min, _max, qVertices[1]),
-                                          (pos3 < _numProtectedVertices) ?  vertices[2] : dequantize<Vector>(k, _min, _max, qVertices[2]) };
-
-				if ((newVertices[0] != newVertices[1] &&
-					newVertices[0] != newVertices[2] &&
-					newVertices[1] != newVertices[2]) ||
-                    k == 32)
-				{
-					(*_lodDrawElements)[int(k-1)]->push_back(pos1);
-					(*_lodDrawElements)[int(k-1)]->push_back(pos2);
-					(*_lodDrawElements)[int(k-1)]->push_back(pos3);
-
-					break;
-				}
-			}
+
+			_triangles->push_back(pos1);
+			_triangles->push_back(pos2);
+			_triangles->push_back(pos3);
     }
 };
 
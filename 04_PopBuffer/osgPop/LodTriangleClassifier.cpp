@@ -0,0 +1,114 @@
+#include "LodTriangleClassifier.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOD_CLASSIFIER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace osg;
+
+namespace osgUtil
+{
+
+LodTriangleClassifier::LodTriangleClassifier(float min, float max, unsigned int numProtectedVertices)
+	: _min(min)
+	, _numProtectedVertices(numProtectedVertices)
+{
+	for (int bits = 1; bits <= NUM_LODS; ++bits)
+	{
+		_factors[bits - 1] = quantizationFactor(bits, min, max);
+		_invFactors[bits - 1] = dequantizationFactor(bits, min, max);
+	}
+}
+
+#ifdef LOD_CLASSIFIER_SSE2
+void LodTriangleClassifier::classify(const Vec3* vertices, const unsigned int* indices, size_t numTriangles, unsigned char* lods) const
+{
+	// up to 30 bits the quantized coordinates fit into a signed int, so the packed conversions give the same result as the scalar ones
+	const int maxPackedBits = 30;
+	const __m128 min = _mm_set1_ps(_min);
+	const __m128 half = _mm_set1_ps(0.5f);
+
+	size_t numPackedTriangles = numTriangles & ~size_t(3);
+	for (size_t i = 0; i < numPackedTriangles; i += 4)
+	{
+		// transpose the corners of four triangles, so each lane holds one triangle
+		__m128 corners[3][3];
+		__m128 protectedCorners[3];
+		for (int corner = 0; corner < 3; ++corner)
+		{
+			const unsigned int* triangle = indices + 3 * i + corner;
+			const Vec3& v0 = vertices[triangle[0]];
+			const Vec3& v1 = vertices[triangle[3]];
+			const Vec3& v2 = vertices[triangle[6]];
+			const Vec3& v3 = vertices[triangle[9]];
+			corners[corner][0] = _mm_setr_ps(v0.x(), v1.x(), v2.x(), v3.x());
+			corners[corner][1] = _mm_setr_ps(v0.y(), v1.y(), v2.y(), v3.y());
+			corners[corner][2] = _mm_setr_ps(v0.z(), v1.z(), v2.z(), v3.z());
+			protectedCorners[corner] = _mm_castsi128_ps(_mm_setr_epi32(triangle[0] < _numProtectedVertices ? -1 : 0,
+																	   triangle[3] < _numProtectedVertices ? -1 : 0,
+																	   triangle[6] < _numProtectedVertices ? -1 : 0,
+																	   triangle[9] < _numProtectedVertices ? -1 : 0));
+		}
+
+		int done = 0;
+		for (int bits = 1; bits <= maxPackedBits && done != 0xf; ++bits)
+		{
+			__m128 factor = _mm_set1_ps(_factors[bits - 1]);
+			__m128 invFactor = _mm_set1_ps(_invFactors[bits - 1]);
+
+			__m128 newCorners[3][3];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					__m128i quantized = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(factor, _mm_sub_ps(corners[corner][axis], min)), half));
+					__m128 dequantized = _mm_add_ps(_mm_mul_ps(invFactor, _mm_cvtepi32_ps(quantized)), min);
+					newCorners[corner][axis] = _mm_or_ps(_mm_and_ps(protectedCorners[corner], corners[corner][axis]),
+														 _mm_andnot_ps(protectedCorners[corner], dequantized));
+				}
+			}
+
+			// a triangle survives, if every pair of corners differs in at least one coordinate
+			__m128 survives = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			const int pairs[3][2] = { { 0, 1 }, { 0, 2 }, { 1, 2 } };
+			for (int pair = 0; pair < 3; ++pair)
+			{
+				const __m128* first = newCorners[pairs[pair][0]];
+				const __m128* second = newCorners[pairs[pair][1]];
+				__m128 differs = _mm_or_ps(_mm_or_ps(_mm_cmpneq_ps(first[0], second[0]), _mm_cmpneq_ps(first[1], second[1])), _mm_cmpneq_ps(first[2], second[2]));
+				survives = _mm_and_ps(survives, differs);
+			}
+
+			int newlyDone = _mm_movemask_ps(survives) & ~done;
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				if (newlyDone & (1 << lane)) { lods[i + lane] = static_cast<unsigned char>(bits - 1); }
+			}
+			done |= newlyDone;
+		}
+
+		// the remaining precisions would overflow the packed conversion
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if ((done & (1 << lane)) == 0) { lods[i + lane] = classifyTriangle(vertices, indices + 3 * (i + lane), maxPackedBits + 1); }
+		}
+	}
+
+	for (size_t i = numPackedTriangles; i < numTriangles; ++i)
+	{
+		lods[i] = classifyTriangle(vertices, indices + 3 * i, 1);
+	}
+}
+#else
+void LodTriangleClassifier::classify(const Vec3* vertices, const unsigned int* indices, size_t numTriangles, unsigned char* lods) const
+{
+	for (size_t i = 0; i < numTriangles; ++i)
+	{
+		lods[i] = classifyTriangle(vertices, indices + 3 * i, 1);
+	}
+}
+#endif
+
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "Vec3ui.h"
+
+// std
+#include <cmath>
+
+// osg
+#include <osg/Export>
+#include <osg/Vec3>
+
+namespace osgUtil
+{
+
+/**
+ @brief Computes the lod of triangles, the first quantization precision at which none of the vertices of a triangle collapse
+
+ The factors of all 32 precisions are computed once, so a triangle costs no pow calls. Protected vertices are never
+ quantized. Triangles with float vertices are classified four at a time with SSE2, the result is the same as quantizing
+ and dequantizing each triangle with quantize() and dequantize() one precision after another.
+*/
+class OSG_EXPORT LodTriangleClassifier
+{
+public:
+	static const int NUM_LODS = 32;
+
+	LodTriangleClassifier(float min, float max, unsigned int numProtectedVertices);
+
+	// writes the lod(precision - 1) of every triangle of indices, the triangles must not be collapsed
+	template<class Vector> void classify(const Vector* vertices, const unsigned int* indices, size_t numTriangles, unsigned char* lods) const
+	{
+		for (size_t i = 0; i < numTriangles; ++i)
+		{
+			lods[i] = classifyTriangle(vertices, indices + 3 * i, 1);
+		}
+	}
+
+	void classify(const osg::Vec3* vertices, const unsigned int* indices, size_t numTriangles, unsigned char* lods) const;
+
+	// tries the precisions from firstBits on, the last precision is always accepted
+	template<class Vector> unsigned char classifyTriangle(const Vector* vertices, const unsigned int* triangle, int firstBits) const
+	{
+		for (int bits = firstBits; bits < NUM_LODS; ++bits)
+		{
+			Vector newVertices[3];
+			for (int i = 0; i < 3; ++i)
+			{
+				const Vector& vertex = vertices[triangle[i]];
+				newVertices[i] = (triangle[i] < _numProtectedVertices) ? vertex : requantize(bits, vertex);
+			}
+
+			if (newVertices[0] != newVertices[1] &&
+				newVertices[0] != newVertices[2] &&
+				newVertices[1] != newVertices[2])
+			{
+				return static_cast<unsigned char>(bits - 1);
+			}
+		}
+
+		return NUM_LODS - 1;
+	}
+
+	// quantizes and dequantizes a vertex, the same as dequantize(bits, min, max, quantize(bits, min, max, vertex))
+	template<class Vector> Vector requantize(int bits, const Vector& vertex) const
+	{
+		float factor = _factors[bits - 1];
+		float invFactor = _invFactors[bits - 1];
+		return Vector(invFactor * static_cast<unsigned int>(factor * (vertex.x() - _min) + 0.5f) + _min,
+					  invFactor * static_cast<unsigned int>(factor * (vertex.y() - _min) + 0.5f) + _min,
+					  invFactor * static_cast<unsigned int>(factor * (vertex.z() - _min) + 0.5f) + _min);
+	}
+protected:
+	float _min;
+	unsigned int _numProtectedVertices;
+	float _factors[NUM_LODS];
+	float _invFactors[NUM_LODS];
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+// std
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+namespace osgUtil
+{
+
+inline size_t getNumCores()
+{
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/**
+ @brief number of tasks to split the items into, so every task gets at least minItemsPerTask items and there is at most one task per core
+*/
+inline size_t getNumTasks(size_t numItems, size_t minItemsPerTask)
+{
+	return std::max<size_t>(std::min(getNumCores(), numItems / std::max<size_t>(minItemsPerTask, 1)), 1);
+}
+
+/**
+ @brief calls function(task, begin, end) for each task on its own thread, task t gets the items [t * numItems / numTasks, (t + 1) * numItems / numTasks)
+
+ The first task runs on the calling thread, so a single task doesn't start any thread.
+*/
+template<class Function> void parallelFor(size_t numTasks, size_t numItems, const Function& function)
+{
+	std::vector<std::thread> threads;
+	threads.reserve(numTasks);
+	for (size_t task = 1; task < numTasks; ++task)
+	{
+		threads.push_back(std::thread(function, task, task * numItems / numTasks, (task + 1) * numItems / numTasks));
+	}
+
+	function(size_t(0), size_t(0), numItems / numTasks);
+
+	for (auto& thread: threads)
+	{
+		thread.join();
+	}
+}
+
+}
\ No newline at end of file
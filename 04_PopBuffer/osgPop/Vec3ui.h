@@ -1,5 +1,8 @@
 #pragma once
 
+// std
+#include <cmath>
+
 namespace osgUtil
 {
 
@@ -50,21 +53,34 @@ protected:
 };
 
 
+/**
+ @brief factors between positions and quantized positions of a precision, LodTriangleClassifier tabulates them once per geometry
+*/
+inline float quantizationFactor(int bits, float min, float max)
+{
+	return (std::pow(2.0f, bits) - 1.0f) / (max-min);
+}
+
+inline float dequantizationFactor(int bits, float min, float max)
+{
+	return (max-min)/std::pow(2.0f, bits);
+}
+
 /**
  @brief quantizes vertex position with different bit precissions(used for vertex clustering)
 */
 template<class Vector> Vec3ui quantize(int bits, float min, float max, const Vector& vertex)
 {
-	float factor = (pow(2.0f, bits) - 1.0f) / (max-min);
+	float factor = quantizationFactor(bits, min, max);
 
-	return Vec3ui(	unsigned int(factor * (vertex.x() - min) + 0.5f),
-					unsigned int(factor * (vertex.y() - min) + 0.5f),
-					unsigned int(factor * (vertex.z() - min) + 0.5f));
+	return Vec3ui(	static_cast<unsigned int>(factor * (vertex.x() - min) + 0.5f),
+					static_cast<unsigned int>(factor * (vertex.y() - min) + 0.5f),
+					static_cast<unsigned int>(factor * (vertex.z() - min) + 0.5f));
 }
 
 template<class Vector> Vector dequantize(int bits, float min, float max, const Vec3ui& vertex)
 {
-	float invFactor = (max-min)/pow(2.0f, bits);
+	float invFactor = dequantizationFactor(bits, min, max);
 
 	return Vector(  invFactor * vertex.x() + min,
 					invFactor * vertex.y() + min,
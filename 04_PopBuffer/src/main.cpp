@@ -26,9 +26,15 @@
 #include <cmath>
 #include <fstream>
 #include <sstream>
+#include <iostream>
+#include <map>
+#include <algorithm>
 
 #include "LevelOfDetailGeometry.h"
 #include "ConvertToLevelOfDetailGeometryVisitor.h"
+#include "HalfEdge.h"
+#include "LodTriangleClassifier.h"
+#include "ParallelFor.h"
 #include "AddTextureUniformVisitor.h"
 #include "DemoEventHandler.h"
 #include "KdTreeVisitor.h"
@@ -42,6 +48,8 @@
 #include <osgDB/ReadFile>
 #include <osgDB/WriteFile>
 #include <osg/CullFace>
+#include <osg/Timer>
+#include <osg/TriangleIndexFunctor>
 
 osg::Shader* loadShaderAndAddPrelude(const std::string& fileName, const std::string& uniformDefintion, const std::string& functionDefinition)
 {
@@ -75,9 +83,247 @@ osg::Shader* loadShaderAndAddPrelude(const std::string& fileName, const std::str
     return vertexShader;
 }
 
+/**
+ Collects all geometries below a node
+*/
+class CollectGeometriesVisitor : public osg::NodeVisitor
+{
+public:
+    CollectGeometriesVisitor()
+        : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN)
+    {}
+
+    virtual void apply(osg::Geode& geode)
+    {
+        for (size_t i = 0; i < geode.getNumDrawables(); ++i)
+        {
+            osg::Geometry* geometry = dynamic_cast<osg::Geometry*>(geode.getDrawable(i));
+            if (geometry) { _geometries.push_back(geometry); }
+        }
+    }
+
+    std::vector<osg::ref_ptr<osg::Geometry> > _geometries;
+};
+
+/**
+ Welds the corners of all triangles like HalfEdgeTriangleCollector, once with the std::map it used before and once with the VertexWelder
+*/
+struct WeldingBenchmarkCollector
+{
+    osg::ref_ptr<osg::Vec3Array>        _vertexArray;
+    std::map<osg::Vec3, unsigned int>*  _vertexIDMap;
+    osgUtil::VertexWelder<osg::Vec3>*   _vertexWelder;
+    size_t                              _numTriangles;
+    size_t                              _checksum;
+
+    WeldingBenchmarkCollector()
+        : _vertexIDMap(NULL)
+        , _vertexWelder(NULL)
+        , _numTriangles(0)
+        , _checksum(0)
+    {}
+
+    unsigned int weld(const osg::Vec3& vertex)
+    {
+        if (_vertexWelder) { return _vertexWelder->weld(vertex); }
+
+        auto it = _vertexIDMap->find(vertex);
+        if (it == _vertexIDMap->end()) { unsigned int id = _vertexIDMap->size(); (*_vertexIDMap)[vertex] = id; }
+        return (*_vertexIDMap)[vertex];
+    }
+
+    void operator()(unsigned int pos1, unsigned int pos2, unsigned int pos3)
+    {
+        _checksum += weld(_vertexArray->at(pos1)) + weld(_vertexArray->at(pos2)) + weld(_vertexArray->at(pos3));
+        _numTriangles++;
+    }
+};
+
+double benchmarkWelding(const std::vector<osg::ref_ptr<osg::Geometry> >& geometries, bool hashWelding, size_t& numTriangles)
+{
+    numTriangles = 0;
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    for (auto geometry: geometries)
+    {
+        osg::TriangleIndexFunctor<WeldingBenchmarkCollector> collector;
+        collector._vertexArray = dynamic_cast<osg::Vec3Array*>(geometry->getVertexArray());
+        if (!collector._vertexArray) { continue; }
+
+        std::map<osg::Vec3, unsigned int> vertexIDMap;
+        osgUtil::VertexWelder<osg::Vec3> vertexWelder;
+        if (hashWelding)
+        {
+            vertexWelder.reserve(collector._vertexArray->size());
+            collector._vertexWelder = &vertexWelder;
+        } else {
+            collector._vertexIDMap = &vertexIDMap;
+        }
+        geometry->accept(collector);
+        numTriangles += collector._numTriangles;
+    }
+    return osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick());
+}
+
+// lod of a triangle like LodTriangleCollector computed it before, by quantizing with one precision after another
+unsigned char referenceLod(const osg::Vec3* vertices, const unsigned int* triangle, float min, float max, unsigned int numProtectedVertices)
+{
+    for (int k = 1; k < 32; ++k)
+    {
+        osg::Vec3 newVertices[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            const osg::Vec3& vertex = vertices[triangle[i]];
+            newVertices[i] = (triangle[i] < numProtectedVertices) ? vertex : osgUtil::dequantize<osg::Vec3>(k, min, max, osgUtil::quantize(k, min, max, vertex));
+        }
+
+        if (newVertices[0] != newVertices[1] && newVertices[0] != newVertices[2] && newVertices[1] != newVertices[2])
+        {
+            return k - 1;
+        }
+    }
+    return 31;
+}
+
+void benchmarkLodClassification(const std::vector<osg::ref_ptr<osg::Geometry> >& geometries)
+{
+    double referenceTime = 0.0;
+    double classifierTime = 0.0;
+    size_t numTriangles = 0;
+    size_t numDifferent = 0;
+    for (auto geometry: geometries)
+    {
+        osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>(geometry->getVertexArray());
+        if (!vertices || vertices->empty()) { continue; }
+
+        std::vector<unsigned int> triangles;
+        osg::TriangleIndexFunctor<osgUtil::LodTriangleCollector<osg::Vec3Array, osg::Vec3> > collector;
+        collector._vertexArray = vertices;
+        collector._triangles = &triangles;
+        geometry->accept(collector);
+        size_t count = triangles.size() / 3;
+        if (count == 0) { continue; }
+
+        // the first quarter of the vertices stands in for the protected vertices, so both paths are measured
+        osg::BoundingBox bounds = geometry->getBound();
+        float min = std::min(bounds.xMin(), std::min(bounds.yMin(), bounds.zMin()));
+        float max = std::max(bounds.xMax(), std::max(bounds.yMax(), bounds.zMax()));
+        unsigned int numProtectedVertices = vertices->size() / 4;
+
+        std::vector<unsigned char> referenceLods(count);
+        osg::Timer_t start = osg::Timer::instance()->tick();
+        for (size_t i = 0; i < count; ++i)
+        {
+            referenceLods[i] = referenceLod(&vertices->front(), &triangles[3 * i], min, max, numProtectedVertices);
+        }
+        osg::Timer_t referenceEnd = osg::Timer::instance()->tick();
+
+        std::vector<unsigned char> lods(count);
+        osgUtil::LodTriangleClassifier classifier(min, max, numProtectedVertices);
+        classifier.classify(&vertices->front(), &triangles[0], count, &lods[0]);
+        osg::Timer_t classifierEnd = osg::Timer::instance()->tick();
+
+        referenceTime += osg::Timer::instance()->delta_s(start, referenceEnd);
+        classifierTime += osg::Timer::instance()->delta_s(referenceEnd, classifierEnd);
+        numTriangles += count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (lods[i] != referenceLods[i]) { numDifferent++; }
+        }
+    }
+
+    std::cout << "Lod classification of " << numTriangles << " triangles(Vec3 vertices only): per precision " << numTriangles / referenceTime
+              << " triangles/s, single pass " << numTriangles / classifierTime << " triangles/s(" << referenceTime / classifierTime << "x), "
+              << numDifferent << " different lods" << std::endl;
+}
+
+osg::ref_ptr<osg::Node> createBenchmarkGrid(unsigned int size)
+{
+    // unindexed triangles, so every position is shared by up to six vertices that have to be welded
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array();
+    vertices->reserve(size * size * 6);
+    for (unsigned int y = 0; y < size; ++y)
+    {
+        for (unsigned int x = 0; x < size; ++x)
+        {
+            osg::Vec3 corners[4] = { osg::Vec3(x, y, sinf(x * 0.1f) * cosf(y * 0.1f)),
+                                     osg::Vec3(x + 1, y, sinf((x + 1) * 0.1f) * cosf(y * 0.1f)),
+                                     osg::Vec3(x, y + 1, sinf(x * 0.1f) * cosf((y + 1) * 0.1f)),
+                                     osg::Vec3(x + 1, y + 1, sinf((x + 1) * 0.1f) * cosf((y + 1) * 0.1f)) };
+            vertices->push_back(corners[0]);
+            vertices->push_back(corners[1]);
+            vertices->push_back(corners[2]);
+            vertices->push_back(corners[2]);
+            vertices->push_back(corners[1]);
+            vertices->push_back(corners[3]);
+        }
+    }
+
+    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry();
+    geometry->setVertexArray(vertices);
+    geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLES, 0, vertices->size()));
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode();
+    geode->addDrawable(geometry);
+    return geode;
+}
+
+int benchmarkConversion(osg::ref_ptr<osg::Node> model, unsigned int iterations, int maxVertices)
+{
+    osgUtil::ConvertToLevelOfDetailGeometryVisitor lodVisitor;
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+        osg::ref_ptr<osg::Node> optimizedModel = dynamic_cast<osg::Node*>(model->clone(osg::CopyOp::DEEP_COPY_ALL));
+        if (maxVertices > 0)
+        {
+            osgExample::KdTreeVisitor kdVisitor(maxVertices);
+            optimizedModel->accept(kdVisitor);
+        }
+        optimizedModel->accept(lodVisitor);
+    }
+
+    const osgUtil::ConversionStatistics& statistics = lodVisitor.getStatistics();
+    double triangles = (double)statistics.numTriangles;
+    std::cout << "Converted " << statistics.numTriangles / iterations << " triangles of " << statistics.numGeometries / iterations
+              << " geometries " << iterations << " times on " << osgUtil::getNumCores() << " cores: " << triangles / statistics.wallTime << " triangles/s" << std::endl;
+    std::cout << "Time per stage summed over all threads:" << std::endl;
+    std::cout << "  half edges and welding: " << statistics.halfEdgeTime / iterations << " s, " << triangles / statistics.halfEdgeTime << " triangles/s, "
+              << statistics.numWeldedVertices / iterations << " unique positions" << std::endl;
+    std::cout << "  opposite half edges:    " << statistics.oppositeTime / iterations << " s, " << triangles / statistics.oppositeTime << " triangles/s, "
+              << statistics.numNonManifoldEdges / iterations << " non-manifold edges" << std::endl;
+    std::cout << "  protected vertices:     " << statistics.protectedVertexTime / iterations << " s, " << triangles / statistics.protectedVertexTime << " triangles/s" << std::endl;
+    std::cout << "  lod classification:     " << statistics.lodTime / iterations << " s, " << triangles / statistics.lodTime << " triangles/s" << std::endl;
+
+    // compare the welding alone against the std::map the half edge collector used before
+    CollectGeometriesVisitor geometryVisitor;
+    model->accept(geometryVisitor);
+    size_t numTriangles = 0;
+    double mapTime = benchmarkWelding(geometryVisitor._geometries, false, numTriangles);
+    double hashTime = benchmarkWelding(geometryVisitor._geometries, true, numTriangles);
+    std::cout << "Welding " << numTriangles << " triangles(Vec3 vertices only): std::map " << numTriangles / mapTime << " triangles/s, hash "
+              << numTriangles / hashTime << " triangles/s(" << mapTime / hashTime << "x)" << std::endl;
+
+    // compare the lods against trying every precision per triangle
+    benchmarkLodClassification(geometryVisitor._geometries);
+
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
 	osg::ArgumentParser arguments(&argc, argv);
+
+    // benchmark the conversion to pop buffers with a model or a generated grid with two million triangles
+    unsigned int iterations = 1;
+    if (arguments.read("--benchmark-conversion", iterations) || arguments.read("--benchmark-conversion"))
+    {
+        int maxVertices = 0;
+        arguments.read("--optimize", maxVertices);
+        osg::ref_ptr<osg::Node> model = (arguments.argc() > 1) ? osgDB::readNodeFile(arguments[1]) : createBenchmarkGrid(1024);
+        if (!model) { return -1; }
+
+        return benchmarkConversion(model, std::max(iterations, 1u), maxVertices);
+    }
+
 	osg::ref_ptr<osgViewer::Viewer> viewer = new osgViewer::Viewer;
 
 	viewer->setUpViewInWindow(100, 100, 800, 600);